@@ -11,6 +11,7 @@
 #include "kvm/devices.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm.h"
+#include "kvm/numa.h"
 #include "kvm/virtio-mmio.h"
 
 static void dump_fdt(const char *dtb_file, void *fdt) {
@@ -52,6 +53,7 @@ static void generate_cpu_nodes(void *fdt, struct kvm *kvm) {
             _FDT(fdt_property_string(fdt, "enable-method", "psci"));
 
         _FDT(fdt_property_cell(fdt, "reg", mpidr));
+        kvm_numa_generate_fdt_cpu(fdt, kvm, cpu);
         _FDT(fdt_end_node(fdt));
     }
 
@@ -141,10 +143,14 @@ static int setup_fdt(struct kvm *kvm) {
     _FDT(fdt_end_node(fdt));
 
     /* Memory */
-    _FDT(fdt_begin_node(fdt, "memory"));
-    _FDT(fdt_property_string(fdt, "device_type", "memory"));
-    _FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
-    _FDT(fdt_end_node(fdt));
+    if (kvm->numa) {
+        kvm_numa_generate_fdt_memory(fdt, kvm);
+    } else {
+        _FDT(fdt_begin_node(fdt, "memory"));
+        _FDT(fdt_property_string(fdt, "device_type", "memory"));
+        _FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+        _FDT(fdt_end_node(fdt));
+    }
 
     /* CPU and peripherals (interrupt controller, timers, etc) */
     generate_cpu_nodes(fdt, kvm);
@@ -7,6 +7,7 @@
 #include "arm-common/gic.h"
 #include "kvm/8250-serial.h"
 #include "kvm/fdt.h"
+#include "kvm/numa.h"
 #include "kvm/term.h"
 #include "kvm/util.h"
 #include "kvm/virtio-console.h"
@@ -15,6 +16,7 @@ struct kvm_ext kvm_req_ext[] = {
     {DEFINE_KVM_EXT(KVM_CAP_IRQCHIP)},
     {DEFINE_KVM_EXT(KVM_CAP_ONE_REG)},
     {DEFINE_KVM_EXT(KVM_CAP_ARM_PSCI)},
+    {DEFINE_KVM_EXT(KVM_CAP_IMMEDIATE_EXIT)},
     {0, 0},
 };
 
@@ -45,7 +47,7 @@ void kvm_init_ram(struct kvm *kvm) {
 
     kvm->ram_start = (void *)ALIGN((unsigned long)kvm->arch.ram_alloc_start, SZ_2M);
 
-    madvise(kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size, MADV_MERGEABLE);
+    kvm_advise_ram(kvm, kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size);
 
     madvise(kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size, MADV_HUGEPAGE);
 
@@ -53,7 +55,7 @@ void kvm_init_ram(struct kvm *kvm) {
     phys_size = kvm->ram_size;
     host_mem = kvm->ram_start;
 
-    err = kvm_register_ram(kvm, phys_start, phys_size, host_mem);
+    err = kvm_numa_register_ram(kvm, phys_start, phys_size, host_mem);
     if (err)
         die("Failed to register %lld bytes of memory at physical "
             "address 0x%llx [err %d]",
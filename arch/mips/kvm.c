@@ -9,7 +9,7 @@
 #include "kvm/ioport.h"
 #include "kvm/virtio-console.h"
 
-struct kvm_ext kvm_req_ext[] = {{0, 0}};
+struct kvm_ext kvm_req_ext[] = {{DEFINE_KVM_EXT(KVM_CAP_IMMEDIATE_EXIT)}, {0, 0}};
 
 u64 kvm_arch_default_ram_address(void) {
     return 0;
@@ -67,7 +67,7 @@ void kvm_arch_init(struct kvm *kvm) {
     if (kvm->ram_start == MAP_FAILED)
         die("out of memory");
 
-    madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
+    kvm_advise_ram(kvm, kvm->ram_start, kvm->ram_size);
 
     ret = ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP);
     if (ret < 0)
@@ -41,7 +41,10 @@
 static char kern_cmdline[2048];
 
 struct kvm_ext kvm_req_ext[] = {
-    {DEFINE_KVM_EXT(KVM_CAP_PPC_UNSET_IRQ)}, {DEFINE_KVM_EXT(KVM_CAP_PPC_IRQ_LEVEL)}, {0, 0}};
+    {DEFINE_KVM_EXT(KVM_CAP_PPC_UNSET_IRQ)},
+    {DEFINE_KVM_EXT(KVM_CAP_PPC_IRQ_LEVEL)},
+    {DEFINE_KVM_EXT(KVM_CAP_IMMEDIATE_EXIT)},
+    {0, 0}};
 
 u64 kvm_arch_default_ram_address(void) {
     return 0;
@@ -106,7 +109,7 @@ void kvm_arch_init(struct kvm *kvm) {
     kvm->arch.fdt_gra = kvm->ram_size - FDT_MAX_SIZE;
     /* FIXME: Not all PPC systems have RTAS */
     kvm->arch.rtas_gra = kvm->arch.fdt_gra - RTAS_MAX_SIZE;
-    madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
+    kvm_advise_ram(kvm, kvm->ram_start, kvm->ram_size);
 
     /* FIXME:  SPAPR-PR specific; allocate a guest HPT. */
     if (posix_memalign((void **)&hpt, (1 << HPT_ORDER), (1 << HPT_ORDER)))
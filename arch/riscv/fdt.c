@@ -8,6 +8,7 @@
 #include "kvm/devices.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm.h"
+#include "kvm/numa.h"
 
 struct isa_ext_info {
     const char *name;
@@ -188,6 +189,7 @@ static void generate_cpu_nodes(void *fdt, struct kvm *kvm) {
         if (cboz_blksz)
             _FDT(fdt_property_cell(fdt, "riscv,cboz-block-size", cboz_blksz));
         _FDT(fdt_property_cell(fdt, "reg", cpu));
+        kvm_numa_generate_fdt_cpu(fdt, kvm, cpu);
         _FDT(fdt_property_string(fdt, "status", "okay"));
 
         _FDT(fdt_begin_node(fdt, "interrupt-controller"));
@@ -249,10 +251,14 @@ static int setup_fdt(struct kvm *kvm) {
     _FDT(fdt_end_node(fdt));
 
     /* Memory */
-    _FDT(fdt_begin_node(fdt, "memory"));
-    _FDT(fdt_property_string(fdt, "device_type", "memory"));
-    _FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
-    _FDT(fdt_end_node(fdt));
+    if (kvm->numa) {
+        kvm_numa_generate_fdt_memory(fdt, kvm);
+    } else {
+        _FDT(fdt_begin_node(fdt, "memory"));
+        _FDT(fdt_property_string(fdt, "device_type", "memory"));
+        _FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+        _FDT(fdt_end_node(fdt));
+    }
 
     /* CPUs */
     generate_cpu_nodes(fdt, kvm);
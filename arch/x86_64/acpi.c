@@ -0,0 +1,204 @@
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <string.h>
+
+#include "kvm/bios.h"
+#include "kvm/kvm.h"
+#include "kvm/numa.h"
+#include "kvm/util.h"
+
+/*
+ * The guest boots with the MP table rather than ACPI. These tables only
+ * describe its NUMA topology: the RSDP and RSDT Linux finds them through,
+ * the SRAT placing vCPUs and RAM in nodes, and the SLIT with the distances
+ * between nodes. Without a MADT Linux keeps using the MP table.
+ */
+
+#define ACPI_OEM_ID       "KVMTLS"
+#define ACPI_OEM_TABLE_ID "KVMTOOL "
+#define ACPI_CREATOR_ID   "KVMT"
+
+#define ACPI_SRAT_CPU_ENABLED (1 << 0)
+#define ACPI_SRAT_MEM_ENABLED (1 << 0)
+
+struct acpi_rsdp {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_address;
+} __attribute__((packed));
+
+struct acpi_table_header {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    char creator_id[4];
+    u32 creator_revision;
+} __attribute__((packed));
+
+struct acpi_srat {
+    struct acpi_table_header header;
+    u32 table_revision;
+    u64 reserved;
+} __attribute__((packed));
+
+struct acpi_srat_cpu_affinity {
+    u8 type;
+    u8 length;
+    u8 proximity_domain_lo;
+    u8 apic_id;
+    u32 flags;
+    u8 local_sapic_eid;
+    u8 proximity_domain_hi[3];
+    u32 clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem_affinity {
+    u8 type;
+    u8 length;
+    u32 proximity_domain;
+    u16 reserved1;
+    u64 base_address;
+    u64 length_bytes;
+    u32 reserved2;
+    u32 flags;
+    u64 reserved3;
+} __attribute__((packed));
+
+struct acpi_slit {
+    struct acpi_table_header header;
+    u64 locality_count;
+    u8 entry[];
+} __attribute__((packed));
+
+enum {
+    ACPI_SRAT_TYPE_CPU_AFFINITY = 0,
+    ACPI_SRAT_TYPE_MEMORY_AFFINITY = 1,
+};
+
+static u8 acpi_checksum(void *table, u32 len) {
+    u8 *p = table, sum = 0;
+
+    while (len--) sum += *p++;
+
+    return -sum;
+}
+
+static void acpi_init_header(struct acpi_table_header *header, const char *signature, u32 length, u8 revision) {
+    memcpy(header->signature, signature, sizeof(header->signature));
+    header->length = length;
+    header->revision = revision;
+    memcpy(header->oem_id, ACPI_OEM_ID, sizeof(header->oem_id));
+    memcpy(header->oem_table_id, ACPI_OEM_TABLE_ID, sizeof(header->oem_table_id));
+    header->oem_revision = 1;
+    memcpy(header->creator_id, ACPI_CREATOR_ID, sizeof(header->creator_id));
+    header->creator_revision = 1;
+    header->checksum = acpi_checksum(header, length);
+}
+
+static u32 acpi_build_srat(struct kvm *kvm, struct acpi_srat *srat) {
+    struct acpi_srat_mem_affinity *mem;
+    struct acpi_srat_cpu_affinity *cpu;
+    struct kvm_numa *numa = kvm->numa;
+    struct kvm_numa_range *range;
+    void *p = &srat[1];
+    int i, j, node;
+
+    for (i = 0; i < kvm->nrcpus; i++) {
+        node = kvm_numa_vcpu_node(kvm, i);
+        cpu = p;
+        *cpu = (struct acpi_srat_cpu_affinity){
+            .type = ACPI_SRAT_TYPE_CPU_AFFINITY,
+            .length = sizeof(*cpu),
+            .proximity_domain_lo = node,
+            /* As in the MP table */
+            .apic_id = i,
+            .flags = ACPI_SRAT_CPU_ENABLED,
+        };
+        p += sizeof(*cpu);
+    }
+
+    for (i = 0; i < numa->nr_nodes; i++) {
+        for (j = 0; j < numa->nodes[i].nr_ranges; j++) {
+            range = &numa->nodes[i].ranges[j];
+            mem = p;
+            *mem = (struct acpi_srat_mem_affinity){
+                .type = ACPI_SRAT_TYPE_MEMORY_AFFINITY,
+                .length = sizeof(*mem),
+                .proximity_domain = i,
+                .base_address = range->guest_phys,
+                .length_bytes = range->size,
+                .flags = ACPI_SRAT_MEM_ENABLED,
+            };
+            p += sizeof(*mem);
+        }
+    }
+
+    srat->table_revision = 1;
+    acpi_init_header(&srat->header, "SRAT", p - (void *)srat, 3);
+
+    return srat->header.length;
+}
+
+static u32 acpi_build_slit(struct kvm *kvm, struct acpi_slit *slit) {
+    struct kvm_numa *numa = kvm->numa;
+    int i, j;
+
+    slit->locality_count = numa->nr_nodes;
+    for (i = 0; i < numa->nr_nodes; i++)
+        for (j = 0; j < numa->nr_nodes; j++) slit->entry[i * numa->nr_nodes + j] = numa->distance[i][j];
+
+    acpi_init_header(&slit->header, "SLIT", sizeof(*slit) + numa->nr_nodes * numa->nr_nodes, 1);
+
+    return slit->header.length;
+}
+
+int acpi__init(struct kvm *kvm) {
+    struct acpi_table_header *rsdt;
+    struct acpi_rsdp *rsdp;
+    u32 *entries, srat, slit, end;
+    void *base;
+
+    /* Firmware brings its own tables, where these would go */
+    if (!kvm->numa || kvm->cfg.firmware_filename)
+        return 0;
+
+    /* Headers, RSDT and SLIT take well under 4K, the SRAT grows with vCPUs */
+    if (kvm->nrcpus * sizeof(struct acpi_srat_cpu_affinity) +
+            KVM_NUMA_MAX_NODES * KVM_NUMA_MAX_RANGES * sizeof(struct acpi_srat_mem_affinity) + SZ_4K >
+        ACPI_TABLES_SIZE) {
+        pr_err("Too many vCPUs to describe in ACPI tables");
+        return -E2BIG;
+    }
+
+    base = guest_flat_to_host(kvm, ACPI_TABLES_BEGIN);
+    memset(base, 0, ACPI_TABLES_SIZE);
+
+    /* The RSDP first, on the 16 byte boundary the guest scans for it */
+    rsdp = base;
+    rsdt = base + ALIGN(sizeof(*rsdp), 16);
+    entries = (void *)&rsdt[1];
+
+    srat = ALIGN((void *)&entries[2] - base, 16);
+    slit = ALIGN(srat + acpi_build_srat(kvm, base + srat), 16);
+    end = slit + acpi_build_slit(kvm, base + slit);
+
+    entries[0] = ACPI_TABLES_BEGIN + srat;
+    entries[1] = ACPI_TABLES_BEGIN + slit;
+    acpi_init_header(rsdt, "RSDT", sizeof(*rsdt) + 2 * sizeof(*entries), 1);
+
+    memcpy(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature));
+    memcpy(rsdp->oem_id, ACPI_OEM_ID, sizeof(rsdp->oem_id));
+    rsdp->rsdt_address = ACPI_TABLES_BEGIN + ((void *)rsdt - base);
+    rsdp->checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+
+    pr_debug("ACPI tables at 0x%x-0x%x", ACPI_TABLES_BEGIN, ACPI_TABLES_BEGIN + end - 1);
+
+    return 0;
+}
+firmware_init(acpi__init);
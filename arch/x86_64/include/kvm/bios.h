@@ -36,6 +36,11 @@
 #define MB_BIOS_SIZE            (MB_BIOS_END - MB_BIOS_BEGIN + 1)
 #define MB_FIRMWARE_BIOS_SIZE   (MB_BIOS_END - MB_FIRMWARE_BIOS_BEGIN + 1)
 
+/* Only used without a firmware image, which would live there */
+#define ACPI_TABLES_BEGIN       0x000e0000
+#define ACPI_TABLES_END         0x000effff
+#define ACPI_TABLES_SIZE        (ACPI_TABLES_END - ACPI_TABLES_BEGIN + 1)
+
 #define VGA_RAM_BEGIN           0x000a0000
 #define VGA_RAM_END             0x000bffff
 
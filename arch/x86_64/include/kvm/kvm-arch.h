@@ -39,6 +39,12 @@ struct kvm_arch {
     u16 boot_sp;
 
     struct interrupt_table interrupt_table;
+
+    /* Size of the bzImage command line buffer, 0 when there is none */
+    u32 cmdline_size;
 };
 
+struct kvm;
+void kvm_arch_append_cmdline(struct kvm *kvm, const char *param);
+
 #endif /* KVM__KVM_ARCH_H */
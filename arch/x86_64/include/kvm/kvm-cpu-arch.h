@@ -18,6 +18,7 @@ struct kvm_cpu {
 
     struct kvm *kvm; /* parent KVM */
     int vcpu_fd;     /* For VCPU ioctls() */
+    int stats_fd;    /* KVM binary stats, read by kvm_stats_report() */
     struct kvm_run *kvm_run;
     struct kvm_cpu_task *task;
 
@@ -29,6 +30,8 @@ struct kvm_cpu {
 
     u8 is_running;
     u8 paused;
+    u8 in_guest; /* In KVM_RUN or about to enter it, see kvm_cpu__kick() */
+    unsigned long requests; /* KVM_CPU_REQ_* bits */
     u8 needs_nmi;
 
     struct kvm_coalesced_mmio_ring *ring;
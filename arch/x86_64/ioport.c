@@ -107,7 +107,7 @@ static int ioport__setup_arch(struct kvm *kvm) {
         return r;
 
     /* PORT 00ED - DUMMY PORT FOR DELAY??? */
-    r = kvm_register_pio(kvm, 0x00ed, 1, dummy_io, NULL);
+    r = kvm_register_iotrap(kvm, 0x00ed, 1, dummy_io, NULL, DEVICE_BUS_IOPORT | IOTRAP_COALESCE);
     if (r < 0)
         return r;
 
@@ -135,7 +135,8 @@ static int ioport__setup_arch(struct kvm *kvm) {
     if (r < 0)
         return r;
 
-    r = kvm_register_pio(kvm, 0x0402, 1, seabios_debug_io, NULL);
+    /* 0402 - SeaBIOS debug console, output only so it can wait for the next exit */
+    r = kvm_register_iotrap(kvm, 0x0402, 1, seabios_debug_io, NULL, DEVICE_BUS_IOPORT | IOTRAP_COALESCE);
     if (r < 0)
         return r;
 
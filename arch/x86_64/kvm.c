@@ -19,6 +19,7 @@
 #include "kvm/cpufeature.h"
 #include "kvm/interrupt.h"
 #include "kvm/mptable.h"
+#include "kvm/numa.h"
 #include "kvm/util.h"
 #include "kvm/virtio-console.h"
 
@@ -31,6 +32,7 @@ struct kvm_ext kvm_req_ext[] = {{DEFINE_KVM_EXT(KVM_CAP_COALESCED_MMIO)},
                                 {DEFINE_KVM_EXT(KVM_CAP_HLT)},
                                 {DEFINE_KVM_EXT(KVM_CAP_IRQ_INJECT_STATUS)},
                                 {DEFINE_KVM_EXT(KVM_CAP_EXT_CPUID)},
+                                {DEFINE_KVM_EXT(KVM_CAP_IMMEDIATE_EXIT)},
                                 {0, 0}};
 
 u64 kvm_arch_default_ram_address(void) {
@@ -99,7 +101,8 @@ void kvm_init_ram(struct kvm *kvm) {
         phys_size = kvm->ram_size;
         host_mem = kvm->ram_start;
 
-        kvm_register_ram(kvm, phys_start, phys_size, host_mem);
+        if (kvm_numa_register_ram(kvm, phys_start, phys_size, host_mem) < 0)
+            die("Failed to register guest RAM at 0x%llx", phys_start);
     } else {
         /* First RAM range from zero to the PCI gap: */
 
@@ -107,7 +110,8 @@ void kvm_init_ram(struct kvm *kvm) {
         phys_size = KVM_32BIT_GAP_START;
         host_mem = kvm->ram_start;
 
-        kvm_register_ram(kvm, phys_start, phys_size, host_mem);
+        if (kvm_numa_register_ram(kvm, phys_start, phys_size, host_mem) < 0)
+            die("Failed to register guest RAM at 0x%llx", phys_start);
 
         /* Second RAM range from 4GB to the end of RAM: */
 
@@ -115,7 +119,8 @@ void kvm_init_ram(struct kvm *kvm) {
         phys_size = kvm->ram_size - phys_start;
         host_mem = kvm->ram_start + phys_start;
 
-        kvm_register_ram(kvm, phys_start, phys_size, host_mem);
+        if (kvm_numa_register_ram(kvm, phys_start, phys_size, host_mem) < 0)
+            die("Failed to register guest RAM at 0x%llx", phys_start);
     }
 }
 
@@ -159,7 +164,7 @@ void kvm_arch_init(struct kvm *kvm) {
     if (kvm->ram_start == MAP_FAILED)
         die("out of memory");
 
-    madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
+    kvm_advise_ram(kvm, kvm->ram_start, kvm->ram_size);
 
     ret = ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP);
     if (ret < 0)
@@ -273,6 +278,7 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd, const ch
 
         memset(p, 0, boot.hdr.cmdline_size);
         memcpy(p, kernel_cmdline, cmdline_size - 1);
+        kvm->arch.cmdline_size = boot.hdr.cmdline_size;
     }
 
     /* vidmode should be either specified or set by default */
@@ -331,6 +337,28 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd, const ch
     return true;
 }
 
+/*
+ * Append @param to the command line of an already loaded bzImage, for devices
+ * that can only be described to the guest that way (e.g. virtio-mmio).
+ */
+void kvm_arch_append_cmdline(struct kvm *kvm, const char *param) {
+    char *cmdline = guest_flat_to_host(kvm, BOOT_CMDLINE_OFFSET);
+    size_t len;
+
+    if (!kvm->arch.cmdline_size) {
+        pr_warning("No kernel command line, unable to pass \"%s\"", param);
+        return;
+    }
+
+    len = strnlen(cmdline, kvm->arch.cmdline_size);
+    if (len + strlen(param) >= kvm->arch.cmdline_size) {
+        pr_warning("Kernel command line too long, unable to pass \"%s\"", param);
+        return;
+    }
+
+    strcpy(cmdline + len, param);
+}
+
 bool kvm_arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd, const char *kernel_cmdline) {
     if (load_bzimage(kvm, fd_kernel, fd_initrd, kernel_cmdline))
         return true;
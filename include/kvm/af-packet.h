@@ -0,0 +1,57 @@
+#ifndef KVM__AF_PACKET_H
+#define KVM__AF_PACKET_H
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "linux/types.h"
+
+#include <linux/if_packet.h>
+
+struct virtio_net_rss;
+
+#define AF_PACKET_BLOCK_SIZE    (1 << 17)
+#define AF_PACKET_RX_BLOCK_NR   32
+#define AF_PACKET_TX_BLOCK_NR   8
+/* Smallest TX frame, larger ones are sized after the MTU of the interface */
+#define AF_PACKET_FRAME_SIZE    2048
+/* Longest a partially filled RX block waits for more frames, in ms */
+#define AF_PACKET_RX_BLOCK_TOV  1
+
+/*
+ * A TPACKET_V3 socket bound to a host interface, with its RX and TX rings
+ * mapped back to back. The kernel retires whole blocks of received frames
+ * to us and sends the TX frames we queue on a single kick.
+ */
+struct af_packet {
+    int fd;
+    void *map;
+    size_t map_len;
+
+    /* vnet header layout the guest negotiated */
+    u32 vnet_hdr_len;
+    u16 endian;
+    bool guest_csum;
+
+    /* RX: block we are consuming, and the next frame and frames left in it */
+    u32 rx_block;
+    struct tpacket3_hdr *rx_frame;
+    u32 rx_left;
+
+    /* TX: frame layout, next frame to fill and frames filled since the last kick */
+    u32 tx_frame_size;
+    u32 tx_frame_nr;
+    u32 tx_frame;
+    u32 tx_pending;
+    /* Frames the guest sent that the ring can't hold */
+    u64 tx_dropped;
+};
+
+int af_packet_init(struct af_packet *pkt, const char *ifname, int *fanout_id);
+void af_packet_exit(struct af_packet *pkt);
+int af_packet_steer(struct af_packet *pkt, struct virtio_net_rss *rss);
+int af_packet_rx(struct iovec *iov, u16 in, struct af_packet *pkt);
+int af_packet_tx(struct iovec *iov, u16 out, struct af_packet *pkt);
+void af_packet_tx_flush(struct af_packet *pkt);
+
+#endif /* KVM__AF_PACKET_H */
@@ -0,0 +1,68 @@
+#ifndef KVM__AF_XDP_H
+#define KVM__AF_XDP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "linux/types.h"
+
+#define AF_XDP_FRAME_SIZE    2048
+/* Entries of each XSK ring, and UMEM frames for RX and for TX */
+#define AF_XDP_RING_SIZE     2048
+#define AF_XDP_RX_FRAMES     AF_XDP_RING_SIZE
+#define AF_XDP_TX_FRAMES     AF_XDP_RING_SIZE
+
+/*
+ * XDP program redirecting the frames of each queue of an interface to the
+ * socket bound to it. Frames of queues without a socket go to the host.
+ */
+struct af_xdp_prog {
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+};
+
+/* Single producer, single consumer ring shared with the kernel */
+struct af_xdp_ring {
+    u32 *producer;
+    u32 *consumer;
+    u32 *flags;
+    void *descs;
+    void *map;
+    size_t map_len;
+    /* The index we own, and the last one of the other side we've seen */
+    u32 cached_prod;
+    u32 cached_cons;
+};
+
+/* An XSK bound to one queue of a host interface, with a UMEM of its own */
+struct af_xdp {
+    int fd;
+    void *umem;
+    bool need_wakeup;
+    bool zerocopy;
+    u32 vnet_hdr_len;
+
+    struct af_xdp_ring fill;
+    struct af_xdp_ring comp;
+    struct af_xdp_ring rx;
+    struct af_xdp_ring tx;
+
+    /* UMEM frames free for TX, and descriptors not yet published */
+    u64 tx_free[AF_XDP_TX_FRAMES];
+    u32 nr_tx_free;
+    u32 tx_pending;
+};
+
+int af_xdp_nr_queues(const char *ifname);
+int af_xdp_prog_attach(struct af_xdp_prog *prog, const char *ifname, u32 nr_queues);
+void af_xdp_prog_detach(struct af_xdp_prog *prog);
+int af_xdp_init(struct af_xdp *xsk, struct af_xdp_prog *prog, const char *ifname, u32 queue);
+int af_xdp_steer(struct af_xdp *xsk, struct af_xdp_prog *prog, u32 queue, bool enable);
+void af_xdp_exit(struct af_xdp *xsk);
+int af_xdp_rx(struct iovec *iov, u16 in, struct af_xdp *xsk);
+int af_xdp_tx(struct iovec *iov, u16 out, struct af_xdp *xsk);
+void af_xdp_tx_flush(struct af_xdp *xsk);
+
+#endif /* KVM__AF_XDP_H */
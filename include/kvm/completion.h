@@ -0,0 +1,45 @@
+#ifndef KVM__COMPLETION_H
+#define KVM__COMPLETION_H
+
+#include <pthread.h>
+
+#include "kvm/util.h"
+
+/*
+ * Kernel-alike completion API: threads complete() events another one
+ * waits for. Unlike an eventfd it is set up once and reused, each wait
+ * consuming the events it asked for.
+ */
+
+struct completion {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int done;
+};
+#define COMPLETION_INITIALIZER \
+    { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER }
+
+#define DECLARE_COMPLETION(c) struct completion c = COMPLETION_INITIALIZER
+
+static inline void complete(struct completion *c) {
+    if (pthread_mutex_lock(&c->mutex) != 0)
+        die("unexpected pthread_mutex_lock() failure!");
+
+    c->done++;
+    pthread_cond_broadcast(&c->cond);
+
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* Wait for n events, completed since the last wait or during this one */
+static inline void wait_for_completions(struct completion *c, unsigned int n) {
+    if (pthread_mutex_lock(&c->mutex) != 0)
+        die("unexpected pthread_mutex_lock() failure!");
+
+    while (c->done < n) pthread_cond_wait(&c->cond, &c->mutex);
+    c->done -= n;
+
+    pthread_mutex_unlock(&c->mutex);
+}
+
+#endif /* KVM__COMPLETION_H */
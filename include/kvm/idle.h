@@ -0,0 +1,12 @@
+#ifndef KVM__IDLE_H
+#define KVM__IDLE_H
+
+struct kvm;
+
+/*
+ * What idle vCPUs do: how long KVM polls for a wakeup before putting a
+ * halted vCPU to sleep, and which idle instructions don't exit at all.
+ */
+int kvm_idle_init(struct kvm *kvm);
+
+#endif /* KVM__IDLE_H */
@@ -35,7 +35,12 @@ struct kvm_config {
     int active_console;
     int debug_iodelay;
     int nrcpus;
+    const char *vcpu_affinity; /* Host CPUs of each vCPU, e.g. 0-3:4-7 */
+    const char *io_affinity;   /* Host CPUs of every other thread */
+    const char *mem_nodes;     /* Host NUMA nodes guest RAM is spread over */
+    const char *numa;          /* Guest NUMA nodes, e.g. 0-3/2G/0:4-7/2G/1 */
     const char *disk_path;
+    const char *vhost_user_blk; /* vhost-user backend socket */
     // kernel
     const char *kernel_path;
     const char *kernel_cmdline;
@@ -53,12 +58,23 @@ struct kvm_config {
     const char *guest_mac;
     const char *host_mac;
     const char *script;
+    const char *vhost_user_net; /* vhost-user backend socket */
+    const char *net_packet;     /* host interface of a packet socket backend */
+    const char *net_xdp;        /* host interface of an XDP socket backend */
     const char *guest_name;  // default {PID}
     // socket
     char *rootfs_path;         // /tmp/kemu/{guest_name}
     char *rootfs_socket_path;  // /tmp/kemu/{guest_name}/ipc.sock
     const char *sandbox;
     const char *hugetlbfs_path;
+    bool mem_shared; /* Map guest RAM from a file other processes can map */
+    int mem_backend;  /* enum kvm_mem_backend */
+    const char *mem_backend_name;
+    bool ksm; /* Let KSM merge guest pages */
+    bool mem_prealloc; /* Fault in guest RAM before vCPUs start */
+    const char *idle_policy;
+    const char *halt_poll_ns_str; /* Halt poll window, KVM's default if unset */
+    const char *disable_exits;    /* Idle instructions that don't exit */
     const char *custom_rootfs_name;
     struct virtio_net_params *net_params;
     // misc
@@ -75,6 +91,11 @@ struct kvm_config {
     bool ioport_debug;
     bool mmio_debug;
     int virtio_transport;
+    const char *virtio_transport_name;
+    // virtio interrupt moderation
+    int virtio_irq_frames;
+    int virtio_irq_usecs;
+    bool virtio_irq_adaptive;
 };
 
 #endif
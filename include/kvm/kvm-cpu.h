@@ -10,6 +10,16 @@ struct kvm_cpu_task {
     void *data;
 };
 
+/*
+ * What other threads may ask of a vCPU. It handles them between two runs
+ * of the guest, and is kicked out of it for that.
+ */
+enum {
+    KVM_CPU_REQ_EXIT,
+    KVM_CPU_REQ_PAUSE,
+    KVM_CPU_REQ_TASK,
+};
+
 int kvm_cpu__init(struct kvm *kvm);
 int kvm_cpu__exit(struct kvm *kvm);
 struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id);
@@ -29,5 +39,7 @@ void kvm_cpu__show_registers(struct kvm_cpu *vcpu);
 void kvm_cpu__show_page_tables(struct kvm_cpu *vcpu);
 void kvm_cpu__arch_nmi(struct kvm_cpu *cpu);
 void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task);
+bool kvm_cpu__request(struct kvm_cpu *vcpu, int req);
+bool kvm_cpu__has_request(struct kvm_cpu *vcpu, int req);
 
 #endif /* KVM__KVM_CPU_H */
@@ -14,6 +14,7 @@ enum {
     KVM_IPC_STOP = 6,
     KVM_IPC_PID = 7,
     KVM_IPC_VMSTATE = 8,
+    KVM_IPC_EXIT_STATS = 9,
 };
 
 int kvm_ipc__register_handler(u32 type, void (*cb)(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg));
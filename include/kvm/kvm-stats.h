@@ -0,0 +1,60 @@
+#ifndef KVM__KVM_STATS_H
+#define KVM__KVM_STATS_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "kvm/kvm.h"
+
+struct kvm_cpu;
+
+/* Exit reasons counted one by one, later ones together in the last slot */
+#define KVM_STATS_EXIT_REASONS 64
+/* Buckets of time spent in userspace per exit, the n-th one below 2^n ns */
+#define KVM_STATS_BUCKETS      32
+/* Handlers counted per vCPU, further ones together */
+#define KVM_STATS_HANDLERS     32
+
+struct kvm_stats_handler {
+    mmio_handler_fn fn;
+    void *ptr;
+    /* First address it was called for, to tell devices apart */
+    u64 addr;
+    bool pio;
+    u64 calls;
+    u64 ns;
+};
+
+/*
+ * Exit statistics of a vCPU. Only its thread writes them, readers may see
+ * them slightly stale.
+ */
+struct kvm_cpu_stats {
+    u64 exits[KVM_STATS_EXIT_REASONS];
+    u64 exit_ns[KVM_STATS_EXIT_REASONS];
+    u64 hist[KVM_STATS_BUCKETS];
+    struct kvm_stats_handler handlers[KVM_STATS_HANDLERS];
+    struct kvm_stats_handler other;
+    /* Handler of the exit being handled, charged with its time */
+    struct kvm_stats_handler *current;
+};
+
+int kvm_stats_init(struct kvm *kvm);
+void kvm_stats_stop(struct kvm *kvm);
+void kvm_stats_exit(struct kvm *kvm);
+
+void kvm_stats_handler(struct kvm_cpu *vcpu, mmio_handler_fn fn, void *ptr, u64 addr, bool pio);
+u64 kvm_stats_exit_begin(struct kvm_cpu *vcpu);
+void kvm_stats_exit_done(struct kvm_cpu *vcpu, u32 reason, u64 start);
+int kvm_stats_report(struct kvm *kvm, int fd);
+
+static inline u64 kvm_stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* KVM__KVM_STATS_H */
@@ -14,9 +14,8 @@
 #include "kvm/mutex.h"
 #include "kvm/util-init.h"
 
-#define SIGKVMEXIT        (SIGRTMIN + 0)
-#define SIGKVMPAUSE       (SIGRTMIN + 1)
-#define SIGKVMTASK        (SIGRTMIN + 2)
+/* Gets a vCPU out of KVM_RUN to handle its requests */
+#define SIGKVMKICK        (SIGRTMIN + 0)
 
 #define KVM_PID_FILE_PATH "/.lkvm/"
 #define HOME_DIR          getenv("HOME")
@@ -39,6 +38,7 @@
 #define DEFINE_KVM_EXT(ext) .name = #ext, .code = ext
 
 struct kvm_cpu;
+struct kvm_numa;
 typedef void (*mmio_handler_fn)(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len, u8 is_write, void *ptr);
 
 enum {
@@ -83,8 +83,11 @@ struct kvm {
     u64 ram_size;  /* Guest memory size, in bytes */
     void *ram_start;
     u64 ram_pagesize;
+    int ram_fd;         /* Backing file of shared guest RAM, for vhost-user */
+    void *ram_fd_start; /* Host address of offset 0 in ram_fd */
     struct mutex mem_banks_lock;
     struct list_head mem_banks;
+    struct kvm_numa *numa; /* NULL unless the guest has NUMA nodes */
 
     bool nmi_disabled;
     bool msix_needs_devid;
@@ -157,7 +160,8 @@ static inline bool kvm_deregister_pio(struct kvm *kvm, u16 port) {
 void kvm_vm_exit(struct kvm *kvm);
 void kvm_pause(struct kvm *kvm);
 void kvm_continue(struct kvm *kvm);
-void kvm_notify_paused(void);
+void kvm_notify_paused(struct kvm_cpu *vcpu);
+void kvm_wake_paused(struct kvm *kvm);
 int kvm_get_sock_by_instance(const char *name);
 int kvm_enumerate_instances(int (*callback)(const char *name, int pid));
 void kvm_remove_socket(const char *name);
@@ -212,6 +216,7 @@ int kvm_for_each_mem_bank(struct kvm *kvm, enum kvm_mem_type type,
 void kvm_dump_mem(struct kvm *kvm, unsigned long addr, unsigned long size, int debug_fd);
 
 extern const char *kvm_exit_reasons[];
+extern const unsigned int kvm_nr_exit_reasons;
 
 static inline bool host_ptr_in_ram(struct kvm *kvm, void *p) {
     return kvm->ram_start <= p && p < (kvm->ram_start + kvm->ram_size);
@@ -23,6 +23,11 @@ static inline void mutex_init(struct mutex *lock) {
         die("unexpected pthread_mutex_init() failure!");
 }
 
+static inline void mutex_destroy(struct mutex *lock) {
+    if (pthread_mutex_destroy(&lock->mutex) != 0)
+        die("unexpected pthread_mutex_destroy() failure!");
+}
+
 static inline void mutex_lock(struct mutex *lock) {
     if (pthread_mutex_lock(&lock->mutex) != 0)
         die("unexpected pthread_mutex_lock() failure!");
@@ -0,0 +1,51 @@
+#ifndef KVM__NUMA_H
+#define KVM__NUMA_H
+
+#include <linux/types.h>
+#include <sched.h>
+
+struct kvm;
+
+#define KVM_NUMA_MAX_NODES       16
+/* RAM of a node may be split by holes in the guest physical map */
+#define KVM_NUMA_MAX_RANGES      4
+
+#define KVM_NUMA_LOCAL_DISTANCE  10
+#define KVM_NUMA_REMOTE_DISTANCE 20
+
+struct kvm_numa_range {
+    u64 guest_phys;
+    u64 size;
+};
+
+struct kvm_numa_node {
+    cpu_set_t vcpus;
+    u64 mem_size;
+    /* Host node its RAM is bound to, -1 if none */
+    int host_node;
+    int nr_ranges;
+    struct kvm_numa_range ranges[KVM_NUMA_MAX_RANGES];
+};
+
+/*
+ * NUMA topology of the guest. Nodes get their RAM in order: the first
+ * mem_size bytes of RAM go to node 0, the next ones to node 1, and so on.
+ */
+struct kvm_numa {
+    int nr_nodes;
+    struct kvm_numa_node nodes[KVM_NUMA_MAX_NODES];
+    u8 distance[KVM_NUMA_MAX_NODES][KVM_NUMA_MAX_NODES];
+    /* RAM registered so far, which tells the node of the next bank */
+    u64 ram_offset;
+};
+
+int kvm_numa_parse(struct kvm *kvm);
+int kvm_numa_register_ram(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr);
+int kvm_numa_vcpu_node(struct kvm *kvm, unsigned long cpu);
+
+#ifdef CONFIG_HAS_LIBFDT
+void kvm_numa_generate_fdt_memory(void *fdt, struct kvm *kvm);
+void kvm_numa_generate_fdt_cpu(void *fdt, struct kvm *kvm, unsigned long cpu);
+#endif
+
+#endif /* KVM__NUMA_H */
@@ -0,0 +1,22 @@
+#ifndef KVM__PLACEMENT_H
+#define KVM__PLACEMENT_H
+
+#include <linux/types.h>
+#include <sched.h>
+
+struct kvm;
+struct kvm_cpu;
+
+/*
+ * Host placement of the guest: the CPUs its vCPU threads and its I/O
+ * threads run on, and the NUMA nodes its RAM is allocated from.
+ */
+int kvm_placement_init(struct kvm *kvm);
+int kvm_placement_bind_ram(struct kvm *kvm);
+int kvm_placement_bind(void *addr, u64 len, int node);
+int kvm_placement_prealloc_ram(struct kvm *kvm);
+void kvm_placement_vcpu(struct kvm_cpu *vcpu);
+
+const char *placement_parse_list(const char *str, char sep, cpu_set_t *set);
+
+#endif /* KVM__PLACEMENT_H */
@@ -2,11 +2,14 @@
 #define KVM__UIP_H
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 
 #include "kvm/mutex.h"
 #include "linux/types.h"
 
+struct virtio_net_rss;
+
 #define UIP_BUF_STATUS_FREE           0
 #define UIP_BUF_STATUS_INUSE          1
 #define UIP_BUF_STATUS_USED           2
@@ -22,13 +25,18 @@
 #define UIP_IP_P_ICMP                 0X01
 
 #define UIP_TCP_HDR_LEN               0x50
-#define UIP_TCP_WIN_SIZE              14600
 #define UIP_TCP_FLAG_FIN              1
 #define UIP_TCP_FLAG_SYN              2
 #define UIP_TCP_FLAG_RST              4
 #define UIP_TCP_FLAG_PSH              8
 #define UIP_TCP_FLAG_ACK              16
 #define UIP_TCP_FLAG_URG              32
+#define UIP_TCP_OPT_END               0
+#define UIP_TCP_OPT_NOP               1
+#define UIP_TCP_OPT_MSS               2
+#define UIP_TCP_OPT_MSS_LEN           4
+/* MSS assumed when the guest SYN doesn't carry one, for a 1500 bytes MTU */
+#define UIP_TCP_MSS                   1460
 
 #define UIP_BOOTP_VENDOR_SPECIFIC_LEN 64
 #define UIP_BOOTP_MAX_PAYLOAD_LEN     300
@@ -76,6 +84,30 @@
 #define UIP_MAX_TCP_PAYLOAD          (64 * 1024 - 20 - 20 - 1)
 #define UIP_MAX_UDP_PAYLOAD          (64 * 1024 - 20 - 8 - 1)
 
+/*
+ * Guest to host data a TCP connection holds once the host socket stops
+ * taking it, anything beyond is left for the guest to retransmit
+ */
+#define UIP_TCP_SNDBUF_SIZE          (64 * 1024)
+#define UIP_TCP_MAX_EVENTS           64
+
+/* Datagrams moved per recvmmsg/sendmmsg, and guest data held for one sendmmsg */
+#define UIP_UDP_BATCH                32
+#define UIP_UDP_TX_BUF_SIZE          (128 * 1024)
+
+/* Buckets of the UDP and TCP socket tables, hashed on the 4-tuple */
+#define UIP_SOCKET_HASH_BITS         8
+#define UIP_SOCKET_HASH_SIZE         (1 << UIP_SOCKET_HASH_BITS)
+
+/* Receive queues frames can be steered to */
+#define UIP_MAX_QUEUES               8
+
+enum uip_tcp_state {
+    UIP_TCP_CONNECTING,
+    UIP_TCP_ESTABLISHED,
+    UIP_TCP_CLOSED,
+};
+
 struct uip_eth_addr {
     u8 addr[6];
 };
@@ -185,22 +217,46 @@ struct uip_dhcp {
     u8 option[UIP_DHCP_OPTION_LEN];
 } __attribute__((packed));
 
+/*
+ * Guest datagrams queued since the guest started sending, flushed with one
+ * sendmmsg per run of datagrams to the same socket
+ */
+struct uip_udp_tx {
+    struct mmsghdr msgs[UIP_UDP_BATCH];
+    struct iovec iovs[UIP_UDP_BATCH];
+    struct uip_udp_socket *sks[UIP_UDP_BATCH];
+    u8 *buf;
+    u32 nr;
+    u32 len;
+};
+
 struct uip_info {
     struct list_head udp_socket_head;
     struct list_head tcp_socket_head;
+    struct hlist_head udp_socket_hash[UIP_SOCKET_HASH_SIZE];
+    struct hlist_head tcp_socket_hash[UIP_SOCKET_HASH_SIZE];
+    /* Closed TCP sockets, freed by the TCP thread once it holds no event for them */
+    struct list_head tcp_closed_head;
     struct mutex udp_socket_lock;
     struct mutex tcp_socket_lock;
     struct uip_eth_addr guest_mac;
     struct uip_eth_addr host_mac;
     pthread_cond_t buf_free_cond;
-    pthread_cond_t buf_used_cond;
+    pthread_cond_t buf_used_cond[UIP_MAX_QUEUES];
+    /* All buffers, and the FIFOs of free ones and of ones ready for each receive queue */
     struct list_head buf_head;
+    struct list_head buf_free_head;
+    struct list_head buf_used_head[UIP_MAX_QUEUES];
     struct mutex buf_lock;
+    /* Steers frames to the first nr_queues receive queues, all to the first without it */
+    struct virtio_net_rss *rss;
+    u16 nr_queues;
     pthread_t udp_thread;
-    u8 *udp_buf;
+    struct uip_udp_tx udp_tx;
     int udp_epollfd;
-    int buf_free_nr;
-    int buf_used_nr;
+    pthread_t tcp_thread;
+    u8 *tcp_buf;
+    int tcp_epollfd;
     u32 guest_ip;
     u32 guest_netmask;
     u32 host_ip;
@@ -208,10 +264,19 @@ struct uip_info {
     char *domain_name;
     u32 buf_nr;
     u32 vnet_hdr_len;
+    /*
+     * vnet header endianness, and whether the guest takes partial checksums
+     * and TSO frames, the latter only if its RX rings hold a whole one
+     */
+    u16 endian;
+    bool guest_csum;
+    bool guest_tso;
 };
 
 struct uip_buf {
     struct list_head list;
+    /* Link in buf_free_head or in the buf_used_head of a queue */
+    struct list_head queue;
     struct uip_info *info;
     int vnet_len;
     int eth_len;
@@ -224,6 +289,7 @@ struct uip_buf {
 struct uip_udp_socket {
     struct sockaddr_in addr;
     struct list_head list;
+    struct hlist_node node;
     struct mutex *lock;
     u32 dport, sport;
     u32 dip, sip;
@@ -233,13 +299,17 @@ struct uip_udp_socket {
 struct uip_tcp_socket {
     struct sockaddr_in addr;
     struct list_head list;
+    struct hlist_node node;
     struct uip_info *info;
-    pthread_cond_t cond;
     struct mutex *lock;
-    pthread_t thread;
+    enum uip_tcp_state state;
+    /* epoll events we currently wait for */
+    u32 events;
     u32 dport, sport;
     u32 guest_acked;
     u16 window_size;
+    /* Largest segment the guest takes, frames beyond it go out as GSO */
+    u16 mss;
     /*
      * Initial Sequence Number
      */
@@ -251,7 +321,9 @@ struct uip_tcp_socket {
     int read_done;
     u32 dip, sip;
     u8 *payload;
-    u8 *buf;
+    /* Guest data the host socket didn't take yet */
+    u8 *sndbuf;
+    u32 snd_len;
     int fd;
 };
 
@@ -307,6 +379,14 @@ static inline bool uip_tcp_is_fin(struct uip_tcp *tcp) {
     return (tcp->flg & UIP_TCP_FLAG_FIN) != 0;
 }
 
+static inline bool uip_tcp_is_rst(struct uip_tcp *tcp) {
+    return (tcp->flg & UIP_TCP_FLAG_RST) != 0;
+}
+
+static inline bool uip_tcp_is_ack(struct uip_tcp *tcp) {
+    return (tcp->flg & UIP_TCP_FLAG_ACK) != 0;
+}
+
 static inline u32 uip_tcp_isn(struct uip_tcp *tcp) {
     return ntohl(tcp->seq);
 }
@@ -318,17 +398,40 @@ static inline u32 uip_tcp_isn_alloc(void) {
     return 10000000;
 }
 
+static inline u32 uip_socket_hash(u32 sip, u32 dip, u16 sport, u16 dport) {
+    u32 key;
+
+    key = sip ^ dip ^ ((u32)sport << 16 | dport);
+
+    /* Multiplicative hashing, the top bits are the well mixed ones */
+    return (key * 0x61C88647) >> (32 - UIP_SOCKET_HASH_BITS);
+}
+
+/* RFC 1624 update of a checksum covering a 16-bit word changed from old to new */
+static inline u16 uip_csum_replace(u16 csum, u16 old, u16 new) {
+    u32 sum;
+
+    sum = (u16)~csum + (u16)~old + new;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
 static inline u16 uip_eth_hdrlen(struct uip_eth *eth) {
     return sizeof(*eth);
 }
 
 int uip_tx(struct iovec *iov, u16 out, struct uip_info *info);
-int uip_rx(struct iovec *iov, u16 in, struct uip_info *info);
+void uip_tx_flush(struct uip_info *info);
+int uip_rx(struct iovec *iov, u16 in, struct uip_info *info, u16 queue);
+void uip_set_queues(struct uip_info *info, u16 nr_queues);
 void uip_static_init(struct uip_info *info);
 int uip_init(struct uip_info *info);
 void uip_exit(struct uip_info *info);
 void uip_tcp_exit(struct uip_info *info);
 void uip_udp_exit(struct uip_info *info);
+void uip_udp_tx_flush(struct uip_info *info);
 
 int uip_tx_do_ipv4_udp_dhcp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg);
@@ -337,15 +440,16 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4(struct uip_tx_arg *arg);
 int uip_tx_do_arp(struct uip_tx_arg *arg);
 
-u16 uip_csum_icmp(struct uip_icmp *icmp);
 u16 uip_csum_udp(struct uip_udp *udp);
 u16 uip_csum_tcp(struct uip_tcp *tcp);
 u16 uip_csum_ip(struct uip_ip *ip);
+void uip_csum_guest(struct uip_info *info, struct uip_buf *buf);
 
 struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf);
-struct uip_buf *uip_buf_get_used(struct uip_info *info);
+struct uip_buf *uip_buf_get_used(struct uip_info *info, u16 queue);
 struct uip_buf *uip_buf_get_free(struct uip_info *info);
+int uip_buf_get_free_batch(struct uip_info *info, struct uip_buf **bufs, int nr);
 struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg);
 
 int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct uip_buf *buf, u8 *payload,
@@ -137,8 +137,19 @@ static inline int pow2_size(unsigned long x) {
     return sizeof(x) * 8 - __builtin_clzl(x - 1);
 }
 
+/* What guest RAM is mapped from, unless a hugetlbfs path is given */
+enum kvm_mem_backend {
+    KVM_MEM_ANON,      /* Anonymous memory, small pages */
+    KVM_MEM_THP,       /* Anonymous memory, transparent huge pages */
+    KVM_MEM_MEMFD,     /* memfd, shareable with other processes */
+    KVM_MEM_MEMFD_2M,  /* hugetlb memfd with 2M pages */
+    KVM_MEM_MEMFD_1G,  /* hugetlb memfd with 1G pages */
+};
+
 struct kvm;
+int kvm_mem_backend_from_str(const char *arg, enum kvm_mem_backend *backend);
 void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size);
 void *mmap_anon_or_hugetlbfs(struct kvm *kvm, const char *hugetlbfs_path, u64 size);
+void kvm_advise_ram(struct kvm *kvm, void *addr, u64 size);
 
 #endif /* KVM__UTIL_H */
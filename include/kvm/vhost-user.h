@@ -0,0 +1,108 @@
+#ifndef KVM__VHOST_USER_H
+#define KVM__VHOST_USER_H
+
+#include <linux/types.h>
+
+/*
+ * vhost-user wire format, see docs/interop/vhost-user.rst in QEMU. Messages
+ * are exchanged over a unix socket, file descriptors travel as SCM_RIGHTS
+ * ancillary data of the message that refers to them.
+ */
+
+#define VHOST_USER_VERSION                 0x1
+#define VHOST_USER_VERSION_MASK            0x3
+#define VHOST_USER_REPLY_MASK              (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK         (1 << 3)
+
+#define VHOST_USER_MAX_FDS                 8
+#define VHOST_USER_MAX_MEM_REGIONS         8
+#define VHOST_USER_MAX_QUEUES              32
+#define VHOST_USER_MAX_CONFIG_SIZE         256
+
+#define VHOST_USER_F_PROTOCOL_FEATURES     30
+
+#define VHOST_USER_PROTOCOL_F_MQ           0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK    3
+#define VHOST_USER_PROTOCOL_F_CONFIG       9
+
+/* Payload of the kick/call/err requests */
+#define VHOST_USER_VRING_IDX_MASK          0xff
+#define VHOST_USER_VRING_NOFD_MASK         (1 << 8)
+
+enum vhost_user_request {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
+};
+
+struct vhost_user_vring_state {
+    u32 index;
+    u32 num;
+};
+
+struct vhost_user_vring_addr {
+    u32 index;
+    u32 flags;
+    /* Frontend virtual addresses, translated through the memory table */
+    u64 desc_user_addr;
+    u64 used_user_addr;
+    u64 avail_user_addr;
+    u64 log_guest_addr;
+};
+
+struct vhost_user_mem_region {
+    u64 guest_phys_addr;
+    u64 memory_size;
+    u64 userspace_addr;
+    u64 mmap_offset;
+};
+
+struct vhost_user_mem_table {
+    u32 nregions;
+    u32 padding;
+    struct vhost_user_mem_region regions[VHOST_USER_MAX_MEM_REGIONS];
+};
+
+struct vhost_user_config {
+    u32 offset;
+    u32 size;
+    u32 flags;
+    u8 region[VHOST_USER_MAX_CONFIG_SIZE];
+};
+
+struct vhost_user_hdr {
+    u32 request;
+    u32 flags;
+    u32 size; /* of the payload that follows */
+} __attribute__((packed));
+
+struct vhost_user_msg {
+    struct vhost_user_hdr hdr;
+    union {
+        u64 u64;
+        struct vhost_user_vring_state state;
+        struct vhost_user_vring_addr addr;
+        struct vhost_user_mem_table mem;
+        struct vhost_user_config config;
+    } payload;
+} __attribute__((packed));
+
+#endif /* KVM__VHOST_USER_H */
@@ -0,0 +1,45 @@
+#ifndef KVM__VIRTIO_NET_RSS_H
+#define KVM__VIRTIO_NET_RSS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "linux/types.h"
+
+#include <linux/virtio_net.h>
+
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE  40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN 128
+
+/* Extension headers aren't parsed, so no _EX types */
+#define VIRTIO_NET_RSS_HASH_TYPES                                                                      \
+    (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+     VIRTIO_NET_RSS_HASH_TYPE_IPv6 | VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
+/*
+ * Receive side scaling state of a device: the Toeplitz key and hash types
+ * frames are classified with, and the indirection table mapping their hash
+ * to a receive queue. Until the guest programs its own, flows are spread
+ * over the queues in use with a default key.
+ */
+struct virtio_net_rss {
+    pthread_rwlock_t lock;
+    /* The table is the guest's, and the hashes are reported to it */
+    bool configured;
+    bool report;
+    u32 hash_types;
+    u16 table_mask;
+    u16 unclassified;
+    u16 table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    u8 key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+};
+
+void virtio_net_rss_init(struct virtio_net_rss *rss);
+void virtio_net_rss_reset(struct virtio_net_rss *rss, u16 nr_queues);
+void virtio_net_rss_spread(struct virtio_net_rss *rss, u16 nr_queues);
+void virtio_net_rss_configure(struct virtio_net_rss *rss, u32 hash_types, const u8 *key, u8 key_len,
+                              const u16 *table, u16 table_len, u16 unclassified);
+u16 virtio_net_rss_queue(struct virtio_net_rss *rss, const u8 *frame, u32 len, u32 *hash, u16 *report);
+u32 virtio_net_rss_toeplitz(const u8 *key, const u8 *data, u32 len);
+
+#endif /* KVM__VIRTIO_NET_RSS_H */
@@ -12,6 +12,8 @@ struct virtio_net_params {
     const char *downscript;
     const char *trans;
     const char *tapif;
+    const char *vhost_user;
+    const char *ifname; /* host interface of a packet or XDP socket */
     char guest_mac[6];
     char host_mac[6];
     struct kvm *kvm;
@@ -25,6 +27,6 @@ int virtio_net__init(struct kvm *kvm);
 int virtio_net__exit(struct kvm *kvm);
 int netdev_parser(const struct option *opt, const char *arg, int unset);
 
-enum { NET_MODE_USER, NET_MODE_TAP };
+enum { NET_MODE_USER, NET_MODE_TAP, NET_MODE_VHOST_USER, NET_MODE_PACKET, NET_MODE_XDP };
 
 #endif /* KVM__VIRTIO_NET_H */
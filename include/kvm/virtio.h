@@ -3,14 +3,18 @@
 
 #include <endian.h>
 #include <linux/compiler.h>
+#include <linux/list.h>
 #include <linux/types.h>
 #include <linux/virtio_config.h>
 #include <linux/virtio_pci.h>
 #include <linux/virtio_ring.h>
+#include <stdio.h>
 #include <sys/uio.h>
 
 #include "kvm/barrier.h"
 #include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/vhost-user.h"
 
 #define VIRTIO_IRQ_LOW      0
 #define VIRTIO_IRQ_HIGH     1
@@ -61,6 +65,35 @@ struct vring_addr {
     };
 };
 
+/*
+ * Interrupt moderation state of a virtqueue. Completions are accumulated
+ * until either max_frames of them are pending or the oldest one has waited
+ * max_usecs, see virtio_queue__signal().
+ */
+struct virt_queue_irq_mod {
+    struct mutex lock;
+    bool enabled;
+    bool adaptive;
+    u32 max_frames;
+    u32 max_usecs;
+    /* Current frame threshold, only moves away from max_frames when adaptive */
+    u32 cur_frames;
+    u32 pending;
+    u32 queueid;
+    u64 pending_since;
+    u64 last_flush;
+    int timer_fd;
+    bool timer_armed;
+    /* On the list of moderated queues, for the statistics report */
+    struct list_head list;
+
+    /* Statistics, only maintained while moderation is enabled */
+    u64 nr_completions;
+    u64 nr_signals;
+    u64 nr_suppressed;
+    u64 nr_timer_flushes;
+};
+
 struct virt_queue {
     struct vring vring;
     struct vring_addr vring_addr;
@@ -73,10 +106,22 @@ struct virt_queue {
     bool enabled;
     struct virtio_device *vdev;
 
+    /*
+     * VIRTIO_F_IN_ORDER: chains completed through
+     * virt_queue__set_used_elem_in_order() are only published, with a
+     * single used element, by virt_queue__flush_used_in_order().
+     */
+    bool in_order;
+    u16 in_order_batch;
+    u32 in_order_head;
+    u32 in_order_len;
+
     /* vhost IRQ handling */
     int gsi;
     int irqfd;
     int index;
+
+    struct virt_queue_irq_mod irq_mod;
 };
 
 /*
@@ -177,10 +222,16 @@ static inline bool virt_queue__available(struct virt_queue *vq) {
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
 struct vring_used_elem *virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head, u32 len, u16 offset);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+void virt_queue__set_used_elem_in_order(struct virt_queue *queue, u32 head, u32 len);
+void virt_queue__flush_used_in_order(struct virt_queue *queue);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
+int virtio_queue__signal(struct kvm *kvm, struct virtio_device *vdev, struct virt_queue *vq, u32 queueid);
+void virtio_irq_mod__report(FILE *out);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, struct kvm *kvm);
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm);
+u16 virt_queue__get_iov_max(struct virt_queue *vq, struct iovec iov[], u16 max_iov, u16 *out, u16 *in,
+                            struct kvm *kvm);
 u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue, struct iovec in_iov[], struct iovec out_iov[],
                               u16 *in, u16 *out);
 int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off);
@@ -195,6 +246,8 @@ enum virtio_trans {
 struct virtio_device {
     bool legacy;
     bool use_vhost;
+    /* VIRTIO_ID_* of the device */
+    u32 type;
     void *virtio;
     struct virtio_ops *ops;
     u16 endian;
@@ -235,12 +288,40 @@ bool virtio_access_config(struct kvm *kvm, struct virtio_device *vdev, void *dev
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev, void *dev, u64 features);
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev, void *dev, u8 status);
 void virtio_vhost_init(struct kvm *kvm, int vhost_fd);
+int virtio_vhost_get_call_fd(struct kvm *kvm, struct virt_queue *queue);
+void virtio_vhost_put_call_fd(struct kvm *kvm, struct virt_queue *queue);
 void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index, struct virt_queue *queue);
 void virtio_vhost_set_vring_kick(struct kvm *kvm, int vhost_fd, u32 index, int event_fd);
 void virtio_vhost_set_vring_irqfd(struct kvm *kvm, u32 gsi, struct virt_queue *queue);
 void virtio_vhost_reset_vring(struct kvm *kvm, int vhost_fd, u32 index, struct virt_queue *queue);
 int virtio_vhost_set_features(int vhost_fd, u64 features);
 
+/*
+ * vhost-user frontend: the datapath of the device runs in another process
+ * which maps guest RAM (see kvm_config.mem_shared) and is kicked and signals
+ * the guest through eventfds. Rings are only handed over once the driver is
+ * ready, by virtio_vhost_user_start().
+ */
+struct virtio_vhost_user {
+    int sock;
+    struct mutex mutex;
+    u64 features;          /* offered by the backend */
+    u64 protocol_features; /* negotiated with the backend */
+    u32 max_queues;
+    bool started;
+    struct virt_queue *vqs[VHOST_USER_MAX_QUEUES];
+    int kick_fds[VHOST_USER_MAX_QUEUES];
+};
+
+void virtio_vhost_user_init(struct kvm *kvm, struct virtio_vhost_user *vu, const char *path);
+void virtio_vhost_user_exit(struct virtio_vhost_user *vu);
+int virtio_vhost_user_get_config(struct virtio_vhost_user *vu, void *config, u32 size);
+void virtio_vhost_user_set_vring(struct kvm *kvm, struct virtio_vhost_user *vu, u32 index, struct virt_queue *queue);
+void virtio_vhost_user_set_vring_kick(struct virtio_vhost_user *vu, u32 index, int event_fd);
+void virtio_vhost_user_reset_vring(struct kvm *kvm, struct virtio_vhost_user *vu, u32 index);
+void virtio_vhost_user_start(struct kvm *kvm, struct virtio_vhost_user *vu, u64 features);
+
+int virtio_transport_from_str(const char *arg, enum virtio_trans *type);
 int virtio_transport_parser(const struct option *opt, const char *arg, int unset);
 
 #endif /* KVM__VIRTIO_H */
@@ -3,6 +3,7 @@
 #include <kvm/kvm-ipc.h>
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
+#include <kvm/read-write.h>
 #include <kvm/util.h>
 #include <linux/virtio_balloon.h>
 #include <signal.h>
@@ -11,6 +12,7 @@
 #include <sys/select.h>
 
 static bool mem;
+static bool exits;
 static bool all;
 static const char *instance_name;
 
@@ -18,6 +20,7 @@ static const char *const stat_usage[] = {"lkvm stat [command] [--all] [-n name]"
 
 static const struct option stat_options[] = {OPT_GROUP("Commands options:"),
                                              OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+                                             OPT_BOOLEAN('e', "exits", &exits, "Display vCPU exit statistics"),
                                              OPT_GROUP("Instance options:"),
                                              OPT_BOOLEAN('a', "all", &all, "All instances"),
                                              OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -101,17 +104,52 @@ static int do_memstat(const char *name, int sock) {
     return 0;
 }
 
+static int do_exitstat(const char *name, int sock) {
+    char *text;
+    u32 len;
+    int r;
+
+    r = kvm_ipc__send(sock, KVM_IPC_EXIT_STATS);
+    if (r < 0)
+        return r;
+
+    if (read_in_full(sock, &len, sizeof(len)) != sizeof(len)) {
+        ERR("Could not retrieve exit stats from %s", name);
+        return -EIO;
+    }
+
+    text = malloc(len + 1);
+    if (!text)
+        return -ENOMEM;
+
+    if (read_in_full(sock, text, len) != (ssize_t)len) {
+        ERR("Could not retrieve exit stats from %s", name);
+        free(text);
+        return -EIO;
+    }
+    text[len] = '\0';
+
+    printf("\n\t*** %s exit statistics ***\n\n%s\n", name, text);
+    free(text);
+
+    return 0;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix) {
     int instance;
     int r = 0;
 
     parse_stat_options(argc, argv);
 
-    if (!mem)
+    if (!mem && !exits)
         usage_with_options(stat_usage, stat_options);
 
     if (mem && all)
-        return kvm_enumerate_instances(do_memstat);
+        r = kvm_enumerate_instances(do_memstat);
+    if (exits && all && r >= 0)
+        r = kvm_enumerate_instances(do_exitstat);
+    if (all)
+        return r;
 
     if (instance_name == NULL)
         kvm_stat_help();
@@ -123,6 +161,8 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix) {
 
     if (mem)
         r = do_memstat(instance_name, instance);
+    if (exits && r >= 0)
+        r = do_exitstat(instance_name, instance);
 
     close(instance);
 
@@ -0,0 +1,183 @@
+#include "kvm/idle.h"
+
+#include <errno.h>
+#include <linux/kvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "kvm/kvm.h"
+#include "kvm/util.h"
+
+/* Separates the exits of --disable-exits */
+#define IDLE_EXIT_SEP ","
+
+static const struct {
+    const char *name;
+    u32 flag;
+} idle_exits[] = {
+    {"hlt", KVM_X86_DISABLE_EXITS_HLT},
+    {"mwait", KVM_X86_DISABLE_EXITS_MWAIT},
+    {"pause", KVM_X86_DISABLE_EXITS_PAUSE},
+    {"cstate", KVM_X86_DISABLE_EXITS_CSTATE},
+    {"all", KVM_X86_DISABLE_EXITS_HLT | KVM_X86_DISABLE_EXITS_MWAIT | KVM_X86_DISABLE_EXITS_PAUSE |
+                KVM_X86_DISABLE_EXITS_CSTATE},
+};
+
+static int idle_parse_exits(const char *str, u32 *flags) {
+    char *list, *name, *save;
+    unsigned int i;
+    int r = 0;
+
+    list = strdup(str);
+    if (!list)
+        return -ENOMEM;
+
+    *flags = 0;
+    for (name = strtok_r(list, IDLE_EXIT_SEP, &save); name; name = strtok_r(NULL, IDLE_EXIT_SEP, &save)) {
+        for (i = 0; i < ARRAY_SIZE(idle_exits); i++)
+            if (!strcmp(name, idle_exits[i].name))
+                break;
+
+        if (i == ARRAY_SIZE(idle_exits)) {
+            pr_err("Unknown exit '%s', expected hlt, mwait, pause, cstate or all", name);
+            r = -EINVAL;
+            break;
+        }
+        *flags |= idle_exits[i].flag;
+    }
+
+    free(list);
+
+    return r;
+}
+
+/* Names of the exits in flags, for messages */
+static void idle_exit_names(u32 flags, char *buf, size_t size) {
+    unsigned int i;
+    size_t len = 0;
+
+    buf[0] = '\0';
+    /* Leave "all" out */
+    for (i = 0; i < ARRAY_SIZE(idle_exits) - 1; i++)
+        if (flags & idle_exits[i].flag)
+            len += snprintf(buf + len, size - len, "%s%s", len ? IDLE_EXIT_SEP : "", idle_exits[i].name);
+}
+
+/*
+ * Defaults of the idle policies. latency is for vCPUs on cores of their
+ * own: idling never exits, so nothing pays for a wakeup. consolidate is
+ * for hosts sharing cores: halted vCPUs sleep at once rather than burn
+ * CPU time other guests could use.
+ */
+static int idle_apply_policy(struct kvm *kvm, const char *policy, u32 *exits) {
+    if (!strcmp(policy, "latency")) {
+        *exits = KVM_X86_DISABLE_EXITS_HLT | KVM_X86_DISABLE_EXITS_MWAIT | KVM_X86_DISABLE_EXITS_PAUSE |
+                 KVM_X86_DISABLE_EXITS_CSTATE;
+    } else if (!strcmp(policy, "consolidate")) {
+        if (!kvm->cfg.halt_poll_ns_str)
+            kvm->cfg.halt_poll_ns_str = "0";
+    } else if (strcmp(policy, "default")) {
+        pr_err("Unknown idle policy '%s', expected default, latency or consolidate", policy);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int idle_set_halt_poll(struct kvm *kvm, const char *str) {
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_HALT_POLL,
+    };
+    char *end;
+
+    cap.args[0] = strtoull(str, &end, 10);
+    if (end == str || *end) {
+        pr_err("Invalid halt poll window '%s', expected nanoseconds", str);
+        return -EINVAL;
+    }
+
+    if (!kvm_supports_vm_extension(kvm, KVM_CAP_HALT_POLL)) {
+        pr_err("KVM can't set the halt poll window of a VM");
+        return -ENOSYS;
+    }
+
+    if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        pr_err("Failed setting the halt poll window: %s", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Only before vCPUs are created. Exits named with --disable-exits have to
+ * be supported, those a policy picked are skipped when they aren't.
+ */
+static int idle_disable_exits(struct kvm *kvm, u32 flags, bool explicit) {
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_X86_DISABLE_EXITS,
+    };
+    char names[64];
+    int supported;
+
+    supported = ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+    if (supported < 0)
+        supported = 0;
+
+    if (flags & ~supported) {
+        idle_exit_names(flags & ~supported, names, sizeof(names));
+        if (explicit) {
+            pr_err("KVM can't disable exits '%s' on this host", names);
+            return -ENOSYS;
+        }
+        pr_warning("KVM can't disable exits '%s' on this host, they still exit", names);
+        flags &= supported;
+    }
+
+    if (!flags)
+        return 0;
+
+    cap.args[0] = flags;
+    if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        idle_exit_names(flags, names, sizeof(names));
+        pr_err("Failed disabling exits '%s': %s", names, strerror(errno));
+        return -errno;
+    }
+
+    /* A halted vCPU now spins in the guest */
+    if ((flags & KVM_X86_DISABLE_EXITS_HLT) && !kvm->cfg.vcpu_affinity)
+        pr_warning("HLT doesn't exit, idle vCPUs keep their host CPUs busy: pin them with --vcpu-affinity");
+
+    return 0;
+}
+
+int kvm_idle_init(struct kvm *kvm) {
+    u32 exits = 0;
+    int r;
+
+    if (kvm->cfg.idle_policy) {
+        r = idle_apply_policy(kvm, kvm->cfg.idle_policy, &exits);
+        if (r < 0)
+            return r;
+    }
+
+    if (kvm->cfg.halt_poll_ns_str) {
+        r = idle_set_halt_poll(kvm, kvm->cfg.halt_poll_ns_str);
+        if (r < 0)
+            return r;
+    }
+
+    /* Exits named explicitly replace those of the policy */
+    if (kvm->cfg.disable_exits) {
+        r = idle_parse_exits(kvm->cfg.disable_exits, &exits);
+        if (r < 0)
+            return r;
+    }
+
+    if (exits)
+        return idle_disable_exits(kvm, exits, kvm->cfg.disable_exits != NULL);
+
+    return 0;
+}
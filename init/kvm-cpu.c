@@ -5,13 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include "kvm/barrier.h"
+#include "kvm/completion.h"
+#include "kvm/kvm-stats.h"
 #include "kvm/kvm.h"
 #include "kvm/mutex.h"
+#include "kvm/placement.h"
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/virtio.h"
@@ -25,6 +27,7 @@ void *kvm_cpu_thread(void *arg) {
 
     sprintf(name, "kvm-vcpu-%lu", current_kvm_cpu->cpu_id);
     kvm_set_thread_name(name);
+    kvm_placement_vcpu(current_kvm_cpu);
 
     if (kvm_cpu__start(current_kvm_cpu))
         goto panic_kvm;
@@ -61,73 +64,119 @@ void kvm_cpu__enable_singlestep(struct kvm_cpu *vcpu) {
         pr_warning("KVM_SET_GUEST_DEBUG failed");
 }
 
+/*
+ * Enter the guest, unless a request is pending: the vCPU then returns as
+ * if interrupted, to handle it first. A request made once we checked sees
+ * in_guest set and kicks us out with a signal.
+ */
 void kvm_cpu__run(struct kvm_cpu *vcpu) {
     int err;
 
-    if (!vcpu->is_running)
+    __atomic_store_n(&vcpu->in_guest, 1, __ATOMIC_SEQ_CST);
+
+    if (!vcpu->is_running || __atomic_load_n(&vcpu->requests, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&vcpu->in_guest, 0, __ATOMIC_RELEASE);
+        vcpu->kvm_run->exit_reason = KVM_EXIT_INTR;
         return;
+    }
 
     err = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
     if (err < 0 && (errno != EINTR && errno != EAGAIN))
         die_perror("KVM_RUN failed");
+
+    __atomic_store_n(&vcpu->in_guest, 0, __ATOMIC_RELEASE);
+    vcpu->kvm_run->immediate_exit = 0;
 }
 
+/*
+ * The kick only has to get the vCPU out of KVM_RUN: if it hadn't entered
+ * it yet, immediate_exit makes it return right away. Hence
+ * KVM_CAP_IMMEDIATE_EXIT is a required extension on every arch.
+ */
 static void kvm_cpu_signal_handler(int signum) {
-    if (signum == SIGKVMEXIT) {
-        if (current_kvm_cpu && current_kvm_cpu->is_running)
-            current_kvm_cpu->is_running = false;
-    } else if (signum == SIGKVMPAUSE) {
-        if (current_kvm_cpu->paused)
-            die("Pause signaled for already paused CPU\n");
+    if (current_kvm_cpu)
+        current_kvm_cpu->kvm_run->immediate_exit = 1;
+}
 
-        /* pause_lock is held by kvm_pause() */
-        current_kvm_cpu->paused = 1;
+/* Get a vCPU to look at its requests, with a signal only if it may be in the guest */
+static void kvm_cpu__kick(struct kvm_cpu *vcpu) {
+    if (vcpu == current_kvm_cpu || !vcpu->thread)
+        return;
 
-        /*
-         * This is a blocking function and uses locks. It is safe
-         * to call it for this signal as a second pause event should
-         * not be send to this thread until it acquires and releases
-         * the pause_lock.
-         */
-        kvm_notify_paused();
-    }
+    if (__atomic_load_n(&vcpu->in_guest, __ATOMIC_SEQ_CST))
+        pthread_kill(vcpu->thread, SIGKVMKICK);
+}
+
+/*
+ * Returns whether the vCPU will handle the request. One that stopped
+ * running only handles those it took before it last looked, see
+ * kvm_cpu__stop(), the others are taken back.
+ */
+bool kvm_cpu__request(struct kvm_cpu *vcpu, int req) {
+    __atomic_fetch_or(&vcpu->requests, 1UL << req, __ATOMIC_SEQ_CST);
+
+    /* A paused vCPU waits for the pause to end, or to be told to exit */
+    if (req == KVM_CPU_REQ_EXIT)
+        kvm_wake_paused(vcpu->kvm);
+
+    if (!__atomic_load_n(&vcpu->is_running, __ATOMIC_SEQ_CST))
+        return !(__atomic_fetch_and(&vcpu->requests, ~(1UL << req), __ATOMIC_SEQ_CST) & (1UL << req));
 
-    /* For SIGKVMTASK cpu->task is already set */
+    kvm_cpu__kick(vcpu);
+
+    return true;
+}
+
+bool kvm_cpu__has_request(struct kvm_cpu *vcpu, int req) {
+    return __atomic_load_n(&vcpu->requests, __ATOMIC_ACQUIRE) & (1UL << req);
 }
 
-static void kvm_cpu__handle_coalesced_mmio(struct kvm_cpu *cpu) {
-    if (cpu->ring) {
-        while (cpu->ring->first != cpu->ring->last) {
-            struct kvm_coalesced_mmio *m;
-            m = &cpu->ring->coalesced_mmio[cpu->ring->first];
+static DEFINE_MUTEX(coalesced_lock);
+
+/*
+ * The ring is shared by all vCPUs and drained by whichever exits first, so
+ * the writes queued on it are emulated once and in the order the guest made
+ * them, before the exit that follows them.
+ */
+static void kvm_cpu__handle_coalesced_io(struct kvm_cpu *cpu) {
+    struct kvm_coalesced_mmio_ring *ring = cpu->ring;
+    struct kvm_coalesced_mmio *m;
+
+    if (!ring || ring->first == ring->last)
+        return;
+
+    mutex_lock(&coalesced_lock);
+    while (ring->first != ring->last) {
+        /* Read the entry only after seeing it published */
+        rmb();
+        m = &ring->coalesced_mmio[ring->first];
+        if (m->pio)
+            kvm_cpu__emulate_io(cpu, m->phys_addr, m->data, KVM_EXIT_IO_OUT, m->len, 1);
+        else
             kvm_cpu__emulate_mmio(cpu, m->phys_addr, m->data, m->len, 1);
-            cpu->ring->first = (cpu->ring->first + 1) % KVM_COALESCED_MMIO_MAX;
-        }
+        ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
     }
+    mutex_unlock(&coalesced_lock);
 }
 
 static DEFINE_MUTEX(task_lock);
-static int task_eventfd;
+static DECLARE_COMPLETION(task_done);
 
 static void kvm_cpu__run_task(struct kvm_cpu *cpu) {
-    u64 inc = 1;
-
     pr_debug("Running task %p on cpu %lu", cpu->task, cpu->cpu_id);
 
-    /* Make sure we see the store to cpu->task */
-    rmb();
+    /* The request was made after the store to cpu->task */
     cpu->task->func(cpu, cpu->task->data);
 
     /* Clear task before we signal completion */
     cpu->task = NULL;
     wmb();
 
-    if (write(task_eventfd, &inc, sizeof(inc)) < 0)
-        die("Failed notifying of completed task.");
+    complete(&task_done);
 }
 
 void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task) {
-    int i, done = 0;
+    int i, nr_running = 0;
 
     pr_debug("Running task %p on all cpus", task);
 
@@ -140,37 +189,64 @@ void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task) {
         }
 
         kvm->cpus[i]->task = task;
-        wmb();
 
         if (kvm->cpus[i] == current_kvm_cpu)
             kvm_cpu__run_task(current_kvm_cpu);
-        else
-            pthread_kill(kvm->cpus[i]->thread, SIGKVMTASK);
+        else if (!kvm_cpu__request(kvm->cpus[i], KVM_CPU_REQ_TASK)) {
+            /* Stopped, the task can't run there */
+            kvm->cpus[i]->task = NULL;
+            continue;
+        }
+        nr_running++;
     }
 
-    while (done < kvm->nrcpus) {
-        u64 count;
+    wait_for_completions(&task_done, nr_running);
+
+    mutex_unlock(&task_lock);
+}
+
+/* Handle what other threads asked of this vCPU, between two runs */
+static void kvm_cpu__handle_requests(struct kvm_cpu *cpu) {
+    unsigned long requests;
 
-        if (read(task_eventfd, &count, sizeof(count)) < 0)
-            die("Failed reading task eventfd");
+    if (!__atomic_load_n(&cpu->requests, __ATOMIC_RELAXED))
+        return;
 
-        done += count;
+    requests = __atomic_exchange_n(&cpu->requests, 0, __ATOMIC_ACQUIRE);
+
+    if (requests & (1UL << KVM_CPU_REQ_EXIT))
+        __atomic_store_n(&cpu->is_running, 0, __ATOMIC_SEQ_CST);
+
+    if (requests & (1UL << KVM_CPU_REQ_TASK))
+        kvm_cpu__run_task(cpu);
+
+    if (requests & (1UL << KVM_CPU_REQ_PAUSE)) {
+        cpu->paused = 1;
+        kvm_notify_paused(cpu);
+        cpu->paused = 0;
     }
+}
 
-    mutex_unlock(&task_lock);
+/*
+ * Stop running, then handle the requests made so far. Those made later see
+ * is_running cleared and take theirs back, so that nobody waits forever on
+ * a completion this vCPU won't give.
+ */
+static void kvm_cpu__stop(struct kvm_cpu *cpu) {
+    __atomic_store_n(&cpu->is_running, 0, __ATOMIC_SEQ_CST);
+    kvm_cpu__handle_requests(cpu);
 }
 
 int kvm_cpu__start(struct kvm_cpu *cpu) {
     sigset_t sigset;
+    u64 start;
 
     sigemptyset(&sigset);
     sigaddset(&sigset, SIGALRM);
 
     pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-    signal(SIGKVMEXIT, kvm_cpu_signal_handler);
-    signal(SIGKVMPAUSE, kvm_cpu_signal_handler);
-    signal(SIGKVMTASK, kvm_cpu_signal_handler);
+    signal(SIGKVMKICK, kvm_cpu_signal_handler);
 
     kvm_cpu__reset_vcpu(cpu);
 
@@ -178,15 +254,15 @@ int kvm_cpu__start(struct kvm_cpu *cpu) {
         kvm_cpu__enable_singlestep(cpu);
 
     while (cpu->is_running) {
+        kvm_cpu__handle_requests(cpu);
+
         if (cpu->needs_nmi) {
             kvm_cpu__arch_nmi(cpu);
             cpu->needs_nmi = 0;
         }
 
-        if (cpu->task)
-            kvm_cpu__run_task(cpu);
-
         kvm_cpu__run(cpu);
+        start = kvm_stats_exit_begin(cpu);
 
         switch (cpu->kvm_run->exit_reason) {
             case KVM_EXIT_UNKNOWN:
@@ -198,6 +274,9 @@ int kvm_cpu__start(struct kvm_cpu *cpu) {
             case KVM_EXIT_IO: {
                 bool ret;
 
+                /* Like for MMIO, queued writes come before the exit */
+                kvm_cpu__handle_coalesced_io(cpu);
+
                 ret = kvm_cpu__emulate_io(cpu,
                                           cpu->kvm_run->io.port,
                                           (u8 *)cpu->kvm_run + cpu->kvm_run->io.data_offset,
@@ -216,7 +295,7 @@ int kvm_cpu__start(struct kvm_cpu *cpu) {
                  * If we had MMIO exit, coalesced ring should be processed
                  * *before* processing the exit itself
                  */
-                kvm_cpu__handle_coalesced_mmio(cpu);
+                kvm_cpu__handle_coalesced_io(cpu);
 
                 ret = kvm_cpu__emulate_mmio(cpu,
                                             cpu->kvm_run->mmio.phys_addr,
@@ -263,13 +342,16 @@ int kvm_cpu__start(struct kvm_cpu *cpu) {
                 break;
             }
         }
-        kvm_cpu__handle_coalesced_mmio(cpu);
+        kvm_stats_exit_done(cpu, cpu->kvm_run->exit_reason, start);
+        kvm_cpu__handle_coalesced_io(cpu);
     }
 
 exit_kvm:
+    kvm_cpu__stop(cpu);
     return 0;
 
 panic_kvm:
+    kvm_cpu__stop(cpu);
     return 1;
 }
 
@@ -288,12 +370,6 @@ int kvm_cpu__init(struct kvm *kvm) {
 
     kvm->nrcpus = kvm->cfg.nrcpus;
 
-    task_eventfd = eventfd(0, 0);
-    if (task_eventfd < 0) {
-        ERR("Couldn't create task_eventfd");
-        return task_eventfd;
-    }
-
     /* Alloc one pointer too many, so array ends up 0-terminated */
     kvm->cpus = calloc(kvm->nrcpus + 1, sizeof(void *));
     if (!kvm->cpus) {
@@ -309,6 +385,11 @@ int kvm_cpu__init(struct kvm *kvm) {
         }
     }
 
+    if (kvm_stats_init(kvm) < 0) {
+        ERR("Couldn't allocate exit statistics");
+        goto fail_alloc;
+    }
+
     return 0;
 
 fail_alloc:
@@ -321,27 +402,34 @@ int kvm_cpu__exit(struct kvm *kvm) {
     int i, r;
     void *ret = NULL;
 
+    kvm_stats_stop(kvm);
+
     kvm_cpu__delete(kvm->cpus[0]);
     kvm->cpus[0] = NULL;
 
     kvm_pause(kvm);
     for (i = 1; i < kvm->nrcpus; i++) {
-        if (kvm->cpus[i]->is_running) {
-            pthread_kill(kvm->cpus[i]->thread, SIGKVMEXIT);
+        /*
+         * A vCPU may have left its loop by itself and cleared is_running,
+         * but its thread still has to be reaped.
+         */
+        if (kvm->cpus[i]->thread) {
+            if (kvm->cpus[i]->is_running)
+                kvm_cpu__request(kvm->cpus[i], KVM_CPU_REQ_EXIT);
             if (pthread_join(kvm->cpus[i]->thread, &ret) != 0)
                 die("pthread_join");
-            kvm_cpu__delete(kvm->cpus[i]);
         }
+        kvm_cpu__delete(kvm->cpus[i]);
+        kvm->cpus[i] = NULL;
         if (ret == NULL)
             r = 0;
     }
     kvm_continue(kvm);
 
+    kvm_stats_exit(kvm);
     free(kvm->cpus);
 
     kvm->nrcpus = 0;
 
-    close(task_eventfd);
-
     return r;
 }
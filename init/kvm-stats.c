@@ -0,0 +1,388 @@
+#include "kvm/kvm-stats.h"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+
+/* Indexed by vCPU id */
+static struct kvm_cpu_stats *cpu_stats;
+static int nr_cpu_stats;
+
+/* Held by reports, which kvm_stats_stop() ends */
+static DEFINE_MUTEX(report_lock);
+static bool reporting;
+static int vm_stats_fd = -1;
+
+static struct kvm_cpu_stats *stats_of(struct kvm_cpu *vcpu) {
+    if (!vcpu || (int)vcpu->cpu_id >= nr_cpu_stats)
+        return NULL;
+
+    return &cpu_stats[vcpu->cpu_id];
+}
+
+/* Called by the vCPU thread for each emulated access */
+void kvm_stats_handler(struct kvm_cpu *vcpu, mmio_handler_fn fn, void *ptr, u64 addr, bool pio) {
+    struct kvm_cpu_stats *stats = stats_of(vcpu);
+    struct kvm_stats_handler *h;
+    unsigned int i, slot;
+
+    if (!stats)
+        return;
+
+    slot = (((unsigned long)fn ^ (unsigned long)ptr) >> 4) % KVM_STATS_HANDLERS;
+    for (i = 0; i < KVM_STATS_HANDLERS; i++, slot = (slot + 1) % KVM_STATS_HANDLERS) {
+        h = &stats->handlers[slot];
+        if (h->fn == fn && h->ptr == ptr)
+            goto found;
+        if (!h->fn) {
+            *h = (struct kvm_stats_handler){
+                .ptr = ptr,
+                .addr = addr,
+                .pio = pio,
+            };
+            h->fn = fn;
+            goto found;
+        }
+    }
+    h = &stats->other;
+
+found:
+    h->calls++;
+    stats->current = h;
+}
+
+/* Called by the vCPU thread when KVM_RUN returns */
+u64 kvm_stats_exit_begin(struct kvm_cpu *vcpu) {
+    struct kvm_cpu_stats *stats = stats_of(vcpu);
+
+    if (stats)
+        stats->current = NULL;
+
+    return kvm_stats_now();
+}
+
+/* Called by the vCPU thread once it handled an exit */
+void kvm_stats_exit_done(struct kvm_cpu *vcpu, u32 reason, u64 start) {
+    struct kvm_cpu_stats *stats = stats_of(vcpu);
+    u64 ns = kvm_stats_now() - start;
+    int bucket;
+
+    if (!stats)
+        return;
+
+    reason = min_t(u32, reason, KVM_STATS_EXIT_REASONS - 1);
+    bucket = min(ns ? 64 - __builtin_clzll(ns) : 0, KVM_STATS_BUCKETS - 1);
+
+    stats->exits[reason]++;
+    stats->exit_ns[reason] += ns;
+    stats->hist[bucket]++;
+    if (stats->current)
+        stats->current->ns += ns;
+}
+
+static void stats_fmt_ns(char *buf, size_t size, u64 ns) {
+    if (ns < 1000)
+        snprintf(buf, size, "%lluns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+}
+
+static const char *stats_exit_name(u32 reason, char *buf, size_t size) {
+    if (reason < kvm_nr_exit_reasons && kvm_exit_reasons[reason])
+        return kvm_exit_reasons[reason];
+
+    snprintf(buf, size, "exit %u%s", reason, reason == KVM_STATS_EXIT_REASONS - 1 ? "+" : "");
+
+    return buf;
+}
+
+/* Look a function up in the symbol table of the object file, static ones included */
+static bool stats_symtab_name(const char *path, uintptr_t value, char *buf, size_t size) {
+    const Elf64_Ehdr *ehdr;
+    const Elf64_Shdr *shdr;
+    const Elf64_Sym *sym;
+    const char *strtab;
+    struct stat st;
+    bool found = false;
+    void *map;
+    size_t i, j;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*ehdr)) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    ehdr = map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shoff + (u64)ehdr->e_shnum * sizeof(*shdr) > (u64)st.st_size)
+        goto out;
+
+    shdr = map + ehdr->e_shoff;
+    for (i = 0; i < ehdr->e_shnum && !found; i++) {
+        if (shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum ||
+            shdr[i].sh_offset + shdr[i].sh_size > (u64)st.st_size ||
+            shdr[shdr[i].sh_link].sh_offset + shdr[shdr[i].sh_link].sh_size > (u64)st.st_size)
+            continue;
+
+        sym = map + shdr[i].sh_offset;
+        strtab = map + shdr[shdr[i].sh_link].sh_offset;
+        for (j = 0; j < shdr[i].sh_size / sizeof(*sym); j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value != value ||
+                sym[j].st_name >= shdr[shdr[i].sh_link].sh_size)
+                continue;
+            strlcpy(buf, strtab + sym[j].st_name, size);
+            found = true;
+            break;
+        }
+    }
+
+out:
+    munmap(map, st.st_size);
+    return found;
+}
+
+/*
+ * Name of a handler function. Most are static, so the dynamic symbols
+ * dladdr() knows are only tried first, then the full symbol table.
+ */
+static const char *stats_fn_name(void *fn, char *buf, size_t size) {
+    Dl_info info;
+
+    if (dladdr(fn, &info) && info.dli_fname) {
+        if (info.dli_sname && info.dli_saddr == fn)
+            return info.dli_sname;
+        if (stats_symtab_name(info.dli_fname, (uintptr_t)fn - (uintptr_t)info.dli_fbase, buf, size) ||
+            stats_symtab_name(info.dli_fname, (uintptr_t)fn, buf, size))
+            return buf;
+    }
+
+    snprintf(buf, size, "%p", fn);
+
+    return buf;
+}
+
+/*
+ * The counters KVM keeps itself, halt polling among them, from a binary
+ * stats fd. Histograms are summed up, and zero counters skipped.
+ */
+static void stats_report_kvm(FILE *out, int fd) {
+    struct kvm_stats_header header;
+    struct kvm_stats_desc *desc;
+    size_t desc_size;
+    u64 *values;
+    char *descs = NULL;
+    u64 value, polls = 0, polled = 0;
+    int i, j;
+
+    if (fd < 0)
+        return;
+
+    if (pread_in_full(fd, &header, sizeof(header), 0) != sizeof(header))
+        goto out;
+
+    desc_size = sizeof(*desc) + header.name_size;
+    descs = malloc(desc_size * header.num_desc);
+    if (!descs || pread_in_full(fd, descs, desc_size * header.num_desc, header.desc_offset) < 0)
+        goto out;
+
+    for (i = 0; i < (int)header.num_desc; i++) {
+        desc = (void *)descs + i * desc_size;
+
+        values = calloc(desc->size, sizeof(*values));
+        if (!values)
+            break;
+        if (pread_in_full(fd, values, desc->size * sizeof(*values), header.data_offset + desc->offset) < 0) {
+            free(values);
+            break;
+        }
+
+        for (j = 0, value = 0; j < desc->size; j++) value += values[j];
+        free(values);
+
+        if (value)
+            fprintf(out, "    %-32s %llu\n", desc->name, value);
+
+        if (!strcmp(desc->name, "halt_attempted_poll"))
+            polls = value;
+        else if (!strcmp(desc->name, "halt_successful_poll"))
+            polled = value;
+    }
+
+    /* How often polling caught the wakeup, sparing the vCPU a sleep */
+    if (polls)
+        fprintf(out, "    %-32s %.1f%%\n", "halt poll success rate", polled * 100.0 / polls);
+
+out:
+    free(descs);
+}
+
+static void stats_report_cpu(FILE *out, struct kvm_cpu *vcpu, struct kvm_cpu_stats *stats) {
+    struct kvm_stats_handler *h;
+    u64 exits = 0, ns = 0;
+    char name[64], t1[16], t2[16];
+    int i;
+
+    for (i = 0; i < KVM_STATS_EXIT_REASONS; i++) {
+        exits += stats->exits[i];
+        ns += stats->exit_ns[i];
+    }
+
+    stats_fmt_ns(t1, sizeof(t1), ns);
+    fprintf(out, "vCPU %lu: %llu exits, %s in userspace\n", vcpu->cpu_id, exits, t1);
+
+    fprintf(out, "  exits:\n");
+    for (i = 0; i < KVM_STATS_EXIT_REASONS; i++) {
+        if (!stats->exits[i])
+            continue;
+        stats_fmt_ns(t1, sizeof(t1), stats->exit_ns[i] / stats->exits[i]);
+        fprintf(out, "    %-32s %-12llu avg %s\n", stats_exit_name(i, name, sizeof(name)), stats->exits[i], t1);
+    }
+
+    fprintf(out, "  userspace time per exit:\n");
+    for (i = 0; i < KVM_STATS_BUCKETS; i++) {
+        if (!stats->hist[i])
+            continue;
+        stats_fmt_ns(t1, sizeof(t1), i ? 1ULL << (i - 1) : 0);
+        stats_fmt_ns(t2, sizeof(t2), 1ULL << i);
+        fprintf(out, "    %8s - %-8s %llu%s\n", t1, t2, stats->hist[i], i == KVM_STATS_BUCKETS - 1 ? " and above" : "");
+    }
+
+    fprintf(out, "  handlers:\n");
+    for (i = 0; i <= KVM_STATS_HANDLERS; i++) {
+        h = i < KVM_STATS_HANDLERS ? &stats->handlers[i] : &stats->other;
+        if (!h->calls)
+            continue;
+        stats_fmt_ns(t1, sizeof(t1), h->ns);
+        if (h == &stats->other)
+            fprintf(out, "    %-32s %-12llu %s\n", "others", h->calls, t1);
+        else
+            fprintf(out,
+                    "    %s %-#10llx %-32s %-12llu %s\n",
+                    h->pio ? "pio " : "mmio",
+                    h->addr,
+                    stats_fn_name((void *)h->fn, name, sizeof(name)),
+                    h->calls,
+                    t1);
+    }
+
+    fprintf(out, "  kvm:\n");
+    stats_report_kvm(out, vcpu->stats_fd);
+}
+
+/* Write a report on all vCPUs to fd, as its length and then its text */
+int kvm_stats_report(struct kvm *kvm, int fd) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out;
+    u32 len;
+    int i, r = 0;
+
+    out = open_memstream(&buf, &size);
+    if (!out)
+        return -errno;
+
+    /* vCPUs only go away once reports are over */
+    mutex_lock(&report_lock);
+    if (reporting) {
+        for (i = 0; i < nr_cpu_stats; i++)
+            if (kvm->cpus[i])
+                stats_report_cpu(out, kvm->cpus[i], &cpu_stats[i]);
+
+        fprintf(out, "VM:\n  kvm:\n");
+        stats_report_kvm(out, vm_stats_fd);
+        virtio_irq_mod__report(out);
+    }
+    mutex_unlock(&report_lock);
+    fclose(out);
+
+    len = size;
+    if (write_in_full(fd, &len, sizeof(len)) < 0 || write_in_full(fd, buf, len) < 0)
+        r = -errno;
+
+    free(buf);
+
+    return r;
+}
+
+static void handle_exit_stats(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg) {
+    if (WARN_ON(type != KVM_IPC_EXIT_STATS || len))
+        return;
+
+    if (kvm_stats_report(kvm, fd) < 0)
+        pr_warning("Failed sending exit statistics");
+}
+
+/*
+ * KVM_GET_STATS_FD takes the vCPU mutex, held for as long as the vCPU is in
+ * KVM_RUN. Stats fds are opened once here, before any vCPU runs, and reports
+ * only read them.
+ */
+int kvm_stats_init(struct kvm *kvm) {
+    int i;
+
+    cpu_stats = calloc(kvm->nrcpus, sizeof(*cpu_stats));
+    if (!cpu_stats)
+        return -ENOMEM;
+
+    nr_cpu_stats = kvm->nrcpus;
+
+    for (i = 0; i < kvm->nrcpus; i++) kvm->cpus[i]->stats_fd = ioctl(kvm->cpus[i]->vcpu_fd, KVM_GET_STATS_FD, NULL);
+    vm_stats_fd = ioctl(kvm->vm_fd, KVM_GET_STATS_FD, NULL);
+    reporting = true;
+
+    return kvm_ipc__register_handler(KVM_IPC_EXIT_STATS, handle_exit_stats);
+}
+
+/* No more reports, before vCPUs are deleted */
+void kvm_stats_stop(struct kvm *kvm) {
+    int i;
+
+    kvm_ipc__register_handler(KVM_IPC_EXIT_STATS, NULL);
+
+    /* Waits for a report already running */
+    mutex_lock(&report_lock);
+    reporting = false;
+    for (i = 0; i < nr_cpu_stats; i++) {
+        if (kvm->cpus[i] && kvm->cpus[i]->stats_fd >= 0)
+            close(kvm->cpus[i]->stats_fd);
+    }
+    if (vm_stats_fd >= 0)
+        close(vm_stats_fd);
+    vm_stats_fd = -1;
+    mutex_unlock(&report_lock);
+}
+
+/* Once vCPU threads, which count their exits, are gone */
+void kvm_stats_exit(struct kvm *kvm) {
+    nr_cpu_stats = 0;
+    free(cpu_stats);
+    cpu_stats = NULL;
+}
@@ -14,7 +14,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -24,9 +23,12 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "kvm/completion.h"
+#include "kvm/idle.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm-ipc.h"
 #include "kvm/mutex.h"
+#include "kvm/placement.h"
 #include "kvm/read-write.h"
 #include "kvm/strbuf.h"
 #include "kvm/util.h"
@@ -46,10 +48,17 @@ const char *kvm_exit_reasons[] = {
 #ifdef CONFIG_PPC64
     DEFINE_KVM_EXIT_REASON(KVM_EXIT_PAPR_HCALL),
 #endif
+    DEFINE_KVM_EXIT_REASON(KVM_EXIT_SYSTEM_EVENT),
 };
+const unsigned int kvm_nr_exit_reasons = ARRAY_SIZE(kvm_exit_reasons);
 
-static int pause_event;
+/* Held from kvm_pause() to kvm_continue() */
 static DEFINE_MUTEX(pause_lock);
+static DECLARE_COMPLETION(pause_done);
+/* Paused vCPUs wait on resume_cond until the pause they saw ends */
+static DEFINE_MUTEX(resume_lock);
+static pthread_cond_t resume_cond = PTHREAD_COND_INITIALIZER;
+static u64 pause_gen;
 extern struct kvm_ext kvm_req_ext[];
 
 static char kvm_dir[PATH_MAX];
@@ -445,11 +454,28 @@ int kvm_init(struct kvm *kvm) {
         goto err_vm_fd;
     }
 
+    /* Exits can only be disabled before vCPUs are created */
+    ret = kvm_idle_init(kvm);
+    if (ret < 0)
+        goto err_vm_fd;
+
+    ret = kvm_placement_init(kvm);
+    if (ret < 0)
+        goto err_vm_fd;
+
     kvm_arch_init(kvm);
 
+    ret = kvm_placement_bind_ram(kvm);
+    if (ret < 0)
+        goto err_vm_fd;
+
     INIT_LIST_HEAD(&kvm->mem_banks);
     kvm_init_ram(kvm);
 
+    ret = kvm_placement_prealloc_ram(kvm);
+    if (ret < 0)
+        goto err_vm_fd;
+
     if (!kvm->cfg.firmware_filename) {
         if (!kvm_load_kernel(kvm, kvm->cfg.kernel_path, kvm->cfg.initrd_filename, kvm->cfg.real_cmdline))
             die("unable to load kernel %s", kvm->cfg.kernel_path);
@@ -537,15 +563,25 @@ void kvm_vm_exit(struct kvm *kvm) {
     if (!kvm->cpus[0] || kvm->cpus[0]->thread == 0)
         return;
 
-    pthread_kill(kvm->cpus[0]->thread, SIGKVMEXIT);
+    kvm_cpu__request(kvm->cpus[0], KVM_CPU_REQ_EXIT);
 }
 
 void kvm_continue(struct kvm *kvm) {
+    mutex_lock(&resume_lock);
+    pause_gen++;
+    pthread_cond_broadcast(&resume_cond);
+    mutex_unlock(&resume_lock);
+
     mutex_unlock(&pause_lock);
 }
 
+/*
+ * Stop all vCPUs outside the guest until kvm_continue(). Each is asked to
+ * pause and only kicked out of KVM_RUN if it is in it, so this takes about
+ * as long as the slowest vCPU takes to finish its current exit.
+ */
 void kvm_pause(struct kvm *kvm) {
-    int i, paused_vcpus = 0;
+    int i, pausing_vcpus = 0;
 
     mutex_lock(&pause_lock);
 
@@ -553,33 +589,37 @@ void kvm_pause(struct kvm *kvm) {
     if (!kvm->cpus || !kvm->cpus[0] || kvm->cpus[0]->thread == 0)
         return;
 
-    pause_event = eventfd(0, 0);
-    if (pause_event < 0)
-        die("Failed creating pause notification event");
     for (i = 0; i < kvm->nrcpus; i++) {
-        if (kvm->cpus[i]->is_running && kvm->cpus[i]->paused == 0)
-            pthread_kill(kvm->cpus[i]->thread, SIGKVMPAUSE);
-        else
-            paused_vcpus++;
+        /* A vCPU pausing the others is out of the guest already */
+        if (kvm->cpus[i] != current_kvm_cpu && kvm_cpu__request(kvm->cpus[i], KVM_CPU_REQ_PAUSE))
+            pausing_vcpus++;
     }
 
-    while (paused_vcpus < kvm->nrcpus) {
-        u64 cur_read;
-
-        if (read(pause_event, &cur_read, sizeof(cur_read)) < 0)
-            die("Failed reading pause event");
-        paused_vcpus += cur_read;
-    }
-    close(pause_event);
+    wait_for_completions(&pause_done, pausing_vcpus);
 }
 
-void kvm_notify_paused(void) {
-    u64 p = 1;
+/*
+ * Called by a vCPU thread once it stopped for a pause. Returns when the
+ * pause ends, or when the vCPU has to exit.
+ */
+void kvm_notify_paused(struct kvm_cpu *vcpu) {
+    u64 gen;
+
+    mutex_lock(&resume_lock);
+    gen = pause_gen;
+    mutex_unlock(&resume_lock);
 
-    if (write(pause_event, &p, sizeof(p)) < 0)
-        die("Failed notifying of paused VCPU.");
+    complete(&pause_done);
 
-    mutex_lock(&pause_lock);
-    current_kvm_cpu->paused = 0;
-    mutex_unlock(&pause_lock);
+    mutex_lock(&resume_lock);
+    while (pause_gen == gen && vcpu->is_running && !kvm_cpu__has_request(vcpu, KVM_CPU_REQ_EXIT))
+        pthread_cond_wait(&resume_cond, &resume_lock.mutex);
+    mutex_unlock(&resume_lock);
+}
+
+/* Have paused vCPUs check again whether they have to exit */
+void kvm_wake_paused(struct kvm *kvm) {
+    mutex_lock(&resume_lock);
+    pthread_cond_broadcast(&resume_cond);
+    mutex_unlock(&resume_lock);
 }
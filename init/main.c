@@ -25,9 +25,113 @@ int main(int argc, const char **argv) {
         ARG_STR(&kemu_vm.cfg.kernel_cmdline, NULL, "--append", "kernel cmdline", " <cmdline>", NULL),
         ARG_STR(&kemu_vm.cfg.ram_size_str, "-m", NULL, "memory size", " <memory-size>", "memory"),
         ARG_INT(&kemu_vm.cfg.nrcpus, NULL, "--smp", "cpu number", " <cpus>", "cpu"),
+        ARG_STR(&kemu_vm.cfg.vcpu_affinity,
+                NULL,
+                "--vcpu-affinity",
+                "host cpus of each vcpu, separated by ':' and reused round robin",
+                " <cpus>[:<cpus>...]",
+                "vcpu-affinity"),
+        ARG_STR(&kemu_vm.cfg.io_affinity,
+                NULL,
+                "--io-affinity",
+                "host cpus of the device and I/O threads",
+                " <cpus>",
+                "io-affinity"),
+        ARG_STR(&kemu_vm.cfg.mem_nodes,
+                NULL,
+                "--mem-nodes",
+                "host NUMA nodes guest memory is split over",
+                " <nodes>",
+                "mem-nodes"),
+        ARG_STR(&kemu_vm.cfg.numa,
+                NULL,
+                "--numa",
+                "guest numa nodes: their vcpus, memory size and optional host node",
+                " <vcpus>/<size>[/<host-node>][:...]",
+                "numa"),
+        ARG_STR(&kemu_vm.cfg.mem_backend_name,
+                NULL,
+                "--mem-backend",
+                "guest memory backend: anon, thp, memfd, memfd-2M or memfd-1G",
+                " <backend>",
+                "mem-backend"),
+        ARG_BOOLEAN(&kemu_vm.cfg.mem_prealloc,
+                    NULL,
+                    "--mem-prealloc",
+                    "fault in guest memory in parallel at startup",
+                    NULL,
+                    "mem-prealloc"),
+        ARG_BOOLEAN(&kemu_vm.cfg.ksm, NULL, "--ksm", "let ksm merge identical guest pages", NULL, "ksm"),
+        ARG_STR(&kemu_vm.cfg.idle_policy,
+                NULL,
+                "--idle-policy",
+                "what idle vcpus do: default, latency or consolidate",
+                " <policy>",
+                "idle-policy"),
+        ARG_STR(&kemu_vm.cfg.halt_poll_ns_str,
+                NULL,
+                "--halt-poll-ns",
+                "how long kvm polls before a halted vcpu sleeps",
+                " <ns>",
+                "halt-poll-ns"),
+        ARG_STR(&kemu_vm.cfg.disable_exits,
+                NULL,
+                "--disable-exits",
+                "idle instructions that don't exit: hlt, mwait, pause, cstate or all",
+                " <exit>[,<exit>...]",
+                "disable-exits"),
         // storage options
         ARG_STR(&kemu_vm.cfg.disk_path, NULL, "--disk", "disk path", " <disk>", "disk"),
+        ARG_STR(&kemu_vm.cfg.vhost_user_blk,
+                NULL,
+                "--vhost-user-blk",
+                "virtio-blk backed by a vhost-user backend",
+                " <socket>",
+                "vhost-user-blk"),
+        // virtio options
+        ARG_STR(&kemu_vm.cfg.virtio_transport_name,
+                NULL,
+                "--virtio-transport",
+                "virtio transport: pci, pci-legacy, mmio or mmio-legacy",
+                " <transport>",
+                "virtio-transport"),
+        ARG_INT(&kemu_vm.cfg.virtio_irq_frames,
+                NULL,
+                "--virtio-irq-frames",
+                "completions to batch per virtqueue interrupt",
+                " <n>",
+                "virtio-irq-frames"),
+        ARG_INT(&kemu_vm.cfg.virtio_irq_usecs,
+                NULL,
+                "--virtio-irq-usecs",
+                "max delay of a batched virtqueue interrupt",
+                " <usecs>",
+                "virtio-irq-usecs"),
+        ARG_BOOLEAN(&kemu_vm.cfg.virtio_irq_adaptive,
+                    NULL,
+                    "--virtio-irq-adaptive",
+                    "adapt virtqueue interrupt batching to load",
+                    NULL,
+                    "virtio-irq-adaptive"),
         // network options
+        ARG_STR(&kemu_vm.cfg.vhost_user_net,
+                NULL,
+                "--vhost-user-net",
+                "virtio-net backed by a vhost-user backend",
+                " <socket>",
+                "vhost-user-net"),
+        ARG_STR(&kemu_vm.cfg.net_packet,
+                NULL,
+                "--net-packet",
+                "virtio-net backed by a packet socket on a host interface",
+                " <ifname>",
+                "net-packet"),
+        ARG_STR(&kemu_vm.cfg.net_xdp,
+                NULL,
+                "--net-xdp",
+                "virtio-net backed by XDP sockets on a host interface",
+                " <ifname>",
+                "net-xdp"),
         ARG_BOOLEAN(NULL, "-h", "--help", "show help information", NULL, "help"),
         ARG_BOOLEAN(NULL, "-v", "--version", "show version", NULL, "version"),
         ARG_END()};
@@ -1,47 +1,100 @@
 #include <errno.h>
 #include <linux/err.h>
 #include <linux/kvm.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
 #include <linux/types.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 
+#include "kvm/barrier.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/kvm-stats.h"
 #include "kvm/kvm.h"
 #include "kvm/mutex.h"
 #include "kvm/rbtree-interval.h"
 
 #define mmio_node(n) rb_entry(n, struct mmio_mapping, node)
 
+/* Regions each vCPU remembers, per bus */
+#define MMIO_CACHE_SIZE 4
+
+/* The port space is indexed directly, through pages allocated where ports are registered */
+#define MMIO_PORTS           0x10000
+#define MMIO_PORT_PAGE_SHIFT 8
+#define MMIO_PORT_PAGE_SIZE  (1 << MMIO_PORT_PAGE_SHIFT)
+#define MMIO_PORT_PAGES      (MMIO_PORTS >> MMIO_PORT_PAGE_SHIFT)
+
+/*
+ * Serializes the writers: registration, removal and the table snapshots
+ * published for the readers.
+ */
 static DEFINE_MUTEX(mmio_lock);
 
 struct mmio_mapping {
     struct rb_int_node node;
     mmio_handler_fn mmio_fn;
     void *ptr;
+    /* One held by the table the mapping is in, one by each emulation using it */
     u32 refcount;
-    bool remove;
+    /* Writes are queued on the coalesced ring rather than exiting */
+    bool coalesced;
+    bool pio;
 };
 
-static struct rb_root mmio_tree = RB_ROOT;
-static struct rb_root pio_tree = RB_ROOT;
+struct mmio_range {
+    u64 start;
+    u64 end;
+    struct mmio_mapping *mmio;
+};
 
-static struct mmio_mapping *mmio_search(struct rb_root *root, u64 addr, u64 len) {
-    struct rb_int_node *node;
+/*
+ * Immutable sorted copy of a tree. Emulation searches the current one
+ * without taking mmio_lock, writers replace it and only free the old one
+ * once no vCPU may still be looking at it.
+ */
+struct mmio_table {
+    /* Changes with every table, unlike its address */
+    u64 gen;
+    /* The mapping of each port, for the PIO bus only */
+    struct mmio_mapping **ports[MMIO_PORT_PAGES];
+    u32 nr;
+    struct mmio_range ranges[];
+};
 
-    /* If len is zero or if there's an overflow, the MMIO op is invalid. */
-    if (addr + len <= addr)
-        return NULL;
+/*
+ * A thread emulating accesses. Its sequence is odd while it searches a
+ * table and takes a reference on what it found.
+ */
+struct mmio_reader {
+    struct list_head list;
+    u64 seq;
+};
 
-    node = rb_int_search_range(root, addr, addr + len);
-    if (node == NULL)
-        return NULL;
+/* The last regions a vCPU hit, valid as long as the table doesn't change */
+struct mmio_cache {
+    u64 gen;
+    u32 next;
+    struct mmio_range ranges[MMIO_CACHE_SIZE];
+};
 
-    return mmio_node(node);
-}
+enum mmio_bus {
+    MMIO_BUS_MMIO,
+    MMIO_BUS_PIO,
+    MMIO_BUS_NR,
+};
+
+static struct rb_root mmio_trees[MMIO_BUS_NR] = {RB_ROOT, RB_ROOT};
+static struct mmio_table *mmio_tables[MMIO_BUS_NR];
+static u64 mmio_gen;
+static LIST_HEAD(mmio_readers);
+
+static __thread struct mmio_reader *mmio_reader;
+static __thread struct mmio_cache mmio_caches[MMIO_BUS_NR];
 
-/* Find lowest match, Check for overlap */
 static struct mmio_mapping *mmio_search_single(struct rb_root *root, u64 addr) {
     struct rb_int_node *node;
 
@@ -67,44 +120,241 @@ static const char *to_direction(u8 is_write) {
     return "read";
 }
 
-static struct mmio_mapping *mmio_get(struct rb_root *root, u64 phys_addr, u32 len) {
-    struct mmio_mapping *mmio;
+static struct mmio_reader *mmio_read_lock(void) {
+    struct mmio_reader *reader = mmio_reader;
 
-    mutex_lock(&mmio_lock);
-    mmio = mmio_search(root, phys_addr, len);
-    if (mmio)
-        mmio->refcount++;
-    mutex_unlock(&mmio_lock);
+    if (!reader) {
+        reader = calloc(1, sizeof(*reader));
+        if (!reader)
+            die("Failed allocating MMIO reader");
+
+        mutex_lock(&mmio_lock);
+        list_add(&reader->list, &mmio_readers);
+        mutex_unlock(&mmio_lock);
+        mmio_reader = reader;
+    }
+
+    /* A full barrier too: writers must see us reading before we load the table */
+    __atomic_exchange_n(&reader->seq, reader->seq + 1, __ATOMIC_SEQ_CST);
+
+    return reader;
+}
+
+static void mmio_read_unlock(struct mmio_reader *reader) {
+    __atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every reader that may have seen a table we just replaced is
+ * done with it. Readers never block while reading, so this is short.
+ * Called with mmio_lock held.
+ */
+static void mmio_synchronize(void) {
+    struct mmio_reader *reader;
+    u64 seq;
+
+    mb();
+    list_for_each_entry(reader, &mmio_readers, list) {
+        seq = __atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1))
+            continue;
+
+        while (__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) == seq) sched_yield();
+    }
+    mb();
+}
+
+static void mmio_table_free(struct mmio_table *table) {
+    u32 i;
+
+    for (i = 0; i < MMIO_PORT_PAGES; i++) free(table->ports[i]);
+    free(table);
+}
+
+/* Point every port of the ranges of a PIO table at its mapping */
+static int mmio_table_map_ports(struct mmio_table *table) {
+    struct mmio_mapping ***page;
+    struct mmio_range *range;
+    u64 port;
+    u32 i;
+
+    for (i = 0; i < table->nr; i++) {
+        range = &table->ranges[i];
+
+        for (port = range->start; port < range->end && port < MMIO_PORTS; port++) {
+            page = &table->ports[port >> MMIO_PORT_PAGE_SHIFT];
+            if (!*page) {
+                *page = calloc(MMIO_PORT_PAGE_SIZE, sizeof(**page));
+                if (!*page)
+                    return -ENOMEM;
+            }
+
+            (*page)[port & (MMIO_PORT_PAGE_SIZE - 1)] = range->mmio;
+        }
+    }
+
+    return 0;
+}
+
+/* Publish a new snapshot of the tree of a bus. Called with mmio_lock held */
+static int mmio_table_update(enum mmio_bus bus) {
+    struct mmio_table *table, *old = mmio_tables[bus];
+    struct rb_node *node;
+    u32 nr = 0;
+
+    for (node = rb_first(&mmio_trees[bus]); node; node = rb_next(node)) nr++;
+
+    table = calloc(1, sizeof(*table) + nr * sizeof(table->ranges[0]));
+    if (!table)
+        return -ENOMEM;
+
+    table->gen = ++mmio_gen;
+    table->nr = 0;
+    for (node = rb_first(&mmio_trees[bus]); node; node = rb_next(node)) {
+        struct rb_int_node *range = rb_int(node);
+
+        table->ranges[table->nr++] = (struct mmio_range){
+            .start = range->low,
+            .end = range->high,
+            .mmio = mmio_node(range),
+        };
+    }
+
+    if (bus == MMIO_BUS_PIO && mmio_table_map_ports(table) < 0) {
+        mmio_table_free(table);
+        return -ENOMEM;
+    }
+
+    __atomic_store_n(&mmio_tables[bus], table, __ATOMIC_RELEASE);
+    if (old) {
+        mmio_synchronize();
+        mmio_table_free(old);
+    }
+
+    return 0;
+}
+
+static bool mmio_range_match(struct mmio_range *range, u64 addr, u64 end) {
+    return range->start <= addr && end <= range->end;
+}
+
+static struct mmio_range *mmio_table_search(struct mmio_table *table, u64 addr, u64 end) {
+    u32 lo = 0, hi = table->nr, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (addr < table->ranges[mid].start)
+            hi = mid;
+        else if (table->ranges[mid].end <= addr)
+            lo = mid + 1;
+        else
+            return end <= table->ranges[mid].end ? &table->ranges[mid] : NULL;
+    }
+
+    return NULL;
+}
+
+static struct mmio_mapping *mmio_table_port(struct mmio_table *table, u64 port) {
+    struct mmio_mapping **page = table->ports[port >> MMIO_PORT_PAGE_SHIFT];
+
+    return page ? page[port & (MMIO_PORT_PAGE_SIZE - 1)] : NULL;
+}
+
+/*
+ * Find the mapping of an access and take a reference on it, without any
+ * shared lock. Ports are looked up directly, for memory the regions a vCPU
+ * hit last are checked first.
+ */
+static struct mmio_mapping *mmio_get(enum mmio_bus bus, u64 phys_addr, u32 len) {
+    struct mmio_cache *cache = &mmio_caches[bus];
+    struct mmio_mapping *mmio = NULL;
+    struct mmio_reader *reader;
+    struct mmio_range *range;
+    struct mmio_table *table;
+    u64 end = phys_addr + len;
+    u32 i;
+
+    /* If len is zero or if there's an overflow, the MMIO op is invalid. */
+    if (end <= phys_addr)
+        return NULL;
+
+    reader = mmio_read_lock();
+
+    table = __atomic_load_n(&mmio_tables[bus], __ATOMIC_ACQUIRE);
+    if (!table)
+        goto out;
+
+    /* Mappings don't overlap, so an access within one has it at both ends */
+    if (bus == MMIO_BUS_PIO && end <= MMIO_PORTS) {
+        mmio = mmio_table_port(table, phys_addr);
+        if (mmio && mmio == mmio_table_port(table, end - 1))
+            goto found;
+
+        mmio = NULL;
+        goto out;
+    }
+
+    if (cache->gen == table->gen) {
+        for (i = 0; i < MMIO_CACHE_SIZE; i++) {
+            if (cache->ranges[i].mmio && mmio_range_match(&cache->ranges[i], phys_addr, end)) {
+                mmio = cache->ranges[i].mmio;
+                goto found;
+            }
+        }
+    } else {
+        memset(cache, 0, sizeof(*cache));
+        cache->gen = table->gen;
+    }
+
+    range = mmio_table_search(table, phys_addr, end);
+    if (!range)
+        goto out;
+
+    mmio = range->mmio;
+    cache->ranges[cache->next++ % MMIO_CACHE_SIZE] = *range;
+
+found:
+    /* The table still holds its reference, so this never revives a mapping */
+    __atomic_fetch_add(&mmio->refcount, 1, __ATOMIC_RELAXED);
+out:
+    mmio_read_unlock(reader);
 
     return mmio;
 }
 
-/* Called with mmio_lock held. */
-static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio) {
+static void mmio_put(struct kvm *kvm, struct mmio_mapping *mmio) {
     struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone){
         .addr = rb_int_start(&mmio->node),
         .size = 1,
+        .pio = mmio->pio,
     };
-    ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
 
-    mmio_remove(root, mmio);
-    free(mmio);
-}
+    if (__atomic_sub_fetch(&mmio->refcount, 1, __ATOMIC_ACQ_REL))
+        return;
 
-static void mmio_put(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio) {
-    mutex_lock(&mmio_lock);
-    mmio->refcount--;
-    if (mmio->remove && mmio->refcount == 0)
-        mmio_deregister(kvm, root, mmio);
-    mutex_unlock(&mmio_lock);
+    if (mmio->coalesced)
+        ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    free(mmio);
 }
 
 static bool trap_is_mmio(unsigned int flags) {
     return (flags & IOTRAP_BUS_MASK) == DEVICE_BUS_MMIO;
 }
 
+/*
+ * Coalescing is only an optimization: without support for it on the bus,
+ * writes simply exit like any other access.
+ */
+static bool trap_can_coalesce(struct kvm *kvm, unsigned int flags) {
+    if (!(flags & IOTRAP_COALESCE))
+        return false;
+
+    return kvm_supports_extension(kvm, trap_is_mmio(flags) ? KVM_CAP_COALESCED_MMIO : KVM_CAP_COALESCED_PIO);
+}
+
 int kvm_register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len, mmio_handler_fn mmio_fn, void *ptr,
                         unsigned int flags) {
+    enum mmio_bus bus = trap_is_mmio(flags) ? MMIO_BUS_MMIO : MMIO_BUS_PIO;
     struct mmio_mapping *mmio;
     struct kvm_coalesced_mmio_zone zone;
     int ret;
@@ -117,18 +367,17 @@ int kvm_register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len, mmio_
         .node = RB_INT_INIT(phys_addr, phys_addr + phys_addr_len),
         .mmio_fn = mmio_fn,
         .ptr = ptr,
-        /*
-         * Start from 0 because kvm_deregister_mmio() doesn't decrement
-         * the reference count.
-         */
-        .refcount = 0,
-        .remove = false,
+        /* The reference of the table, dropped by kvm_deregister_iotrap() */
+        .refcount = 1,
+        .coalesced = trap_can_coalesce(kvm, flags),
+        .pio = !trap_is_mmio(flags),
     };
 
-    if (trap_is_mmio(flags) && (flags & IOTRAP_COALESCE)) {
+    if (mmio->coalesced) {
         zone = (struct kvm_coalesced_mmio_zone){
             .addr = phys_addr,
             .size = phys_addr_len,
+            .pio = mmio->pio,
         };
         ret = ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
         if (ret < 0) {
@@ -138,46 +387,53 @@ int kvm_register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len, mmio_
     }
 
     mutex_lock(&mmio_lock);
-    if (trap_is_mmio(flags))
-        ret = mmio_insert(&mmio_tree, mmio);
-    else
-        ret = mmio_insert(&pio_tree, mmio);
+    ret = mmio_insert(&mmio_trees[bus], mmio);
+    if (!ret) {
+        ret = mmio_table_update(bus);
+        if (ret)
+            mmio_remove(&mmio_trees[bus], mmio);
+    }
     mutex_unlock(&mmio_lock);
 
+    if (ret) {
+        if (mmio->coalesced)
+            ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+        free(mmio);
+    }
+
     return ret;
 }
 
 bool kvm_deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags) {
+    enum mmio_bus bus = trap_is_mmio(flags) ? MMIO_BUS_MMIO : MMIO_BUS_PIO;
     struct mmio_mapping *mmio;
-    struct rb_root *tree;
-
-    if (trap_is_mmio(flags))
-        tree = &mmio_tree;
-    else
-        tree = &pio_tree;
 
     mutex_lock(&mmio_lock);
-    mmio = mmio_search_single(tree, phys_addr);
+    mmio = mmio_search_single(&mmio_trees[bus], phys_addr);
     if (mmio == NULL) {
         mutex_unlock(&mmio_lock);
         return false;
     }
+
+    mmio_remove(&mmio_trees[bus], mmio);
+    if (mmio_table_update(bus) < 0) {
+        mmio_insert(&mmio_trees[bus], mmio);
+        mutex_unlock(&mmio_lock);
+        return false;
+    }
+    mutex_unlock(&mmio_lock);
+
     /*
      * The PCI emulation code calls this function when memory access is
      * disabled for a device, or when a BAR has a new address assigned. PCI
      * emulation doesn't use any locks and as a result we can end up in a
      * situation where we have called mmio_get() to do emulation on one VCPU
      * thread (let's call it VCPU0), and several other VCPU threads have
-     * called kvm_deregister_mmio(). In this case, if we decrement refcount
-     * kvm_deregister_mmio() (either directly, or by calling mmio_put()),
-     * refcount will reach 0 and we will free the mmio node before VCPU0 has
-     * called mmio_put(). This will trigger use-after-free errors on VCPU0.
+     * called kvm_deregister_mmio(). No vCPU can find the mapping anymore,
+     * but VCPU0 still holds a reference: whoever drops the last one frees
+     * it, so VCPU0 never sees it freed under its feet.
      */
-    if (mmio->refcount == 0)
-        mmio_deregister(kvm, tree, mmio);
-    else
-        mmio->remove = true;
-    mutex_unlock(&mmio_lock);
+    mmio_put(kvm, mmio);
 
     return true;
 }
@@ -185,7 +441,7 @@ bool kvm_deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags) {
 bool kvm_emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data, u32 len, u8 is_write) {
     struct mmio_mapping *mmio;
 
-    mmio = mmio_get(&mmio_tree, phys_addr, len);
+    mmio = mmio_get(MMIO_BUS_MMIO, phys_addr, len);
     if (!mmio) {
         if (vcpu->kvm->cfg.mmio_debug)
             fprintf(stderr,
@@ -196,8 +452,9 @@ bool kvm_emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data, u32 len, u8
         goto out;
     }
 
+    kvm_stats_handler(vcpu, mmio->mmio_fn, mmio->ptr, phys_addr, false);
     mmio->mmio_fn(vcpu, phys_addr, data, len, is_write, mmio->ptr);
-    mmio_put(vcpu->kvm, &mmio_tree, mmio);
+    mmio_put(vcpu->kvm, mmio);
 
 out:
     return true;
@@ -207,7 +464,7 @@ bool kvm_emulate_io(struct kvm_cpu *vcpu, u16 port, void *data, int direction, i
     struct mmio_mapping *mmio;
     bool is_write = direction == KVM_EXIT_IO_OUT;
 
-    mmio = mmio_get(&pio_tree, port, size);
+    mmio = mmio_get(MMIO_BUS_PIO, port, size);
     if (!mmio) {
         if (vcpu->kvm->cfg.ioport_debug) {
             fprintf(stderr, "IO error: %s port=%x, size=%d, count=%u\n", to_direction(direction), port, size, count);
@@ -217,13 +474,14 @@ bool kvm_emulate_io(struct kvm_cpu *vcpu, u16 port, void *data, int direction, i
         return true;
     }
 
+    kvm_stats_handler(vcpu, mmio->mmio_fn, mmio->ptr, port, true);
     while (count--) {
         mmio->mmio_fn(vcpu, port, data, size, is_write, mmio->ptr);
 
         data += size;
     }
 
-    mmio_put(vcpu->kvm, &pio_tree, mmio);
+    mmio_put(vcpu->kvm, mmio);
 
     return true;
 }
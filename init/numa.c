@@ -0,0 +1,305 @@
+#include "kvm/numa.h"
+
+#include <errno.h>
+#include <linux/kernel.h>
+#include <linux/sizes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvm/fdt.h"
+#include "kvm/kvm.h"
+#include "kvm/placement.h"
+#include "kvm/util.h"
+#include "memory.h"
+
+/* Separates nodes, and the fields of a node */
+#define NUMA_NODE_SEP  ':'
+#define NUMA_FIELD_SEP '/'
+
+/* RAM of a node is registered, and bound, in whole 2M blocks */
+#define NUMA_MEM_ALIGN SZ_2M
+
+/*
+ * Distance between two host nodes as the host reports it, 0 if it
+ * doesn't say.
+ */
+static int numa_host_distance(int from, int to) {
+    char path[64];
+    int distance = 0, i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", from);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    for (i = 0; i <= to; i++) {
+        if (fscanf(f, "%d", &distance) != 1) {
+            distance = 0;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return distance;
+}
+
+static void numa_init_distances(struct kvm_numa *numa) {
+    struct kvm_numa_node *from, *to;
+    int i, j, distance;
+
+    for (i = 0; i < numa->nr_nodes; i++) {
+        for (j = 0; j < numa->nr_nodes; j++) {
+            from = &numa->nodes[i];
+            to = &numa->nodes[j];
+
+            if (i == j) {
+                numa->distance[i][j] = KVM_NUMA_LOCAL_DISTANCE;
+                continue;
+            }
+
+            /* Guest nodes on the same host node still need to look remote */
+            distance = 0;
+            if (from->host_node >= 0 && to->host_node >= 0)
+                distance = numa_host_distance(from->host_node, to->host_node);
+            if (distance <= KVM_NUMA_LOCAL_DISTANCE || distance > 255)
+                distance = KVM_NUMA_REMOTE_DISTANCE;
+
+            numa->distance[i][j] = distance;
+        }
+    }
+}
+
+/* Parse a node like 0-3/2G/1: its vCPUs, its RAM, and optionally its host node */
+static const char *numa_parse_node(const char *str, struct kvm_numa_node *node) {
+    char size[32], *end;
+    size_t len;
+
+    str = placement_parse_list(str, NUMA_FIELD_SEP, &node->vcpus);
+    if (!str || *str != NUMA_FIELD_SEP)
+        return NULL;
+    str++;
+
+    len = strcspn(str, "/:");
+    if (!len || len >= sizeof(size))
+        return NULL;
+    memcpy(size, str, len);
+    size[len] = '\0';
+    str += len;
+
+    node->mem_size = parse_ram_size(size);
+    if (!node->mem_size || node->mem_size % NUMA_MEM_ALIGN)
+        return NULL;
+
+    node->host_node = -1;
+    if (*str == NUMA_FIELD_SEP) {
+        node->host_node = strtol(str + 1, &end, 10);
+        if (end == str + 1 || node->host_node < 0)
+            return NULL;
+        str = end;
+    }
+
+    if (*str && *str != NUMA_NODE_SEP)
+        return NULL;
+
+    return str;
+}
+
+/*
+ * Parse the NUMA nodes of the guest, and size its RAM after them unless
+ * the size was given too. Every vCPU must be in exactly one node.
+ */
+int kvm_numa_parse(struct kvm *kvm) {
+    const char *str = kvm->cfg.numa;
+    struct kvm_numa *numa;
+    u64 ram_size = 0;
+    int cpu, node, owner;
+
+    if (!str)
+        return 0;
+
+    numa = calloc(1, sizeof(*numa));
+    if (!numa)
+        return -ENOMEM;
+
+    for (;;) {
+        if (numa->nr_nodes == KVM_NUMA_MAX_NODES) {
+            pr_err("Too many NUMA nodes, at most %d are supported", KVM_NUMA_MAX_NODES);
+            goto err;
+        }
+
+        str = numa_parse_node(str, &numa->nodes[numa->nr_nodes]);
+        if (!str) {
+            pr_err("Invalid NUMA nodes '%s', expected <vcpus>/<size>[/<host-node>][:...]", kvm->cfg.numa);
+            goto err;
+        }
+
+        ram_size += numa->nodes[numa->nr_nodes++].mem_size;
+        if (!*str)
+            break;
+        str++;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        owner = -1;
+        for (node = 0; node < numa->nr_nodes; node++) {
+            if (!CPU_ISSET(cpu, &numa->nodes[node].vcpus))
+                continue;
+            if (cpu >= kvm->cfg.nrcpus) {
+                pr_err("NUMA node %d has vCPU %d, but the guest only %d", node, cpu, kvm->cfg.nrcpus);
+                goto err;
+            }
+            if (owner >= 0) {
+                pr_err("vCPU %d is in NUMA nodes %d and %d", cpu, owner, node);
+                goto err;
+            }
+            owner = node;
+        }
+
+        if (owner < 0 && cpu < kvm->cfg.nrcpus) {
+            pr_err("vCPU %d is in no NUMA node", cpu);
+            goto err;
+        }
+    }
+
+    if (!kvm->cfg.ram_size_str) {
+        kvm->cfg.ram_size = ram_size;
+    } else if (kvm->cfg.ram_size != ram_size) {
+        pr_err("NUMA nodes have %llu bytes of RAM, but the guest %llu", ram_size, kvm->cfg.ram_size);
+        goto err;
+    }
+
+    numa_init_distances(numa);
+    kvm->numa = numa;
+
+    return 0;
+
+err:
+    free(numa);
+    return -EINVAL;
+}
+
+/* The node the RAM at offset belongs to, and where its RAM ends */
+static struct kvm_numa_node *numa_ram_node(struct kvm_numa *numa, u64 offset, u64 *end) {
+    u64 start = 0;
+    int i;
+
+    for (i = 0; i < numa->nr_nodes; i++) {
+        *end = start + numa->nodes[i].mem_size;
+        if (offset < *end)
+            return &numa->nodes[i];
+        start = *end;
+    }
+
+    return NULL;
+}
+
+/*
+ * Register a range of guest RAM, as one bank per node it spans. Banks of
+ * nodes placed on a host node are bound to it before anything touches
+ * them.
+ */
+int kvm_numa_register_ram(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr) {
+    struct kvm_numa *numa = kvm->numa;
+    struct kvm_numa_node *node;
+    u64 node_end, len;
+    int r;
+
+    if (!numa)
+        return kvm_register_ram(kvm, guest_phys, size, userspace_addr);
+
+    while (size) {
+        node = numa_ram_node(numa, numa->ram_offset, &node_end);
+        if (!node || node->nr_ranges == KVM_NUMA_MAX_RANGES)
+            return -EINVAL;
+
+        len = min(size, node_end - numa->ram_offset);
+
+        if (node->host_node >= 0) {
+            r = kvm_placement_bind(userspace_addr, len, node->host_node);
+            if (r < 0)
+                return r;
+        }
+
+        r = kvm_register_ram(kvm, guest_phys, len, userspace_addr);
+        if (r < 0)
+            return r;
+
+        node->ranges[node->nr_ranges++] = (struct kvm_numa_range){
+            .guest_phys = guest_phys,
+            .size = len,
+        };
+
+        numa->ram_offset += len;
+        guest_phys += len;
+        userspace_addr += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+int kvm_numa_vcpu_node(struct kvm *kvm, unsigned long cpu) {
+    int node;
+
+    if (!kvm->numa)
+        return -1;
+
+    for (node = 0; node < kvm->numa->nr_nodes; node++)
+        if (CPU_ISSET(cpu, &kvm->numa->nodes[node].vcpus))
+            return node;
+
+    return -1;
+}
+
+#ifdef CONFIG_HAS_LIBFDT
+
+/* One memory node per bank of each NUMA node, and the distances between them */
+void kvm_numa_generate_fdt_memory(void *fdt, struct kvm *kvm) {
+    struct kvm_numa *numa = kvm->numa;
+    struct kvm_numa_range *range;
+    u32 matrix[KVM_NUMA_MAX_NODES * KVM_NUMA_MAX_NODES * 3];
+    u64 reg[2];
+    char name[32];
+    int i, j, n = 0;
+
+    for (i = 0; i < numa->nr_nodes; i++) {
+        for (j = 0; j < numa->nodes[i].nr_ranges; j++) {
+            range = &numa->nodes[i].ranges[j];
+            reg[0] = cpu_to_fdt64(range->guest_phys);
+            reg[1] = cpu_to_fdt64(range->size);
+
+            snprintf(name, sizeof(name), "memory@%llx", range->guest_phys);
+            _FDT(fdt_begin_node(fdt, name));
+            _FDT(fdt_property_string(fdt, "device_type", "memory"));
+            _FDT(fdt_property(fdt, "reg", reg, sizeof(reg)));
+            _FDT(fdt_property_cell(fdt, "numa-node-id", i));
+            _FDT(fdt_end_node(fdt));
+        }
+    }
+
+    for (i = 0; i < numa->nr_nodes; i++) {
+        for (j = 0; j < numa->nr_nodes; j++) {
+            matrix[n++] = cpu_to_fdt32(i);
+            matrix[n++] = cpu_to_fdt32(j);
+            matrix[n++] = cpu_to_fdt32(numa->distance[i][j]);
+        }
+    }
+
+    _FDT(fdt_begin_node(fdt, "distance-map"));
+    _FDT(fdt_property_string(fdt, "compatible", "numa-distance-map-v1"));
+    _FDT(fdt_property(fdt, "distance-matrix", matrix, n * sizeof(matrix[0])));
+    _FDT(fdt_end_node(fdt));
+}
+
+/* Called within the node of a CPU */
+void kvm_numa_generate_fdt_cpu(void *fdt, struct kvm *kvm, unsigned long cpu) {
+    int node = kvm_numa_vcpu_node(kvm, cpu);
+
+    if (node >= 0)
+        _FDT(fdt_property_cell(fdt, "numa-node-id", node));
+}
+
+#endif
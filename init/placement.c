@@ -0,0 +1,448 @@
+#include "kvm/placement.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/mempolicy.h>
+#include <linux/sizes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm.h"
+#include "kvm/numa.h"
+#include "kvm/util.h"
+
+/* Separates the host CPU sets of successive vCPUs */
+#define PLACEMENT_VCPU_SEP ':'
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Not worth a thread below that */
+#define PREALLOC_MIN_CHUNK SZ_256M
+
+static cpu_set_t *vcpu_sets;
+static int nr_vcpu_sets;
+
+/* Where vCPUs run when only the I/O threads are pinned */
+static cpu_set_t vcpu_default;
+static bool io_pinned;
+
+/*
+ * Parse a list like 0-3,8,10-11 up to the end of the string or to sep.
+ * Returns where it stopped, NULL if the list is malformed.
+ */
+const char *placement_parse_list(const char *str, char sep, cpu_set_t *set) {
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO(set);
+    for (;;) {
+        if (!isdigit(*str))
+            return NULL;
+
+        first = last = strtoul(str, &end, 10);
+        if (*end == '-') {
+            str = end + 1;
+            if (!isdigit(*str))
+                return NULL;
+            last = strtoul(str, &end, 10);
+        }
+
+        if (first > last || last >= CPU_SETSIZE)
+            return NULL;
+
+        for (; first <= last; first++) CPU_SET(first, set);
+
+        if (*end != ',')
+            break;
+        str = end + 1;
+    }
+
+    if (*end && *end != sep)
+        return NULL;
+
+    return end;
+}
+
+static int placement_parse_vcpus(const char *str) {
+    cpu_set_t set, *sets;
+
+    for (;;) {
+        str = placement_parse_list(str, PLACEMENT_VCPU_SEP, &set);
+        if (!str)
+            return -EINVAL;
+
+        sets = realloc(vcpu_sets, (nr_vcpu_sets + 1) * sizeof(*sets));
+        if (!sets)
+            return -ENOMEM;
+
+        vcpu_sets = sets;
+        vcpu_sets[nr_vcpu_sets++] = set;
+
+        if (!*str)
+            return 0;
+        str++;
+    }
+}
+
+/*
+ * Pin the I/O threads, and remember where each vCPU goes. This runs before
+ * any thread is started: they all inherit the I/O CPUs, and vCPU threads
+ * then move to their own.
+ */
+int kvm_placement_init(struct kvm *kvm) {
+    cpu_set_t io_set;
+    int r;
+
+    if (kvm->cfg.vcpu_affinity) {
+        r = placement_parse_vcpus(kvm->cfg.vcpu_affinity);
+        if (r < 0) {
+            pr_err("Invalid vCPU affinity '%s'", kvm->cfg.vcpu_affinity);
+            return r;
+        }
+    }
+
+    if (!kvm->cfg.io_affinity)
+        return 0;
+
+    if (!placement_parse_list(kvm->cfg.io_affinity, '\0', &io_set)) {
+        pr_err("Invalid I/O thread affinity '%s'", kvm->cfg.io_affinity);
+        return -EINVAL;
+    }
+
+    if (sched_getaffinity(0, sizeof(vcpu_default), &vcpu_default) < 0 ||
+        sched_setaffinity(0, sizeof(io_set), &io_set) < 0) {
+        r = -errno;
+        pr_err("Failed pinning I/O threads to '%s': %s", kvm->cfg.io_affinity, strerror(errno));
+        return r;
+    }
+
+    io_pinned = true;
+
+    return 0;
+}
+
+int kvm_placement_bind(void *addr, u64 len, int node) {
+    unsigned long mask[CPU_SETSIZE / BITS_PER_LONG] = {};
+    int r;
+
+    if (node >= CPU_SETSIZE)
+        return -EINVAL;
+
+    mask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, mask, CPU_SETSIZE, MPOL_MF_MOVE) < 0) {
+        r = -errno;
+        pr_err("Failed binding guest RAM to node %d: %s", node, strerror(errno));
+        return r;
+    }
+
+    return 0;
+}
+
+/*
+ * Split guest RAM in as many consecutive slices as there are nodes, and
+ * bind each to its node, lowest first. Pages are allocated on their node
+ * when the guest first touches them.
+ */
+int kvm_placement_bind_ram(struct kvm *kvm) {
+    int nodes[CPU_SETSIZE], nr_nodes = 0, i, r;
+    u64 slice, start, len;
+    cpu_set_t set;
+
+    if (!kvm->cfg.mem_nodes)
+        return 0;
+
+    /* Guest NUMA nodes say where their own RAM goes */
+    if (kvm->numa) {
+        pr_err("Guest NUMA nodes and memory nodes can't be used together");
+        return -EINVAL;
+    }
+
+    if (!placement_parse_list(kvm->cfg.mem_nodes, '\0', &set)) {
+        pr_err("Invalid memory nodes '%s'", kvm->cfg.mem_nodes);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &set))
+            nodes[nr_nodes++] = i;
+
+    slice = ALIGN(kvm->ram_size / nr_nodes, kvm->ram_pagesize);
+    for (i = 0, start = 0; i < nr_nodes && start < kvm->ram_size; i++, start += slice) {
+        len = i == nr_nodes - 1 ? kvm->ram_size - start : min(slice, kvm->ram_size - start);
+
+        r = kvm_placement_bind(kvm->ram_start + start, len, nodes[i]);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+/* CPUs of a host node, as sysfs lists them */
+static int placement_host_node_cpus(int node, cpu_set_t *set) {
+    char path[64], list[1024];
+    FILE *f;
+    int r = -ENOENT;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+        return r;
+
+    if (fgets(list, sizeof(list), f)) {
+        list[strcspn(list, "\n")] = '\0';
+        if (placement_parse_list(list, '\0', set))
+            r = 0;
+    }
+
+    fclose(f);
+
+    return r;
+}
+
+struct prealloc_range {
+    void *addr;
+    u64 size;
+};
+
+struct prealloc_worker {
+    pthread_t thread;
+    bool started;
+    /* Host CPU the thread runs on, -1 for any */
+    int cpu;
+    struct prealloc_range *ranges;
+    int nr_ranges;
+    /* Bytes to fault in, starting that far into the ranges */
+    u64 start;
+    u64 len;
+    u64 pagesize;
+    int err;
+};
+
+static int prealloc_collect_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data) {
+    struct prealloc_worker *w = data;
+    struct prealloc_range *ranges;
+
+    ranges = realloc(w->ranges, (w->nr_ranges + 1) * sizeof(*ranges));
+    if (!ranges)
+        return -ENOMEM;
+
+    ranges[w->nr_ranges++] = (struct prealloc_range){
+        .addr = bank->host_addr,
+        .size = bank->size,
+    };
+    w->ranges = ranges;
+    w->len += bank->size;
+
+    return 0;
+}
+
+/* Where a worker touching pages by hand goes when the kernel has none left */
+static __thread sigjmp_buf *prealloc_jmp;
+
+static void prealloc_sigbus(int sig) {
+    if (prealloc_jmp)
+        siglongjmp(*prealloc_jmp, 1);
+
+    /* Not ours, fault again without the handler */
+    signal(sig, SIG_DFL);
+}
+
+/*
+ * Fault in writable pages, by hand on kernels without MADV_POPULATE_WRITE.
+ * Running out of huge pages is an error then too, rather than a SIGBUS.
+ */
+static int prealloc_populate(void *addr, u64 len, u64 pagesize) {
+    volatile char *p;
+    sigjmp_buf jmp;
+
+    if (!madvise(addr, len, MADV_POPULATE_WRITE))
+        return 0;
+    /* EFAULT is what a SIGBUS would have been */
+    if (errno == EFAULT)
+        return -ENOMEM;
+    if (errno != EINVAL)
+        return -errno;
+
+    if (sigsetjmp(jmp, 1)) {
+        prealloc_jmp = NULL;
+        return -ENOMEM;
+    }
+
+    prealloc_jmp = &jmp;
+    for (p = addr; p < (char *)addr + len; p += pagesize) *p = *p;
+    prealloc_jmp = NULL;
+
+    return 0;
+}
+
+static void prealloc_chunk(struct prealloc_worker *w) {
+    u64 offset = 0, start, end;
+    int i;
+
+    for (i = 0; i < w->nr_ranges && !w->err; i++) {
+        start = max(offset, w->start);
+        end = min(offset + w->ranges[i].size, w->start + w->len);
+        if (start < end)
+            w->err = prealloc_populate(w->ranges[i].addr + start - offset, end - start, w->pagesize);
+        offset += w->ranges[i].size;
+    }
+}
+
+static void *prealloc_thread(void *arg) {
+    struct prealloc_worker *w = arg;
+    cpu_set_t set;
+
+    kvm_set_thread_name("kvm-prealloc");
+
+    /* Pages bound to no node then land evenly next to their CPUs */
+    if (w->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    prealloc_chunk(w);
+
+    return NULL;
+}
+
+/*
+ * CPUs the guest runs on: those of its vCPUs, else those of the nodes its
+ * RAM is on, else those we were started on. Not the I/O CPUs this thread
+ * may be pinned to by now.
+ */
+static void prealloc_cpus(struct kvm *kvm, cpu_set_t *set) {
+    cpu_set_t nodes, node_cpus;
+    int i;
+
+    CPU_ZERO(set);
+
+    if (nr_vcpu_sets) {
+        for (i = 0; i < nr_vcpu_sets; i++) CPU_OR(set, set, &vcpu_sets[i]);
+        return;
+    }
+
+    CPU_ZERO(&nodes);
+    if (kvm->numa) {
+        for (i = 0; i < kvm->numa->nr_nodes; i++)
+            if (kvm->numa->nodes[i].host_node >= 0)
+                CPU_SET(kvm->numa->nodes[i].host_node, &nodes);
+    } else if (kvm->cfg.mem_nodes) {
+        placement_parse_list(kvm->cfg.mem_nodes, '\0', &nodes);
+    }
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &nodes) && !placement_host_node_cpus(i, &node_cpus))
+            CPU_OR(set, set, &node_cpus);
+    if (CPU_COUNT(set))
+        return;
+
+    if (io_pinned)
+        *set = vcpu_default;
+    else if (sched_getaffinity(0, sizeof(*set), set) < 0)
+        CPU_ZERO(set);
+}
+
+/*
+ * Fault in all of guest RAM before vCPUs start, split in one chunk per
+ * host CPU the guest runs on. This runs after RAM is bound to its nodes, and
+ * fails here rather than in the guest when huge pages run out.
+ */
+int kvm_placement_prealloc_ram(struct kvm *kvm) {
+    struct prealloc_worker all = {}, *workers;
+    int nr_workers, cpu, i, r = 0;
+    struct sigaction sigbus = {.sa_handler = prealloc_sigbus}, old_sigbus;
+    u64 chunk, done = 0;
+    cpu_set_t set;
+
+    if (!kvm->cfg.mem_prealloc)
+        return 0;
+
+    r = kvm_for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, prealloc_collect_bank, &all);
+    if (r < 0)
+        goto out;
+
+    prealloc_cpus(kvm, &set);
+    nr_workers = max(CPU_COUNT(&set), 1);
+    nr_workers = min_t(u64, nr_workers, max_t(u64, all.len / PREALLOC_MIN_CHUNK, 1));
+    chunk = ALIGN(all.len / nr_workers, kvm->ram_pagesize);
+
+    workers = calloc(nr_workers, sizeof(*workers));
+    if (!workers) {
+        r = -ENOMEM;
+        goto out;
+    }
+
+    sigaction(SIGBUS, &sigbus, &old_sigbus);
+
+    for (i = 0, cpu = -1; i < nr_workers; i++) {
+        do cpu++;
+        while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &set));
+
+        workers[i] = all;
+        workers[i].cpu = cpu < CPU_SETSIZE ? cpu : -1;
+        workers[i].start = done;
+        workers[i].len = i == nr_workers - 1 ? all.len - done : min(chunk, all.len - done);
+        workers[i].pagesize = kvm->ram_pagesize;
+        done += workers[i].len;
+
+        workers[i].started = !pthread_create(&workers[i].thread, NULL, prealloc_thread, &workers[i]);
+    }
+
+    for (i = 0; i < nr_workers; i++) {
+        /* Chunks without a thread are faulted in from here */
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        else
+            prealloc_chunk(&workers[i]);
+        if (workers[i].err && !r)
+            r = workers[i].err;
+    }
+
+    sigaction(SIGBUS, &old_sigbus, NULL);
+    free(workers);
+
+    if (r < 0)
+        pr_err("Failed preallocating %llu bytes of guest RAM: %s", all.len, strerror(-r));
+    else
+        pr_debug("Preallocated %llu bytes of guest RAM with %d threads", all.len, nr_workers);
+
+out:
+    free(all.ranges);
+    return r;
+}
+
+/* Called by each vCPU thread before it first runs its vCPU */
+void kvm_placement_vcpu(struct kvm_cpu *vcpu) {
+    int node = kvm_numa_vcpu_node(vcpu->kvm, vcpu->cpu_id);
+    cpu_set_t *set, host_cpus;
+
+    /* By default vCPUs of a NUMA node run where its RAM is */
+    if (nr_vcpu_sets)
+        set = &vcpu_sets[vcpu->cpu_id % nr_vcpu_sets];
+    else if (node >= 0 && vcpu->kvm->numa->nodes[node].host_node >= 0 &&
+             !placement_host_node_cpus(vcpu->kvm->numa->nodes[node].host_node, &host_cpus))
+        set = &host_cpus;
+    else if (io_pinned)
+        set = &vcpu_default;
+    else
+        return;
+
+    if (sched_setaffinity(0, sizeof(*set), set) < 0)
+        pr_warning("Failed pinning vCPU%lu: %s", vcpu->cpu_id, strerror(errno));
+}
@@ -2,8 +2,10 @@
 #include <clib/clib.h>
 #include <kvm/kvm-config.h>
 #include <kvm/kvm-cpu.h>
+#include <kvm/numa.h>
 #include <kvm/term.h>
 #include <kvm/util-init.h>
+#include <kvm/virtio.h>
 #include <stdio.h>
 #include <string.h>
 #include <vm/vm.h>
@@ -103,6 +105,10 @@ int vm_config_init(struct kvm *kvm) {
     } else {
         kvm->cfg.ram_size = parse_ram_size(kvm->cfg.ram_size_str);
     }
+
+    if (kvm_numa_parse(kvm) < 0)
+        return -EINVAL;
+
     DEBUG("ram size: %llu GB", kvm->cfg.ram_size / GB);
 
     if (!kvm->cfg.dev)
@@ -138,6 +144,30 @@ int vm_config_init(struct kvm *kvm) {
     if (!kvm->cfg.network)
         kvm->cfg.network = DEFAULT_NETWORK;
 
+    if (kvm->cfg.virtio_transport_name) {
+        enum virtio_trans trans;
+
+        if (virtio_transport_from_str(kvm->cfg.virtio_transport_name, &trans) < 0)
+            return -EINVAL;
+        kvm->cfg.virtio_transport = trans;
+    }
+
+    if (kvm->cfg.mem_backend_name) {
+        enum kvm_mem_backend backend;
+
+        if (kvm_mem_backend_from_str(kvm->cfg.mem_backend_name, &backend) < 0)
+            return -EINVAL;
+        kvm->cfg.mem_backend = backend;
+    }
+
+    /* vhost-user backends map guest RAM themselves */
+    if (kvm->cfg.vhost_user_net || kvm->cfg.vhost_user_blk)
+        kvm->cfg.mem_shared = true;
+
+    /* KSM leaves shared mappings alone */
+    if (kvm->cfg.ksm && (kvm->cfg.mem_shared || kvm->cfg.mem_backend >= KVM_MEM_MEMFD))
+        pr_warning("KSM doesn't merge guest memory shared through a memfd");
+
     if (!kvm->cfg.guest_name) {
         static char default_name[20];
         sprintf(default_name, "%u", getpid());
@@ -163,7 +193,7 @@ int vm_config_init(struct kvm *kvm) {
         }
     }
 
-    if (kvm->nr_disks == 0) {
+    if (kvm->nr_disks == 0 && !kvm->cfg.vhost_user_blk) {
         ERR("no disk specified");
         return -1;
     }
@@ -0,0 +1,629 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "kvm/af-packet.h"
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
+#include "kvm/rwsem.h"
+#include "kvm/util.h"
+#include "kvm/virtio-net-rss.h"
+#include "kvm/virtio.h"
+
+#ifndef PACKET_FANOUT_FLAG_UNIQUEID
+#define PACKET_FANOUT_FLAG_UNIQUEID 0x2000
+#endif
+
+/* Frames and blocks are shared with the kernel, which updates their status */
+#define af_packet_status(p) (*(volatile u32 *)&(p))
+
+static struct tpacket_block_desc *af_packet_rx_block(struct af_packet *pkt) {
+    return pkt->map + (size_t)pkt->rx_block * AF_PACKET_BLOCK_SIZE;
+}
+
+static struct tpacket3_hdr *af_packet_tx_frame(struct af_packet *pkt) {
+    size_t tx_ring = (size_t)AF_PACKET_RX_BLOCK_NR * AF_PACKET_BLOCK_SIZE;
+
+    return pkt->map + tx_ring + (size_t)pkt->tx_frame * pkt->tx_frame_size;
+}
+
+/* TX frames hold the largest frame the interface sends, behind the frame header */
+static u32 af_packet_tx_frame_size(int fd, const char *ifname) {
+    struct ifreq ifr = {};
+    u32 size = AF_PACKET_FRAME_SIZE;
+
+    strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+        return size;
+
+    while (size < TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) + ETH_HLEN + 4 + ifr.ifr_mtu) size <<= 1;
+
+    return min_t(u32, size, AF_PACKET_BLOCK_SIZE);
+}
+
+/*
+ * Join the fanout group of the other queues of the device, or have the
+ * kernel pick an unused id for it if this is the first one. Members are
+ * picked by the steering program, see af_packet_steer(), or by the hash of
+ * the flow on kernels without fanout programs.
+ */
+static int af_packet_join_fanout(struct af_packet *pkt, int *fanout_id) {
+    int id = *fanout_id < 0 ? PACKET_FANOUT_FLAG_UNIQUEID << 16 : *fanout_id;
+    int arg = id | (PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_ROLLOVER) << 16;
+    socklen_t len = sizeof(arg);
+
+    if (setsockopt(pkt->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        /* Fanout programs need Linux 4.3 */
+        arg = id | (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_ROLLOVER) << 16;
+        if (setsockopt(pkt->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+            return -errno;
+    }
+
+    if (*fanout_id < 0) {
+        if (getsockopt(pkt->fd, SOL_PACKET, PACKET_FANOUT, &arg, &len) < 0)
+            return -errno;
+        *fanout_id = arg & 0xffff;
+    }
+
+    return 0;
+}
+
+int af_packet_init(struct af_packet *pkt, const char *ifname, int *fanout_id) {
+    struct tpacket_req3 rx_req = {
+        .tp_block_size = AF_PACKET_BLOCK_SIZE,
+        .tp_block_nr = AF_PACKET_RX_BLOCK_NR,
+        .tp_frame_size = AF_PACKET_FRAME_SIZE,
+        .tp_frame_nr = AF_PACKET_RX_BLOCK_NR * (AF_PACKET_BLOCK_SIZE / AF_PACKET_FRAME_SIZE),
+        .tp_retire_blk_tov = AF_PACKET_RX_BLOCK_TOV,
+    };
+    struct tpacket_req3 tx_req = {
+        .tp_block_size = AF_PACKET_BLOCK_SIZE,
+        .tp_block_nr = AF_PACKET_TX_BLOCK_NR,
+    };
+    struct packet_mreq mreq = {.mr_type = PACKET_MR_PROMISC};
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    int version = TPACKET_V3, one = 1;
+    int r;
+
+    memset(pkt, 0, sizeof(*pkt));
+
+    sll.sll_ifindex = mreq.mr_ifindex = if_nametoindex(ifname);
+    if (!sll.sll_ifindex) {
+        pr_warning("Unknown interface %s", ifname);
+        return -ENODEV;
+    }
+
+    /* No protocol until bound, or we would queue frames of every interface */
+    pkt->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (pkt->fd < 0)
+        return -errno;
+
+    pkt->tx_frame_size = tx_req.tp_frame_size = af_packet_tx_frame_size(pkt->fd, ifname);
+    pkt->tx_frame_nr = tx_req.tp_frame_nr = AF_PACKET_TX_BLOCK_NR * (AF_PACKET_BLOCK_SIZE / pkt->tx_frame_size);
+
+    if (setsockopt(pkt->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(pkt->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0 ||
+        setsockopt(pkt->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0) {
+        r = -errno;
+        pr_warning("Unable to set up TPACKET_V3 rings");
+        goto fail;
+    }
+
+    pkt->map_len = (size_t)(AF_PACKET_RX_BLOCK_NR + AF_PACKET_TX_BLOCK_NR) * AF_PACKET_BLOCK_SIZE;
+    pkt->map = mmap(NULL, pkt->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pkt->fd, 0);
+    if (pkt->map == MAP_FAILED) {
+        r = -errno;
+        pkt->map = NULL;
+        goto fail;
+    }
+
+    /* Both are optimizations only available on recent kernels */
+    setsockopt(pkt->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    setsockopt(pkt->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+    if (bind(pkt->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0 ||
+        setsockopt(pkt->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        r = -errno;
+        pr_warning("Unable to bind to interface %s", ifname);
+        goto fail;
+    }
+
+    if (fanout_id && (r = af_packet_join_fanout(pkt, fanout_id)) < 0) {
+        pr_warning("Unable to join packet fanout group");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    af_packet_exit(pkt);
+    return r;
+}
+
+void af_packet_exit(struct af_packet *pkt) {
+    if (pkt->tx_dropped)
+        pr_debug("packet socket: %llu TX frames dropped", pkt->tx_dropped);
+
+    if (pkt->map)
+        munmap(pkt->map, pkt->map_len);
+    if (pkt->fd > 0)
+        close(pkt->fd);
+    pkt->map = NULL;
+    pkt->fd = 0;
+}
+
+/*
+ * Classic BPF program computing the Toeplitz hash of a frame, the way
+ * virtio_net_rss_queue() does, and returning the fanout member of the
+ * queue the indirection table maps it to. Members joined in queue order.
+ * Loads are relative to the network header, the key and the table are
+ * built into the program.
+ */
+enum af_packet_steer_label {
+    AF_PACKET_STEER_V6,
+    AF_PACKET_STEER_V4_NOPORTS,
+    AF_PACKET_STEER_V4_PORTS,
+    AF_PACKET_STEER_V6_NOPORTS,
+    AF_PACKET_STEER_V6_PORTS,
+    AF_PACKET_STEER_LOOKUP,
+    AF_PACKET_STEER_UNCLASSIFIED,
+    AF_PACKET_STEER_NR_LABELS,
+};
+
+#define AF_PACKET_STEER_MAX_FIXUPS 16
+
+struct af_packet_steer {
+    struct sock_filter *insns;
+    u32 len;
+    u32 labels[AF_PACKET_STEER_NR_LABELS];
+    /* Jumps to a label not emitted yet */
+    struct {
+        u32 insn;
+        enum af_packet_steer_label label;
+    } fixups[AF_PACKET_STEER_MAX_FIXUPS];
+    u32 nr_fixups;
+};
+
+static void af_packet_steer_emit(struct af_packet_steer *s, u16 code, u8 jt, u8 jf, u32 k) {
+    if (s->len < BPF_MAXINSNS)
+        s->insns[s->len] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+    s->len++;
+}
+
+static void af_packet_steer_label(struct af_packet_steer *s, enum af_packet_steer_label label) {
+    s->labels[label] = s->len;
+}
+
+/* Jumps are limited to 255 instructions unless unconditional */
+static void af_packet_steer_jump(struct af_packet_steer *s, enum af_packet_steer_label label) {
+    if (s->nr_fixups < AF_PACKET_STEER_MAX_FIXUPS) {
+        s->fixups[s->nr_fixups].insn = s->len;
+        s->fixups[s->nr_fixups].label = label;
+    }
+    s->nr_fixups++;
+    af_packet_steer_emit(s, BPF_JMP | BPF_JA, 0, 0, 0);
+}
+
+static void af_packet_steer_jump_if(struct af_packet_steer *s, u16 code, u32 k, enum af_packet_steer_label label) {
+    af_packet_steer_emit(s, BPF_JMP | code | BPF_K, 0, 1, k);
+    af_packet_steer_jump(s, label);
+}
+
+/* The 32 bits of the key starting at bit */
+static u32 af_packet_steer_window(const u8 *key, u32 bit) {
+    u32 window = 0, i;
+
+    for (i = bit; i < bit + 32; i++)
+        window = window << 1 | (i / 8 < VIRTIO_NET_RSS_MAX_KEY_SIZE ? (key[i / 8] >> (7 - i % 8)) & 1 : 0);
+
+    return window;
+}
+
+/* XOR into M[0] the key windows of the bits set in A, the input word at bit */
+static void af_packet_steer_hash_word(struct af_packet_steer *s, const u8 *key, u32 bit) {
+    u32 i, window;
+
+    af_packet_steer_emit(s, BPF_MISC | BPF_TAX, 0, 0, 0);
+    for (i = 0; i < 32; i++) {
+        window = af_packet_steer_window(key, bit + i);
+        if (!window)
+            continue;
+
+        af_packet_steer_emit(s, BPF_MISC | BPF_TXA, 0, 0, 0);
+        af_packet_steer_emit(s, BPF_JMP | BPF_JSET | BPF_K, 0, 3, 1U << (31 - i));
+        af_packet_steer_emit(s, BPF_LD | BPF_MEM, 0, 0, 0);
+        af_packet_steer_emit(s, BPF_ALU | BPF_XOR | BPF_K, 0, 0, window);
+        af_packet_steer_emit(s, BPF_ST, 0, 0, 0);
+    }
+}
+
+/*
+ * Hash the nr_words words of addresses at addr of the IP header, then the
+ * ports if the hash types want them for the protocol at proto.
+ */
+static void af_packet_steer_ip(struct af_packet_steer *s, const struct virtio_net_rss *rss, u32 addr, u32 nr_words,
+                               u32 proto, bool v4, u32 types[3]) {
+    enum af_packet_steer_label noports = v4 ? AF_PACKET_STEER_V4_NOPORTS : AF_PACKET_STEER_V6_NOPORTS;
+    enum af_packet_steer_label ports = v4 ? AF_PACKET_STEER_V4_PORTS : AF_PACKET_STEER_V6_PORTS;
+    bool ip = rss->hash_types & types[0];
+    bool tcp = rss->hash_types & types[1];
+    bool udp = rss->hash_types & types[2];
+    u32 i;
+
+    if (!ip && !tcp && !udp) {
+        af_packet_steer_jump(s, AF_PACKET_STEER_UNCLASSIFIED);
+        return;
+    }
+
+    for (i = 0; i < nr_words; i++) {
+        af_packet_steer_emit(s, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + addr + i * 4);
+        af_packet_steer_hash_word(s, rss->key, i * 32);
+    }
+
+    if (tcp || udp) {
+        /* Fragments have no ports, or only the first one does */
+        if (v4) {
+            af_packet_steer_emit(s, BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_NET_OFF + 6);
+            af_packet_steer_jump_if(s, BPF_JSET, 0x3fff, noports);
+        }
+        af_packet_steer_emit(s, BPF_LD | BPF_B | BPF_ABS, 0, 0, SKF_NET_OFF + proto);
+        if (tcp)
+            af_packet_steer_jump_if(s, BPF_JEQ, IPPROTO_TCP, ports);
+        if (udp)
+            af_packet_steer_jump_if(s, BPF_JEQ, IPPROTO_UDP, ports);
+    }
+
+    af_packet_steer_label(s, noports);
+    af_packet_steer_jump(s, ip ? AF_PACKET_STEER_LOOKUP : AF_PACKET_STEER_UNCLASSIFIED);
+
+    if (tcp || udp) {
+        af_packet_steer_label(s, ports);
+        if (v4) {
+            af_packet_steer_emit(s, BPF_LDX | BPF_B | BPF_MSH, 0, 0, SKF_NET_OFF);
+            af_packet_steer_emit(s, BPF_LD | BPF_W | BPF_IND, 0, 0, SKF_NET_OFF);
+        } else {
+            af_packet_steer_emit(s, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + addr + nr_words * 4);
+        }
+        af_packet_steer_hash_word(s, rss->key, nr_words * 32);
+        af_packet_steer_jump(s, AF_PACKET_STEER_LOOKUP);
+    }
+}
+
+/* Binary search of the indirection table entries [lo, hi) for the hash in A */
+static void af_packet_steer_lookup(struct af_packet_steer *s, const u16 *table, u32 lo, u32 hi) {
+    u32 i, mid = (lo + hi) / 2, jump;
+
+    for (i = lo + 1; i < hi && table[i] == table[lo]; i++)
+        ;
+    if (i == hi) {
+        af_packet_steer_emit(s, BPF_RET | BPF_K, 0, 0, table[lo]);
+        return;
+    }
+
+    /* At most 64 entries to the left, which takes 127 instructions */
+    jump = s->len;
+    af_packet_steer_emit(s, BPF_JMP | BPF_JGE | BPF_K, 0, 0, mid);
+    af_packet_steer_lookup(s, table, lo, mid);
+    if (jump < BPF_MAXINSNS)
+        s->insns[jump].jt = s->len - jump - 1;
+    af_packet_steer_lookup(s, table, mid, hi);
+}
+
+/*
+ * Steer the frames of the fanout group of pkt after the RSS state of the
+ * device, on every change of it.
+ */
+int af_packet_steer(struct af_packet *pkt, struct virtio_net_rss *rss) {
+    u32 v4_types[] = {VIRTIO_NET_RSS_HASH_TYPE_IPv4, VIRTIO_NET_RSS_HASH_TYPE_TCPv4, VIRTIO_NET_RSS_HASH_TYPE_UDPv4};
+    u32 v6_types[] = {VIRTIO_NET_RSS_HASH_TYPE_IPv6, VIRTIO_NET_RSS_HASH_TYPE_TCPv6, VIRTIO_NET_RSS_HASH_TYPE_UDPv6};
+    struct af_packet_steer s = {};
+    struct sock_fprog fprog;
+    u32 i;
+    int r = 0;
+
+    s.insns = calloc(BPF_MAXINSNS, sizeof(*s.insns));
+    if (!s.insns)
+        return -ENOMEM;
+
+    down_read(&rss->lock);
+
+    af_packet_steer_emit(&s, BPF_LD | BPF_IMM, 0, 0, 0);
+    af_packet_steer_emit(&s, BPF_ST, 0, 0, 0);
+    af_packet_steer_emit(&s, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_PROTOCOL);
+    af_packet_steer_jump_if(&s, BPF_JEQ, ETH_P_IPV6, AF_PACKET_STEER_V6);
+    af_packet_steer_emit(&s, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, ETH_P_IP);
+    af_packet_steer_jump(&s, AF_PACKET_STEER_UNCLASSIFIED);
+
+    af_packet_steer_ip(&s, rss, 12, 2, 9, true, v4_types);
+    af_packet_steer_label(&s, AF_PACKET_STEER_V6);
+    af_packet_steer_ip(&s, rss, 8, 8, 6, false, v6_types);
+
+    af_packet_steer_label(&s, AF_PACKET_STEER_LOOKUP);
+    af_packet_steer_emit(&s, BPF_LD | BPF_MEM, 0, 0, 0);
+    af_packet_steer_emit(&s, BPF_ALU | BPF_AND | BPF_K, 0, 0, rss->table_mask);
+    af_packet_steer_lookup(&s, rss->table, 0, rss->table_mask + 1);
+
+    af_packet_steer_label(&s, AF_PACKET_STEER_UNCLASSIFIED);
+    af_packet_steer_emit(&s, BPF_RET | BPF_K, 0, 0, rss->unclassified);
+
+    up_read(&rss->lock);
+
+    if (s.len > BPF_MAXINSNS || s.nr_fixups > AF_PACKET_STEER_MAX_FIXUPS) {
+        r = -E2BIG;
+        goto out;
+    }
+
+    for (i = 0; i < s.nr_fixups; i++) s.insns[s.fixups[i].insn].k = s.labels[s.fixups[i].label] - s.fixups[i].insn - 1;
+
+    fprog.len = s.len;
+    fprog.filter = s.insns;
+    if (setsockopt(pkt->fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0)
+        r = -errno;
+
+out:
+    free(s.insns);
+    return r;
+}
+
+/* Locate the L4 checksum of a TCP or UDP frame */
+static bool af_packet_csum_offsets(u8 *data, u32 len, u16 *start, u16 *offset) {
+    struct ethhdr *eth = (struct ethhdr *)data;
+    u32 off = ETH_HLEN;
+    u16 proto;
+    u8 l4;
+
+    if (len < ETH_HLEN)
+        return false;
+
+    proto = ntohs(eth->h_proto);
+    if (proto == ETH_P_8021Q) {
+        if (len < off + 4)
+            return false;
+        proto = ntohs(*(u16 *)(data + off + 2));
+        off += 4;
+    }
+
+    if (proto == ETH_P_IP && len >= off + sizeof(struct iphdr)) {
+        struct iphdr *ip = (struct iphdr *)(data + off);
+
+        l4 = ip->protocol;
+        off += ip->ihl * 4;
+    } else if (proto == ETH_P_IPV6 && len >= off + sizeof(struct ip6_hdr)) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)(data + off);
+
+        l4 = ip6->ip6_nxt;
+        off += sizeof(*ip6);
+    } else {
+        return false;
+    }
+
+    if (l4 == IPPROTO_TCP)
+        *offset = offsetof(struct tcphdr, check);
+    else if (l4 == IPPROTO_UDP)
+        *offset = offsetof(struct udphdr, check);
+    else
+        return false;
+
+    *start = off;
+    return off + *offset + sizeof(u16) <= len;
+}
+
+/* Fold the data from start into the pseudo header sum the stack left at offset */
+static void af_packet_csum_complete(u8 *data, u32 len, u16 start, u16 offset) {
+    u16 *csum = (u16 *)(data + start + offset);
+    u8 *p = data + start;
+    u32 count = len - start;
+    u64 sum = 0;
+    u16 folded;
+
+    while (count > 1) {
+        sum += *(u16 *)p;
+        p += 2;
+        count -= 2;
+    }
+    if (count)
+        sum += *p;
+
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+
+    /* Zero means no checksum to UDP */
+    folded = ~sum;
+    *csum = folded ?: 0xffff;
+}
+
+/*
+ * Frames the host stack sent with a partial checksum are passed on as such
+ * if the guest accepts them, or completed here otherwise. The guest sees
+ * the frame with its VLAN tag back, vlan_len bytes further.
+ */
+static void af_packet_rx_csum(struct af_packet *pkt, struct tpacket3_hdr *frame, struct virtio_net_hdr_v1 *hdr,
+                              u16 vlan_len) {
+    u8 *data = (u8 *)frame + frame->tp_mac;
+    u16 start, offset;
+
+    if (frame->tp_status & TP_STATUS_CSUM_VALID) {
+        if (pkt->guest_csum)
+            hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        return;
+    }
+
+    if (!(frame->tp_status & TP_STATUS_CSUMNOTREADY) ||
+        !af_packet_csum_offsets(data, frame->tp_snaplen, &start, &offset))
+        return;
+
+    if (pkt->guest_csum) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = virtio_host_to_guest_u16(pkt->endian, start + vlan_len);
+        hdr->csum_offset = virtio_host_to_guest_u16(pkt->endian, offset);
+    } else {
+        af_packet_csum_complete(data, frame->tp_snaplen, start, offset);
+    }
+}
+
+/* Wait for the kernel to retire the next block to us */
+static int af_packet_rx_next_block(struct af_packet *pkt) {
+    struct tpacket_block_desc *block = af_packet_rx_block(pkt);
+    struct pollfd pfd = {.fd = pkt->fd, .events = POLLIN | POLLERR};
+
+    while (!(af_packet_status(block->hdr.bh1.block_status) & TP_STATUS_USER)) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -errno;
+    }
+    rmb();
+
+    pkt->rx_frame = (void *)block + block->hdr.bh1.offset_to_first_pkt;
+    pkt->rx_left = block->hdr.bh1.num_pkts;
+    return 0;
+}
+
+static void af_packet_rx_release_block(struct af_packet *pkt) {
+    struct tpacket_block_desc *block = af_packet_rx_block(pkt);
+
+    /* We are done reading the frames once the kernel may refill it */
+    mb();
+    af_packet_status(block->hdr.bh1.block_status) = TP_STATUS_KERNEL;
+
+    pkt->rx_block = (pkt->rx_block + 1) % AF_PACKET_RX_BLOCK_NR;
+    pkt->rx_frame = NULL;
+}
+
+/*
+ * Copy the next received frame into the guest buffers. A block stays ours
+ * until all its frames were consumed, so the last frame of a block is
+ * only released on the next call. If the frame doesn't fit, its length is
+ * returned without copying anything.
+ */
+int af_packet_rx(struct iovec *iov, u16 in, struct af_packet *pkt) {
+    /* Largest header there is, hash report included */
+    struct virtio_net_hdr_v1_hash hdr;
+    struct tpacket3_hdr *frame;
+    struct sockaddr_ll *sll;
+    size_t len, off;
+    u16 vlan[2], vlan_len = 0;
+    u8 *data;
+    int r;
+
+    while (1) {
+        if (!pkt->rx_frame && (r = af_packet_rx_next_block(pkt)) < 0)
+            return r;
+
+        if (!pkt->rx_left) {
+            af_packet_rx_release_block(pkt);
+            continue;
+        }
+
+        frame = pkt->rx_frame;
+        pkt->rx_frame = (void *)frame + frame->tp_next_offset;
+        pkt->rx_left--;
+
+        /* Skip our own frames if the kernel can't filter them, runts and truncated ones */
+        sll = (void *)frame + TPACKET_ALIGN(sizeof(*frame));
+        if (sll->sll_pkttype != PACKET_OUTGOING && frame->tp_snaplen >= ETH_HLEN &&
+            frame->tp_snaplen == frame->tp_len)
+            break;
+    }
+
+    data = (u8 *)frame + frame->tp_mac;
+    if (frame->tp_status & TP_STATUS_VLAN_VALID)
+        vlan_len = sizeof(vlan);
+    len = pkt->vnet_hdr_len + vlan_len + frame->tp_snaplen;
+    if (len > iov_size(iov, in))
+        return len;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    af_packet_rx_csum(pkt, frame, &hdr.hdr, vlan_len);
+    memcpy_toiovecend(iov, (unsigned char *)&hdr, 0, pkt->vnet_hdr_len);
+    off = pkt->vnet_hdr_len;
+
+    /* The kernel strips the VLAN tag of the frame, put it back */
+    if (vlan_len) {
+        vlan[0] = htons(frame->tp_status & TP_STATUS_VLAN_TPID_VALID ? frame->hv1.tp_vlan_tpid : ETH_P_8021Q);
+        vlan[1] = htons(frame->hv1.tp_vlan_tci);
+        memcpy_toiovecend(iov, data, off, 2 * ETH_ALEN);
+        memcpy_toiovecend(iov, (unsigned char *)vlan, off + 2 * ETH_ALEN, sizeof(vlan));
+        memcpy_toiovecend(iov, data + 2 * ETH_ALEN, off + 2 * ETH_ALEN + vlan_len, frame->tp_snaplen - 2 * ETH_ALEN);
+    } else {
+        memcpy_toiovecend(iov, data, off, frame->tp_snaplen);
+    }
+
+    return len;
+}
+
+/* Hand the frames queued so far to the kernel, waiting for them if asked */
+static int af_packet_tx_kick(struct af_packet *pkt, bool wait) {
+    pkt->tx_pending = 0;
+
+    while (send(pkt->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == ENOBUFS)
+            return 0;
+        return -errno;
+    }
+
+    return 0;
+}
+
+void af_packet_tx_flush(struct af_packet *pkt) {
+    if (pkt->tx_pending)
+        af_packet_tx_kick(pkt, false);
+}
+
+/*
+ * Queue a frame on the TX ring. The kernel is only kicked once the guest
+ * ran out of frames to send, see af_packet_tx_flush(), or when half of the
+ * ring is waiting. Frames larger than the MTU are dropped, like the
+ * interface would, and so are empty ones: neither stops the queue.
+ */
+int af_packet_tx(struct iovec *iov, u16 out, struct af_packet *pkt) {
+    const size_t data_off = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+    size_t total = iov_size(iov, out);
+    size_t len = total - pkt->vnet_hdr_len;
+    struct tpacket3_hdr *frame;
+    int r;
+
+    if (total <= pkt->vnet_hdr_len || len > pkt->tx_frame_size - data_off) {
+        pkt->tx_dropped++;
+        return total;
+    }
+
+    frame = af_packet_tx_frame(pkt);
+    while (af_packet_status(frame->tp_status) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        r = af_packet_tx_kick(pkt, true);
+        if (r < 0)
+            return r;
+    }
+    rmb();
+
+    memcpy_fromiovecend((unsigned char *)frame + data_off, iov, pkt->vnet_hdr_len, len);
+    frame->tp_len = len;
+    frame->tp_next_offset = 0;
+
+    /* The frame must be complete before the kernel may see it */
+    wmb();
+    af_packet_status(frame->tp_status) = TP_STATUS_SEND_REQUEST;
+
+    pkt->tx_frame = (pkt->tx_frame + 1) % pkt->tx_frame_nr;
+    if (++pkt->tx_pending == pkt->tx_frame_nr / 2)
+        af_packet_tx_kick(pkt, false);
+
+    return len + pkt->vnet_hdr_len;
+}
@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/kernel.h>
+#include <linux/sockios.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kvm/af-xdp.h"
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Publish or read an index of a ring shared with the kernel */
+#define af_xdp_index(p) (*(volatile u32 *)(p))
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Number of queues the interface receives on, each getting a socket */
+int af_xdp_nr_queues(const char *ifname) {
+    struct ethtool_channels channels = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr = {};
+    int fd, r;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return 1;
+
+    strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+    ifr.ifr_data = (void *)&channels;
+    r = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+
+    if (r < 0)
+        return 1;
+    r = max(channels.combined_count, channels.rx_count);
+    return r ?: 1;
+}
+
+/*
+ * Load and attach the program below, natively if the driver supports XDP
+ * and as generic XDP otherwise:
+ *
+ *     return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ */
+int af_xdp_prog_attach(struct af_xdp_prog *prog, const char *ifname, u32 nr_queues) {
+    const u32 modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+    struct bpf_insn insns[] = {
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_2,
+            .src_reg = BPF_REG_1,
+            .off = offsetof(struct xdp_md, rx_queue_index),
+        },
+        {.code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD},
+        {},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS},
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+        {.code = BPF_JMP | BPF_EXIT},
+    };
+    union bpf_attr attr;
+    int ifindex, r;
+    u32 i;
+
+    memset(prog, 0, sizeof(*prog));
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        pr_warning("Unknown interface %s", ifname);
+        return -ENODEV;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(u32);
+    attr.value_size = sizeof(int);
+    attr.max_entries = nr_queues;
+    prog->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (prog->map_fd < 0) {
+        r = -errno;
+        prog->map_fd = 0;
+        pr_warning("Unable to create the XSK map");
+        goto fail;
+    }
+
+    insns[1].imm = prog->map_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (unsigned long)insns;
+    attr.insn_cnt = ARRAY_SIZE(insns);
+    attr.license = (unsigned long)"GPL";
+    prog->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (prog->prog_fd < 0) {
+        r = -errno;
+        prog->prog_fd = 0;
+        pr_warning("Unable to load the XDP program");
+        goto fail;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = prog->prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = modes[i];
+        prog->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (prog->link_fd >= 0)
+            return 0;
+        r = -errno;
+    }
+
+    prog->link_fd = 0;
+    pr_warning("Unable to attach the XDP program to %s", ifname);
+
+fail:
+    af_xdp_prog_detach(prog);
+    return r;
+}
+
+void af_xdp_prog_detach(struct af_xdp_prog *prog) {
+    /* The program stays attached as long as the link is open */
+    if (prog->link_fd > 0)
+        close(prog->link_fd);
+    if (prog->prog_fd > 0)
+        close(prog->prog_fd);
+    if (prog->map_fd > 0)
+        close(prog->map_fd);
+    memset(prog, 0, sizeof(*prog));
+}
+
+static int af_xdp_ring_map(struct af_xdp *xsk, struct af_xdp_ring *ring, struct xdp_ring_offset *off,
+                           size_t desc_size, off_t pgoff) {
+    ring->map_len = off->desc + AF_XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -errno;
+    }
+
+    ring->producer = ring->map + off->producer;
+    ring->consumer = ring->map + off->consumer;
+    ring->flags = ring->map + off->flags;
+    ring->descs = ring->map + off->desc;
+    return 0;
+}
+
+/* Entries we may consume, looking at the producer again once we've seen them all */
+static u32 af_xdp_ring_avail(struct af_xdp_ring *ring) {
+    u32 avail = ring->cached_prod - ring->cached_cons;
+
+    if (avail)
+        return avail;
+
+    ring->cached_prod = af_xdp_index(ring->producer);
+    /* Read the entries after the producer index that covers them */
+    rmb();
+    return ring->cached_prod - ring->cached_cons;
+}
+
+static void af_xdp_ring_submit(struct af_xdp_ring *ring) {
+    /* Entries must be visible before the producer index that covers them */
+    wmb();
+    af_xdp_index(ring->producer) = ring->cached_prod;
+}
+
+static void af_xdp_ring_release(struct af_xdp_ring *ring) {
+    /* Done reading the entries before handing them back */
+    mb();
+    af_xdp_index(ring->consumer) = ring->cached_cons;
+}
+
+static int af_xdp_setup_rings(struct af_xdp *xsk) {
+    struct xdp_umem_reg reg = {
+        .addr = (unsigned long)xsk->umem,
+        .len = (u64)(AF_XDP_RX_FRAMES + AF_XDP_TX_FRAMES) * AF_XDP_FRAME_SIZE,
+        .chunk_size = AF_XDP_FRAME_SIZE,
+    };
+    int size = AF_XDP_RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    int r;
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+        getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        return -errno;
+
+    if ((r = af_xdp_ring_map(xsk, &xsk->fill, &off.fr, sizeof(u64), XDP_UMEM_PGOFF_FILL_RING)) < 0 ||
+        (r = af_xdp_ring_map(xsk, &xsk->comp, &off.cr, sizeof(u64), XDP_UMEM_PGOFF_COMPLETION_RING)) < 0 ||
+        (r = af_xdp_ring_map(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) < 0 ||
+        (r = af_xdp_ring_map(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) < 0)
+        return r;
+
+    return 0;
+}
+
+/* Zero-copy when the driver supports it, copying the frames otherwise */
+static int af_xdp_bind(struct af_xdp *xsk, int ifindex, u32 queue) {
+    const u16 modes[] = {
+        XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+        XDP_COPY | XDP_USE_NEED_WAKEUP,
+        XDP_COPY,
+    };
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = queue,
+    };
+    u32 i;
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        sxdp.sxdp_flags = modes[i];
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+            xsk->zerocopy = modes[i] & XDP_ZEROCOPY;
+            xsk->need_wakeup = modes[i] & XDP_USE_NEED_WAKEUP;
+            return 0;
+        }
+    }
+
+    return -errno;
+}
+
+int af_xdp_init(struct af_xdp *xsk, struct af_xdp_prog *prog, const char *ifname, u32 queue) {
+    size_t umem_len = (size_t)(AF_XDP_RX_FRAMES + AF_XDP_TX_FRAMES) * AF_XDP_FRAME_SIZE;
+    int ifindex, r;
+    u32 i;
+
+    memset(xsk, 0, sizeof(*xsk));
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex)
+        return -ENODEV;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0)
+        return -errno;
+
+    xsk->umem = mmap(NULL, umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        r = -errno;
+        xsk->umem = NULL;
+        goto fail;
+    }
+
+    r = af_xdp_setup_rings(xsk);
+    if (r < 0) {
+        pr_warning("Unable to set up the XSK rings");
+        goto fail;
+    }
+
+    /* The first frames are for RX and all given to the kernel, the others for TX */
+    for (i = 0; i < AF_XDP_RX_FRAMES; i++)
+        ((u64 *)xsk->fill.descs)[xsk->fill.cached_prod++ % AF_XDP_RING_SIZE] = (u64)i * AF_XDP_FRAME_SIZE;
+    af_xdp_ring_submit(&xsk->fill);
+
+    for (i = 0; i < AF_XDP_TX_FRAMES; i++)
+        xsk->tx_free[xsk->nr_tx_free++] = (u64)(AF_XDP_RX_FRAMES + i) * AF_XDP_FRAME_SIZE;
+
+    r = af_xdp_bind(xsk, ifindex, queue);
+    if (r < 0) {
+        pr_warning("Unable to bind to queue %u of %s", queue, ifname);
+        goto fail;
+    }
+
+    r = af_xdp_steer(xsk, prog, queue, true);
+    if (r < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    af_xdp_exit(xsk);
+    return r;
+}
+
+/* Redirect the frames of a queue to its socket, or leave them to the host */
+int af_xdp_steer(struct af_xdp *xsk, struct af_xdp_prog *prog, u32 queue, bool enable) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = prog->map_fd;
+    attr.key = (unsigned long)&queue;
+    if (enable) {
+        attr.value = (unsigned long)&xsk->fd;
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+            return -errno;
+    } else if (sys_bpf(BPF_MAP_DELETE_ELEM, &attr) < 0 && errno != ENOENT) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+void af_xdp_exit(struct af_xdp *xsk) {
+    struct af_xdp_ring *rings[] = {&xsk->fill, &xsk->comp, &xsk->rx, &xsk->tx};
+    u32 i;
+
+    for (i = 0; i < ARRAY_SIZE(rings); i++) {
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_len);
+    }
+    if (xsk->fd > 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, (size_t)(AF_XDP_RX_FRAMES + AF_XDP_TX_FRAMES) * AF_XDP_FRAME_SIZE);
+    memset(xsk, 0, sizeof(*xsk));
+}
+
+/* Give consumed RX frames back to the kernel through the fill ring */
+static void af_xdp_rx_recycle(struct af_xdp *xsk) {
+    af_xdp_ring_release(&xsk->rx);
+    af_xdp_ring_submit(&xsk->fill);
+
+    if (xsk->need_wakeup && (af_xdp_index(xsk->fill.flags) & XDP_RING_NEED_WAKEUP))
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/*
+ * Copy the next received frame into the guest buffers. The RX and fill
+ * rings are only synced with the kernel once all frames seen at the last
+ * sync were consumed. If the frame doesn't fit, its length is returned
+ * without copying anything.
+ */
+int af_xdp_rx(struct iovec *iov, u16 in, struct af_xdp *xsk) {
+    struct pollfd pfd = {.fd = xsk->fd, .events = POLLIN};
+    /* Largest header there is, hash report included */
+    struct virtio_net_hdr_v1_hash hdr;
+    struct xdp_desc *desc;
+    size_t len;
+    u64 addr;
+
+    while (!af_xdp_ring_avail(&xsk->rx)) {
+        af_xdp_rx_recycle(xsk);
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -errno;
+    }
+
+    desc = &((struct xdp_desc *)xsk->rx.descs)[xsk->rx.cached_cons++ % AF_XDP_RING_SIZE];
+    addr = desc->addr;
+
+    len = xsk->vnet_hdr_len + desc->len;
+    if (len <= iov_size(iov, in)) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+        memcpy_toiovecend(iov, (unsigned char *)&hdr, 0, xsk->vnet_hdr_len);
+        memcpy_toiovecend(iov, xsk->umem + addr, xsk->vnet_hdr_len, desc->len);
+    }
+
+    /* There are as many RX frames as fill ring entries, so there is room */
+    ((u64 *)xsk->fill.descs)[xsk->fill.cached_prod++ % AF_XDP_RING_SIZE] = addr & ~(u64)(AF_XDP_FRAME_SIZE - 1);
+
+    return len;
+}
+
+/* Collect the TX frames the kernel is done with */
+static void af_xdp_tx_complete(struct af_xdp *xsk) {
+    u32 n = af_xdp_ring_avail(&xsk->comp);
+
+    if (!n)
+        return;
+
+    while (n--)
+        xsk->tx_free[xsk->nr_tx_free++] = ((u64 *)xsk->comp.descs)[xsk->comp.cached_cons++ % AF_XDP_RING_SIZE];
+    af_xdp_ring_release(&xsk->comp);
+}
+
+/* In copy mode each call sends a bounded batch, and asks to be called again */
+static void af_xdp_tx_kick(struct af_xdp *xsk) {
+    while (!xsk->need_wakeup || (af_xdp_index(xsk->tx.flags) & XDP_RING_NEED_WAKEUP)) {
+        if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0 || errno != EAGAIN)
+            break;
+        af_xdp_tx_complete(xsk);
+    }
+}
+
+void af_xdp_tx_flush(struct af_xdp *xsk) {
+    if (!xsk->tx_pending)
+        return;
+
+    af_xdp_ring_submit(&xsk->tx);
+    af_xdp_tx_kick(xsk);
+    xsk->tx_pending = 0;
+}
+
+/*
+ * Queue a frame on the TX ring. Descriptors are published once the guest
+ * ran out of frames to send, see af_xdp_tx_flush(), or when a batch of
+ * half the ring is waiting. Frames larger than a UMEM frame are dropped.
+ */
+int af_xdp_tx(struct iovec *iov, u16 out, struct af_xdp *xsk) {
+    struct pollfd pfd = {.fd = xsk->fd, .events = POLLOUT};
+    size_t len = iov_size(iov, out);
+    struct xdp_desc *desc;
+    u64 addr;
+
+    if (len <= xsk->vnet_hdr_len)
+        return -EINVAL;
+    if (len - xsk->vnet_hdr_len > AF_XDP_FRAME_SIZE)
+        return len;
+
+    af_xdp_tx_complete(xsk);
+    while (!xsk->nr_tx_free) {
+        /* Every frame is in flight, have the kernel send and wait for some */
+        af_xdp_tx_flush(xsk);
+        af_xdp_tx_kick(xsk);
+        if (poll(&pfd, 1, 1) < 0 && errno != EINTR)
+            return -errno;
+        af_xdp_tx_complete(xsk);
+    }
+
+    /* There are as many TX frames as ring entries, so there is room */
+    addr = xsk->tx_free[--xsk->nr_tx_free];
+    memcpy_fromiovecend(xsk->umem + addr, iov, xsk->vnet_hdr_len, len - xsk->vnet_hdr_len);
+
+    desc = &((struct xdp_desc *)xsk->tx.descs)[xsk->tx.cached_prod++ % AF_XDP_RING_SIZE];
+    desc->addr = addr;
+    desc->len = len - xsk->vnet_hdr_len;
+    desc->options = 0;
+
+    if (++xsk->tx_pending == AF_XDP_RING_SIZE / 2)
+        af_xdp_tx_flush(xsk);
+
+    return len;
+}
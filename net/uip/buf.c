@@ -2,76 +2,117 @@
 #include <linux/list.h>
 
 #include "kvm/uip.h"
-
-struct uip_buf *uip_buf_get_used(struct uip_info *info) {
+#include "kvm/virtio-net-rss.h"
+
+/*
+ * Buffers move between the free and the used FIFO, so taking one is O(1)
+ * whatever the pool size, and frames reach the guest in the order they were
+ * queued.
+ */
+struct uip_buf *uip_buf_get_used(struct uip_info *info, u16 queue) {
+    struct list_head *head = &info->buf_used_head[queue];
     struct uip_buf *buf;
-    bool found = false;
 
     mutex_lock(&info->buf_lock);
 
-    while (!(info->buf_used_nr > 0)) pthread_cond_wait(&info->buf_used_cond, &info->buf_lock.mutex);
-
-    list_for_each_entry(buf, &info->buf_head, list) {
-        if (buf->status == UIP_BUF_STATUS_USED) {
-            /*
-             * Set status to INUSE immediately to prevent
-             * someone from using this buf until we free it
-             */
-            buf->status = UIP_BUF_STATUS_INUSE;
-            info->buf_used_nr--;
-            found = true;
-            break;
-        }
-    }
+    while (list_empty(head)) pthread_cond_wait(&info->buf_used_cond[queue], &info->buf_lock.mutex);
+
+    /*
+     * Set status to INUSE immediately to prevent
+     * someone from using this buf until we free it
+     */
+    buf = list_first_entry(head, struct uip_buf, queue);
+    list_del(&buf->queue);
+    buf->status = UIP_BUF_STATUS_INUSE;
 
     mutex_unlock(&info->buf_lock);
 
-    return found ? buf : NULL;
+    return buf;
 }
 
 struct uip_buf *uip_buf_get_free(struct uip_info *info) {
     struct uip_buf *buf;
-    bool found = false;
 
     mutex_lock(&info->buf_lock);
 
-    while (!(info->buf_free_nr > 0)) pthread_cond_wait(&info->buf_free_cond, &info->buf_lock.mutex);
-
-    list_for_each_entry(buf, &info->buf_head, list) {
-        if (buf->status == UIP_BUF_STATUS_FREE) {
-            /*
-             * Set status to INUSE immediately to prevent
-             * someone from using this buf until we free it
-             */
-            buf->status = UIP_BUF_STATUS_INUSE;
-            info->buf_free_nr--;
-            found = true;
-            break;
-        }
+    while (list_empty(&info->buf_free_head)) pthread_cond_wait(&info->buf_free_cond, &info->buf_lock.mutex);
+
+    buf = list_first_entry(&info->buf_free_head, struct uip_buf, queue);
+    list_del(&buf->queue);
+    buf->status = UIP_BUF_STATUS_INUSE;
+
+    mutex_unlock(&info->buf_lock);
+
+    return buf;
+}
+
+/* Like uip_buf_get_free(), but takes up to nr buffers. Returns how many it got */
+int uip_buf_get_free_batch(struct uip_info *info, struct uip_buf **bufs, int nr) {
+    int i;
+
+    mutex_lock(&info->buf_lock);
+
+    while (list_empty(&info->buf_free_head)) pthread_cond_wait(&info->buf_free_cond, &info->buf_lock.mutex);
+
+    for (i = 0; i < nr && !list_empty(&info->buf_free_head); i++) {
+        bufs[i] = list_first_entry(&info->buf_free_head, struct uip_buf, queue);
+        list_del(&bufs[i]->queue);
+        bufs[i]->status = UIP_BUF_STATUS_INUSE;
     }
 
     mutex_unlock(&info->buf_lock);
 
-    return found ? buf : NULL;
+    return i;
 }
 
+/* Frames of a flow all go to the queue RSS picks for them, keeping their order */
 struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf) {
+    u16 queue = 0, report;
+    u32 hash;
+
+    if (info->rss)
+        queue = virtio_net_rss_queue(info->rss, buf->eth, buf->eth_len, &hash, &report);
+
     mutex_lock(&info->buf_lock);
 
+    if (queue >= info->nr_queues)
+        queue = 0;
+
     buf->status = UIP_BUF_STATUS_USED;
-    info->buf_used_nr++;
-    pthread_cond_signal(&info->buf_used_cond);
+    list_add_tail(&buf->queue, &info->buf_used_head[queue]);
+    pthread_cond_signal(&info->buf_used_cond[queue]);
 
     mutex_unlock(&info->buf_lock);
 
     return buf;
 }
 
+/*
+ * Frames waiting on queues the guest stopped using would never be received,
+ * move them to the first one.
+ */
+void uip_set_queues(struct uip_info *info, u16 nr_queues) {
+    u16 i;
+
+    mutex_lock(&info->buf_lock);
+
+    info->nr_queues = min_t(u16, nr_queues, UIP_MAX_QUEUES);
+    for (i = info->nr_queues; i < UIP_MAX_QUEUES; i++) {
+        if (list_empty(&info->buf_used_head[i]))
+            continue;
+
+        list_splice_tail_init(&info->buf_used_head[i], &info->buf_used_head[0]);
+        pthread_cond_signal(&info->buf_used_cond[0]);
+    }
+
+    mutex_unlock(&info->buf_lock);
+}
+
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf) {
     mutex_lock(&info->buf_lock);
 
     buf->status = UIP_BUF_STATUS_FREE;
-    info->buf_free_nr++;
+    list_add_tail(&buf->queue, &info->buf_free_head);
     pthread_cond_signal(&info->buf_free_cond);
 
     mutex_unlock(&info->buf_lock);
@@ -92,9 +133,9 @@ struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg) {
     buf = uip_buf_get_free(info);
 
     /*
-     * Clone buffer
+     * Clone buffer, without the offload state of the guest vnet header
      */
-    memcpy(buf->vnet, arg->vnet, arg->vnet_len);
+    memset(buf->vnet, 0, arg->vnet_len);
     memcpy(buf->eth, arg->eth, arg->eth_len);
     buf->vnet_len = arg->vnet_len;
     buf->eth_len = arg->eth_len;
@@ -93,14 +93,19 @@ out_free_buf:
     return -EINVAL;
 }
 
-int uip_rx(struct iovec *iov, u16 in, struct uip_info *info) {
+/* The guest has no more frames for now, push out what was held for batching */
+void uip_tx_flush(struct uip_info *info) {
+    uip_udp_tx_flush(info);
+}
+
+int uip_rx(struct iovec *iov, u16 in, struct uip_info *info, u16 queue) {
     struct uip_buf *buf;
     int len;
 
     /*
      * Sleep until there is a buffer for guest
      */
-    buf = uip_buf_get_used(info);
+    buf = uip_buf_get_used(info, queue);
 
     memcpy_toiovecend(iov, buf->vnet, 0, buf->vnet_len);
     memcpy_toiovecend(iov, buf->eth, buf->vnet_len, buf->eth_len);
@@ -115,6 +120,7 @@ void uip_static_init(struct uip_info *info) {
     struct list_head *udp_socket_head;
     struct list_head *tcp_socket_head;
     struct list_head *buf_head;
+    int i;
 
     udp_socket_head = &info->udp_socket_head;
     tcp_socket_head = &info->tcp_socket_head;
@@ -122,16 +128,26 @@ void uip_static_init(struct uip_info *info) {
 
     INIT_LIST_HEAD(udp_socket_head);
     INIT_LIST_HEAD(tcp_socket_head);
+    INIT_LIST_HEAD(&info->tcp_closed_head);
     INIT_LIST_HEAD(buf_head);
+    INIT_LIST_HEAD(&info->buf_free_head);
+
+    for (i = 0; i < UIP_SOCKET_HASH_SIZE; i++) {
+        INIT_HLIST_HEAD(&info->udp_socket_hash[i]);
+        INIT_HLIST_HEAD(&info->tcp_socket_hash[i]);
+    }
 
     mutex_init(&info->udp_socket_lock);
     mutex_init(&info->tcp_socket_lock);
     mutex_init(&info->buf_lock);
 
-    pthread_cond_init(&info->buf_used_cond, NULL);
     pthread_cond_init(&info->buf_free_cond, NULL);
 
-    info->buf_used_nr = 0;
+    for (i = 0; i < UIP_MAX_QUEUES; i++) {
+        INIT_LIST_HEAD(&info->buf_used_head[i]);
+        pthread_cond_init(&info->buf_used_cond[i], NULL);
+    }
+    info->nr_queues = 1;
 }
 
 int uip_init(struct uip_info *info) {
@@ -151,20 +167,19 @@ int uip_init(struct uip_info *info) {
         buf->info = info;
         buf->id = i;
         list_add_tail(&buf->list, buf_head);
+        list_add_tail(&buf->queue, &info->buf_free_head);
     }
 
     list_for_each_entry(buf, buf_head, list) {
         buf->vnet_len = info->vnet_hdr_len;
         buf->vnet = malloc(buf->vnet_len);
-        buf->eth_len = 1024 * 64 + sizeof(struct uip_pseudo_hdr);
+        buf->eth_len = sizeof(struct uip_eth) + 1024 * 64 + sizeof(struct uip_pseudo_hdr);
         buf->eth = malloc(buf->eth_len);
 
         memset(buf->vnet, 0, buf->vnet_len);
         memset(buf->eth, 0, buf->eth_len);
     }
 
-    info->buf_free_nr = buf_nr;
-
     uip_dhcp_get_dns(info);
 
     return 0;
@@ -1,83 +1,160 @@
 #include "kvm/uip.h"
+#include "kvm/virtio.h"
+
+#include <linux/virtio_net.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Ones' complement sum (RFC 1071) of a buffer, accumulated 32 bits at a time
+ * into 64-bit lanes so carries never need handling inside the loop. Words are
+ * summed in memory order, the result is folded by uip_csum_fold().
+ */
+static u64 uip_csum_add(u64 sum, const void *buf, u32 count) {
+    const u8 *addr = buf;
+    u32 word;
+    u16 half;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    u64 lanes[2];
+
+    while (count >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)addr);
+
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        addr += 16;
+        count -= 16;
+    }
 
-static u16 uip_csum(u16 csum, u8 *addr, u16 count) {
-    long sum = csum;
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += lanes[0] >> 32;
+    sum += lanes[0] & 0xffffffff;
+    sum += lanes[1] >> 32;
+    sum += lanes[1] & 0xffffffff;
+#elif defined(__ARM_NEON)
+    uint64x2_t acc = vdupq_n_u64(0);
+    u64 lane;
+
+    while (count >= 16) {
+        acc = vpadalq_u32(acc, vreinterpretq_u32_u8(vld1q_u8(addr)));
+        addr += 16;
+        count -= 16;
+    }
 
-    while (count > 1) {
-        sum += *(u16 *)addr;
+    lane = vgetq_lane_u64(acc, 0);
+    sum += (lane >> 32) + (lane & 0xffffffff);
+    lane = vgetq_lane_u64(acc, 1);
+    sum += (lane >> 32) + (lane & 0xffffffff);
+#endif
+
+    while (count >= 4) {
+        memcpy(&word, addr, 4);
+        sum += word;
+        addr += 4;
+        count -= 4;
+    }
+
+    if (count >= 2) {
+        memcpy(&half, addr, 2);
+        sum += half;
         addr += 2;
         count -= 2;
     }
 
+    /* Odd length, as if padded with a zero byte */
     if (count > 0)
-        sum += *(unsigned char *)addr;
-
-    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+        sum += *addr;
 
-    return ~sum;
+    return sum;
 }
 
-u16 uip_csum_ip(struct uip_ip *ip) {
-    return uip_csum(0, &ip->vhl, uip_ip_hdrlen(ip));
-}
+static u16 uip_csum_fold(u64 sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
 
-u16 uip_csum_icmp(struct uip_icmp *icmp) {
-    struct uip_ip *ip;
+    return sum;
+}
 
-    ip = &icmp->ip;
-    return icmp->csum = uip_csum(0, &icmp->type, htons(ip->len) - uip_ip_hdrlen(ip) - 8); /* icmp header len = 8 */
+static u16 uip_csum(u16 csum, u8 *addr, u32 count) {
+    return ~uip_csum_fold(uip_csum_add(csum, addr, count));
 }
 
-u16 uip_csum_udp(struct uip_udp *udp) {
+/* Sum of the TCP/UDP pseudo header, not complemented */
+static u16 uip_csum_pseudo(struct uip_ip *ip, u16 len) {
     struct uip_pseudo_hdr hdr;
-    struct uip_ip *ip;
-    int udp_len;
-    u8 *udp_hdr = (u8 *)udp + offsetof(struct uip_udp, sport);
-
-    ip = &udp->ip;
 
     hdr.sip = ip->sip;
     hdr.dip = ip->dip;
     hdr.zero = 0;
     hdr.proto = ip->proto;
-    hdr.len = udp->len;
+    hdr.len = htons(len);
+
+    return uip_csum_fold(uip_csum_add(0, &hdr, sizeof(hdr)));
+}
+
+u16 uip_csum_ip(struct uip_ip *ip) {
+    return uip_csum(0, &ip->vhl, uip_ip_hdrlen(ip));
+}
+
+u16 uip_csum_udp(struct uip_udp *udp) {
+    u16 udp_len, csum;
 
     udp_len = uip_udp_len(udp);
+    csum = uip_csum(uip_csum_pseudo(&udp->ip, udp_len), (u8 *)udp + offsetof(struct uip_udp, sport), udp_len);
 
-    if (udp_len % 2) {
-        udp_hdr[udp_len] = 0; /* zero padding */
-        memcpy(udp_hdr + udp_len + 1, &hdr, sizeof(hdr));
-        return uip_csum(0, udp_hdr, udp_len + 1 + sizeof(hdr));
-    } else {
-        memcpy(udp_hdr + udp_len, &hdr, sizeof(hdr));
-        return uip_csum(0, udp_hdr, udp_len + sizeof(hdr));
-    }
+    /* Zero means no checksum to UDP */
+    return csum ?: 0xffff;
 }
 
 u16 uip_csum_tcp(struct uip_tcp *tcp) {
-    struct uip_pseudo_hdr hdr;
     struct uip_ip *ip;
     u16 tcp_len;
-    u8 *tcp_hdr = (u8 *)tcp + offsetof(struct uip_tcp, sport);
 
     ip = &tcp->ip;
     tcp_len = ntohs(ip->len) - uip_ip_hdrlen(ip);
 
-    hdr.sip = ip->sip;
-    hdr.dip = ip->dip;
-    hdr.zero = 0;
-    hdr.proto = ip->proto;
-    hdr.len = htons(tcp_len);
-
     if (tcp_len > UIP_MAX_TCP_PAYLOAD + 20)
         pr_warning("tcp_len(%d) is too large", tcp_len);
 
-    if (tcp_len % 2) {
-        tcp_hdr[tcp_len] = 0; /* zero padding */
-        memcpy(tcp_hdr + tcp_len + 1, &hdr, sizeof(hdr));
-        return uip_csum(0, tcp_hdr, tcp_len + 1 + sizeof(hdr));
-    } else {
-        memcpy(tcp_hdr + tcp_len, &hdr, sizeof(hdr));
-        return uip_csum(0, tcp_hdr, tcp_len + sizeof(hdr));
+    return uip_csum(uip_csum_pseudo(ip, tcp_len), (u8 *)tcp + offsetof(struct uip_tcp, sport), tcp_len);
+}
+
+/*
+ * Fill the TCP or UDP checksum of a frame going to the guest. When the guest
+ * takes partial checksums, only the pseudo header is summed and the frame is
+ * flagged for the guest to complete, or skip on local delivery.
+ */
+void uip_csum_guest(struct uip_info *info, struct uip_buf *buf) {
+    struct virtio_net_hdr *hdr;
+    struct uip_ip *ip;
+    u16 *csum, offset;
+
+    ip = (struct uip_ip *)buf->eth;
+    hdr = (struct virtio_net_hdr *)buf->vnet;
+
+    if (ip->proto == UIP_IP_P_TCP)
+        offset = offsetof(struct uip_tcp, csum) - offsetof(struct uip_tcp, sport);
+    else
+        offset = offsetof(struct uip_udp, csum) - offsetof(struct uip_udp, sport);
+
+    csum = (u16 *)(buf->eth + offsetof(struct uip_tcp, sport) + offset);
+
+    if (!info->guest_csum) {
+        if (ip->proto == UIP_IP_P_TCP)
+            *csum = uip_csum_tcp((struct uip_tcp *)buf->eth);
+        else
+            *csum = uip_csum_udp((struct uip_udp *)buf->eth);
+        return;
     }
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = virtio_host_to_guest_u16(info->endian, uip_eth_hdrlen(&ip->eth) + uip_ip_hdrlen(ip));
+    hdr->csum_offset = virtio_host_to_guest_u16(info->endian, offset);
+    *csum = uip_csum_pseudo(ip, ntohs(ip->len) - uip_ip_hdrlen(ip));
 }
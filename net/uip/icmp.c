@@ -4,6 +4,7 @@ int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg) {
     struct uip_ip *ip, *ip2;
     struct uip_icmp *icmp2;
     struct uip_buf *buf;
+    u16 old, new;
 
     buf = uip_buf_clone(arg);
 
@@ -11,16 +12,18 @@ int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg) {
     ip2 = (struct uip_ip *)(buf->eth);
     ip = (struct uip_ip *)(arg->eth);
 
+    /*
+     * Swapping the addresses leaves the IP checksum as it is
+     */
     ip2->sip = ip->dip;
     ip2->dip = ip->sip;
-    ip2->csum = 0;
     /*
-     * ICMP reply: 0
+     * ICMP reply: 0, only the type/code word of the ICMP checksum changes
      */
+    memcpy(&old, &icmp2->type, sizeof(old));
     icmp2->type = 0;
-    icmp2->csum = 0;
-    ip2->csum = uip_csum_ip(ip2);
-    icmp2->csum = uip_csum_icmp(icmp2);
+    memcpy(&new, &icmp2->type, sizeof(new));
+    icmp2->csum = uip_csum_replace(icmp2->csum, old, new);
 
     uip_buf_set_used(arg->info, buf);
 
@@ -1,115 +1,126 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <kvm/kvm.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/virtio_net.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "kvm/uip.h"
+#include "kvm/virtio.h"
 
-static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how) {
-    shutdown(sk->fd, how);
+/*
+ * All host sockets are non-blocking and serviced by a single thread waiting on
+ * tcp_epollfd. Both that thread and the guest TX path only touch a connection
+ * with the tcp socket lock held.
+ */
 
-    if (sk->write_done && sk->read_done) {
-        shutdown(sk->fd, SHUT_RDWR);
-        close(sk->fd);
+/* Bytes the guest is still willing to receive. Caller holds the sk lock */
+static s32 uip_tcp_guest_window(struct uip_tcp_socket *sk) {
+    return (s32)(sk->guest_acked + sk->window_size - sk->seq_server);
+}
 
-        mutex_lock(sk->lock);
-        list_del(&sk->list);
-        mutex_unlock(sk->lock);
+/* Wait for what the connection can make progress on. Caller holds the sk lock */
+static void uip_tcp_socket_update(struct uip_tcp_socket *sk) {
+    struct epoll_event ev = {.data.ptr = sk};
 
-        free(sk->buf);
-        free(sk);
+    if (sk->state == UIP_TCP_CLOSED)
+        return;
+
+    if (sk->state == UIP_TCP_CONNECTING) {
+        ev.events = EPOLLOUT;
+    } else {
+        if (!sk->read_done && uip_tcp_guest_window(sk) > 0)
+            ev.events |= EPOLLIN;
+        if (sk->snd_len)
+            ev.events |= EPOLLOUT;
     }
 
-    return 0;
+    if (ev.events == sk->events)
+        return;
+
+    if (epoll_ctl(sk->info->tcp_epollfd, EPOLL_CTL_MOD, sk->fd, &ev) < 0)
+        pr_warning("epoll_ctl error");
+    else
+        sk->events = ev.events;
 }
 
-static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport) {
-    struct list_head *sk_head;
-    struct mutex *sk_lock;
-    struct uip_tcp_socket *sk;
+/*
+ * Caller holds the sk lock. Closing the fd drops it from tcp_epollfd, the sk
+ * itself is freed by the TCP thread once it can't have a pending event for it.
+ */
+static void uip_tcp_socket_close(struct uip_tcp_socket *sk) {
+    if (sk->state == UIP_TCP_CLOSED)
+        return;
+
+    sk->state = UIP_TCP_CLOSED;
+    close(sk->fd);
+    hlist_del(&sk->node);
+    list_move_tail(&sk->list, &sk->info->tcp_closed_head);
+}
 
-    sk_head = &arg->info->tcp_socket_head;
-    sk_lock = &arg->info->tcp_socket_lock;
+/* Both directions are shut and all guest data reached the host socket */
+static void uip_tcp_socket_try_close(struct uip_tcp_socket *sk) {
+    if (sk->read_done && sk->write_done && !sk->snd_len)
+        uip_tcp_socket_close(sk);
+}
 
-    mutex_lock(sk_lock);
-    list_for_each_entry(sk, sk_head, list) {
-        if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
-            mutex_unlock(sk_lock);
-            return sk;
-        }
-    }
-    mutex_unlock(sk_lock);
+static void uip_tcp_socket_reap(struct uip_info *info) {
+    struct uip_tcp_socket *sk, *next;
 
-    return NULL;
+    mutex_lock(&info->tcp_socket_lock);
+    list_for_each_entry_safe(sk, next, &info->tcp_closed_head, list) {
+        list_del(&sk->list);
+        free(sk->sndbuf);
+        free(sk);
+    }
+    mutex_unlock(&info->tcp_socket_lock);
 }
 
-static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport) {
-    struct list_head *sk_head;
+/* Caller holds the tcp socket lock */
+static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_info *info, u32 sip, u32 dip, u16 sport, u16 dport) {
     struct uip_tcp_socket *sk;
-    struct mutex *sk_lock;
-    struct uip_tcp *tcp;
-    struct uip_ip *ip;
-    int ret;
+    struct hlist_head *head;
 
-    tcp = (struct uip_tcp *)arg->eth;
-    ip = (struct uip_ip *)arg->eth;
-
-    sk_head = &arg->info->tcp_socket_head;
-    sk_lock = &arg->info->tcp_socket_lock;
-
-    sk = malloc(sizeof(*sk));
-    memset(sk, 0, sizeof(*sk));
-
-    sk->lock = sk_lock;
-    sk->info = arg->info;
+    head = &info->tcp_socket_hash[uip_socket_hash(sip, dip, sport, dport)];
+    hlist_for_each_entry(sk, head, node) {
+        if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport)
+            return sk;
+    }
 
-    sk->fd = socket(AF_INET, SOCK_STREAM, 0);
-    sk->addr.sin_family = AF_INET;
-    sk->addr.sin_port = dport;
-    sk->addr.sin_addr.s_addr = dip;
+    return NULL;
+}
 
-    pthread_cond_init(&sk->cond, NULL);
+/* MSS option of a guest SYN */
+static u16 uip_tcp_mss(struct uip_tcp *tcp) {
+    u8 *opt, *end;
 
-    if (ntohl(dip) == arg->info->host_ip)
-        sk->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    opt = (u8 *)tcp + offsetof(struct uip_tcp, urgent) + sizeof(tcp->urgent);
+    end = uip_tcp_payload(tcp);
 
-    ret = connect(sk->fd, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
-    if (ret) {
-        free(sk);
-        return NULL;
+    while (opt < end && *opt != UIP_TCP_OPT_END) {
+        if (*opt == UIP_TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (end - opt < 2 || opt[1] < 2 || end - opt < opt[1])
+            break;
+        if (opt[0] == UIP_TCP_OPT_MSS && opt[1] == UIP_TCP_OPT_MSS_LEN)
+            return (opt[2] << 8 | opt[3]) ?: UIP_TCP_MSS;
+        opt += opt[1];
     }
 
-    sk->sip = ip->sip;
-    sk->dip = ip->dip;
-    sk->sport = tcp->sport;
-    sk->dport = tcp->dport;
-
-    mutex_lock(sk_lock);
-    list_add_tail(&sk->list, sk_head);
-    mutex_unlock(sk_lock);
-
-    return sk;
+    return UIP_TCP_MSS;
 }
 
-/* Caller holds the sk lock */
-static void uip_tcp_socket_free(struct uip_tcp_socket *sk) {
-    /*
-     * Here we assume that the virtqueues are already inactive so we don't
-     * race with uip_tx_do_ipv4_tcp. We are racing with
-     * uip_tcp_socket_thread though, but holding the sk lock ensures that it
-     * cannot free data concurrently.
-     */
-    if (sk->thread) {
-        pthread_cancel(sk->thread);
-        pthread_join(sk->thread, NULL);
-    }
-
-    sk->write_done = sk->read_done = 1;
-    uip_tcp_socket_close(sk, SHUT_RDWR);
+/* Window offered to the guest: what the send buffer can still take */
+static u16 uip_tcp_window(struct uip_tcp_socket *sk) {
+    return min_t(u32, UIP_TCP_SNDBUF_SIZE - sk->snd_len, 0xffff);
 }
 
 static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len) {
+    struct virtio_net_hdr *hdr;
     struct uip_info *info;
     struct uip_eth *eth2;
     struct uip_tcp *tcp2;
@@ -149,20 +160,30 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
     tcp2->seq = htonl(sk->seq_server);
     tcp2->ack = htonl(sk->ack_server);
     /*
-     * Diable TCP options, tcp hdr len equals 20 bytes
+     * The only TCP option sent is our MSS on the SYN-ACK: any segment size
+     * is fine, host sockets take a byte stream.
      */
     tcp2->off = UIP_TCP_HDR_LEN;
     tcp2->flg = flag;
-    tcp2->win = htons(UIP_TCP_WIN_SIZE);
+    tcp2->win = htons(uip_tcp_window(sk));
     tcp2->csum = 0;
     tcp2->urgent = 0;
 
+    if (flag & UIP_TCP_FLAG_SYN) {
+        u8 *opt = uip_tcp_payload(tcp2);
+
+        opt[0] = UIP_TCP_OPT_MSS;
+        opt[1] = UIP_TCP_OPT_MSS_LEN;
+        opt[2] = UIP_MAX_TCP_PAYLOAD >> 8;
+        opt[3] = UIP_MAX_TCP_PAYLOAD & 0xff;
+        tcp2->off += UIP_TCP_OPT_MSS_LEN << 2;
+    }
+
     if (payload_len > 0)
         memcpy(uip_tcp_payload(tcp2), sk->payload, payload_len);
 
     ip2->len = htons(uip_tcp_hdrlen(tcp2) + payload_len + uip_ip_hdrlen(ip2));
     ip2->csum = uip_csum_ip(ip2);
-    tcp2->csum = uip_csum_tcp(tcp2);
 
     /*
      * virtio_net_hdr
@@ -170,6 +191,20 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
     buf->vnet_len = info->vnet_hdr_len;
     memset(buf->vnet, 0, buf->vnet_len);
 
+    uip_csum_guest(info, buf);
+
+    /*
+     * Past the guest MSS, only sent when it takes TSO frames: let it
+     * segment the frame, or better keep it whole up its stack
+     */
+    if (payload_len > sk->mss) {
+        hdr = (struct virtio_net_hdr *)buf->vnet;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = virtio_host_to_guest_u16(info->endian, sk->mss);
+        hdr->hdr_len = virtio_host_to_guest_u16(
+            info->endian, uip_eth_hdrlen(&ip2->eth) + uip_ip_hdrlen(ip2) + uip_tcp_hdrlen(tcp2));
+    }
+
     buf->eth_len = ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
     /*
@@ -185,186 +220,436 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
     return 0;
 }
 
-static void *uip_tcp_socket_thread(void *p) {
-    struct uip_tcp_socket *sk;
-    int len, left, ret;
-    u8 *pos;
+/* The remote end went away, reset the guest side. Caller holds the sk lock */
+static void uip_tcp_socket_reset(struct uip_tcp_socket *sk) {
+    uip_tcp_payload_send(sk, UIP_TCP_FLAG_RST | UIP_TCP_FLAG_ACK, 0);
+    uip_tcp_socket_close(sk);
+}
 
-    kvm_set_thread_name("uip-tcp");
+/* The guest reset the connection, reset the remote side too. Caller holds the sk lock */
+static void uip_tcp_socket_abort(struct uip_tcp_socket *sk) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
 
-    sk = p;
+    setsockopt(sk->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    uip_tcp_socket_close(sk);
+}
 
-    while (1) {
-        pos = sk->buf;
+/* Non-blocking connect completed, answer the guest SYN. Caller holds the sk lock */
+static void uip_tcp_socket_connected(struct uip_tcp_socket *sk) {
+    socklen_t len = sizeof(int);
+    int err = 0;
 
-        ret = read(sk->fd, sk->buf, UIP_MAX_TCP_PAYLOAD);
+    if (getsockopt(sk->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
 
-        if (ret <= 0 || ret > UIP_MAX_TCP_PAYLOAD)
-            goto out;
+    if (err == EINPROGRESS)
+        return;
 
-        left = ret;
+    if (err) {
+        uip_tcp_socket_reset(sk);
+        return;
+    }
 
-        while (left > 0) {
-            mutex_lock(sk->lock);
-            while ((len = sk->guest_acked + sk->window_size - sk->seq_server) <= 0)
-                pthread_cond_wait(&sk->cond, &sk->lock->mutex);
-            mutex_unlock(sk->lock);
-
-            sk->payload = pos;
-            if (len > left)
-                len = left;
-            if (len > UIP_MAX_TCP_PAYLOAD)
-                len = UIP_MAX_TCP_PAYLOAD;
-            left -= len;
-            pos += len;
-
-            uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, len);
-        }
+    sk->state = UIP_TCP_ESTABLISHED;
+    uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
+    sk->seq_server += 1;
+    sk->guest_acked = sk->seq_server;
+}
+
+/* Push buffered guest data to the host socket. Caller holds the sk lock */
+static int uip_tcp_socket_flush(struct uip_tcp_socket *sk) {
+    ssize_t ret;
+
+    if (!sk->snd_len)
+        return 0;
+
+    ret = write(sk->fd, sk->sndbuf, sk->snd_len);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+    sk->snd_len -= ret;
+    if (sk->snd_len) {
+        memmove(sk->sndbuf, sk->sndbuf + ret, sk->snd_len);
+        return 0;
+    }
+
+    free(sk->sndbuf);
+    sk->sndbuf = NULL;
+
+    /*
+     * Guest FIN was held back until its data went out. Otherwise tell the
+     * guest its window opened again, it may be waiting on a zero window.
+     */
+    if (sk->write_done)
+        shutdown(sk->fd, SHUT_WR);
+    else
+        uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+
+    return 0;
+}
+
+/* Forward what the guest window allows from the host socket. Caller holds the sk lock */
+static void uip_tcp_socket_read(struct uip_tcp_socket *sk) {
+    s32 window;
+    ssize_t len;
+
+    window = uip_tcp_guest_window(sk);
+    if (window <= 0)
+        return;
+
+    /*
+     * Up to a full 64KiB GSO frame when the guest takes them
+     */
+    sk->payload = sk->info->tcp_buf;
+    len = read(sk->fd, sk->payload, min_t(s32, window, sk->info->guest_tso ? UIP_MAX_TCP_PAYLOAD : sk->mss));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (len > 0) {
+        uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, len);
+        return;
     }
 
-out:
     /*
      * Close server to guest TCP connection
      */
-    uip_tcp_socket_close(sk, SHUT_RD);
+    shutdown(sk->fd, SHUT_RD);
 
     uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
     sk->seq_server += 1;
 
     sk->read_done = 1;
+    uip_tcp_socket_try_close(sk);
+}
 
-    pthread_exit(NULL);
+/* Caller holds the sk lock */
+static void uip_tcp_socket_event(struct uip_tcp_socket *sk, u32 events) {
+    switch (sk->state) {
+    case UIP_TCP_CLOSED:
+        return;
+    case UIP_TCP_CONNECTING:
+        uip_tcp_socket_connected(sk);
+        break;
+    case UIP_TCP_ESTABLISHED:
+        if ((events & (EPOLLOUT | EPOLLERR)) && uip_tcp_socket_flush(sk) < 0) {
+            uip_tcp_socket_reset(sk);
+            return;
+        }
 
-    return NULL;
+        if (!sk->read_done && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            uip_tcp_socket_read(sk);
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            /*
+             * Nothing left to read and the remote end can't take data either
+             */
+            uip_tcp_socket_reset(sk);
+            return;
+        }
+
+        uip_tcp_socket_try_close(sk);
+        break;
+    }
+
+    uip_tcp_socket_update(sk);
 }
 
-static int uip_tcp_socket_receive(struct uip_tcp_socket *sk) {
-    int ret;
+static void uip_tcp_socket_unlock(void *p) {
+    mutex_unlock(p);
+}
 
-    if (sk->thread == 0) {
-        sk->buf = malloc(UIP_MAX_TCP_PAYLOAD);
-        if (!sk->buf)
-            return -ENOMEM;
-        ret = pthread_create(&sk->thread, NULL, uip_tcp_socket_thread, (void *)sk);
-        if (ret)
-            free(sk->buf);
-        return ret;
+static void *uip_tcp_socket_thread(void *p) {
+    struct epoll_event events[UIP_TCP_MAX_EVENTS];
+    struct uip_tcp_socket *sk;
+    struct uip_info *info;
+    int nfds;
+    int i;
+
+    kvm_set_thread_name("uip-tcp");
+
+    info = p;
+
+    while (1) {
+        /*
+         * Sockets closed since the last epoll_wait can't show up anymore
+         */
+        uip_tcp_socket_reap(info);
+
+        nfds = epoll_wait(info->tcp_epollfd, events, UIP_TCP_MAX_EVENTS, -1);
+
+        if (nfds == -1)
+            continue;
+
+        for (i = 0; i < nfds; i++) {
+            sk = events[i].data.ptr;
+
+            mutex_lock(sk->lock);
+            pthread_cleanup_push(uip_tcp_socket_unlock, sk->lock);
+            uip_tcp_socket_event(sk, events[i].events);
+            pthread_cleanup_pop(1);
+        }
     }
 
-    return 0;
+    pthread_exit(NULL);
+    return NULL;
 }
 
-static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp) {
-    int len;
-    int ret;
-    u8 *payload;
+static int uip_tcp_thread_start(struct uip_info *info) {
+    info->tcp_buf = malloc(UIP_MAX_TCP_PAYLOAD);
+    if (!info->tcp_buf)
+        return -ENOMEM;
 
-    if (sk->write_done)
-        return 0;
+    info->tcp_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (info->tcp_epollfd < 0)
+        goto err_free;
 
-    payload = uip_tcp_payload(tcp);
-    len = uip_tcp_payloadlen(tcp);
+    if (pthread_create(&info->tcp_thread, NULL, uip_tcp_socket_thread, (void *)info))
+        goto err_close;
 
-    ret = write(sk->fd, payload, len);
-    if (ret != len)
-        pr_warning("tcp send error");
+    return 0;
 
-    return ret;
+err_close:
+    info->tcp_thread = 0;
+    close(info->tcp_epollfd);
+err_free:
+    info->tcp_epollfd = 0;
+    free(info->tcp_buf);
+    info->tcp_buf = NULL;
+    return -1;
 }
 
-int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg) {
+/* Caller holds the tcp socket lock */
+static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport) {
+    struct epoll_event ev;
     struct uip_tcp_socket *sk;
+    struct uip_info *info;
     struct uip_tcp *tcp;
-    struct uip_ip *ip;
-    int ret;
 
     tcp = (struct uip_tcp *)arg->eth;
-    ip = (struct uip_ip *)arg->eth;
+    info = arg->info;
+
+    if (!info->tcp_thread && uip_tcp_thread_start(info) < 0)
+        return NULL;
+
+    sk = calloc(1, sizeof(*sk));
+    if (!sk)
+        return NULL;
+
+    sk->lock = &info->tcp_socket_lock;
+    sk->info = info;
+
+    sk->sip = sip;
+    sk->dip = dip;
+    sk->sport = sport;
+    sk->dport = dport;
+
+    sk->window_size = ntohs(tcp->win);
+    sk->mss = uip_tcp_mss(tcp);
 
     /*
-     * Guest is trying to start a TCP session, let's fake SYN-ACK to guest
+     * Setup ISN number
      */
-    if (uip_tcp_is_syn(tcp)) {
-        sk = uip_tcp_socket_alloc(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-        if (!sk)
-            return -1;
+    sk->isn_guest = uip_tcp_isn(tcp);
+    sk->isn_server = uip_tcp_isn_alloc();
 
-        sk->window_size = ntohs(tcp->win);
+    sk->seq_server = sk->isn_server;
+    sk->ack_server = sk->isn_guest + 1;
 
-        /*
-         * Setup ISN number
-         */
-        sk->isn_guest = uip_tcp_isn(tcp);
-        sk->isn_server = uip_tcp_isn_alloc();
+    sk->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sk->fd < 0)
+        goto err_free;
 
-        sk->seq_server = sk->isn_server;
-        sk->ack_server = sk->isn_guest + 1;
-        uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
-        sk->seq_server += 1;
+    sk->addr.sin_family = AF_INET;
+    sk->addr.sin_port = dport;
+    sk->addr.sin_addr.s_addr = dip;
 
-        /*
-         * Start receive thread for data from remote to guest
-         */
-        uip_tcp_socket_receive(sk);
+    if (ntohl(dip) == info->host_ip)
+        sk->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
-        goto out;
+    /*
+     * The SYN-ACK goes to the guest once the TCP thread sees the connect complete
+     */
+    if (connect(sk->fd, (struct sockaddr *)&sk->addr, sizeof(sk->addr)) < 0 && errno != EINPROGRESS) {
+        uip_tcp_payload_send(sk, UIP_TCP_FLAG_RST | UIP_TCP_FLAG_ACK, 0);
+        goto err_close;
+    }
+
+    sk->state = UIP_TCP_CONNECTING;
+    sk->events = ev.events = EPOLLOUT;
+    ev.data.ptr = sk;
+    if (epoll_ctl(info->tcp_epollfd, EPOLL_CTL_ADD, sk->fd, &ev) < 0) {
+        pr_warning("epoll_ctl error");
+        goto err_close;
     }
 
+    list_add_tail(&sk->list, &info->tcp_socket_head);
+    hlist_add_head(&sk->node, &info->tcp_socket_hash[uip_socket_hash(sip, dip, sport, dport)]);
+
+    return sk;
+
+err_close:
+    close(sk->fd);
+err_free:
+    free(sk);
+    return NULL;
+}
+
+/*
+ * Hand guest data to the host socket, buffering what it doesn't take right
+ * away up to UIP_TCP_SNDBUF_SIZE. Returns the number of bytes accepted.
+ * Caller holds the sk lock.
+ */
+static int uip_tcp_socket_send(struct uip_tcp_socket *sk, u8 *payload, int len) {
+    ssize_t ret = 0;
+    u32 copy;
+
     /*
-     * Find socket we have allocated
+     * Keep the byte stream in order behind anything already buffered
      */
-    sk = uip_tcp_socket_find(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-    if (!sk)
-        return -1;
+    if (!sk->snd_len) {
+        ret = write(sk->fd, payload, len);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -errno;
+            ret = 0;
+        }
+    }
 
-    mutex_lock(sk->lock);
-    sk->window_size = ntohs(tcp->win);
-    sk->guest_acked = ntohl(tcp->ack);
-    pthread_cond_signal(&sk->cond);
-    mutex_unlock(sk->lock);
+    copy = min_t(u32, len - ret, UIP_TCP_SNDBUF_SIZE - sk->snd_len);
+    if (!copy)
+        return ret;
 
-    if (uip_tcp_is_fin(tcp)) {
-        if (sk->write_done)
-            goto out;
+    if (!sk->sndbuf) {
+        sk->sndbuf = malloc(UIP_TCP_SNDBUF_SIZE);
+        if (!sk->sndbuf)
+            return ret;
+    }
 
-        sk->write_done = 1;
-        sk->ack_server += 1;
-        uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+    memcpy(sk->sndbuf + sk->snd_len, payload + ret, copy);
+    sk->snd_len += copy;
 
-        /*
-         * Close guest to server TCP connection
-         */
-        uip_tcp_socket_close(sk, SHUT_WR);
+    return ret + copy;
+}
+
+int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg) {
+    struct uip_tcp_socket *sk;
+    struct uip_info *info;
+    struct uip_tcp *tcp;
+    struct uip_ip *ip;
+    int len, off, ret = 0;
+    u8 *payload;
+
+    tcp = (struct uip_tcp *)arg->eth;
+    ip = (struct uip_ip *)arg->eth;
+    info = arg->info;
+
+    mutex_lock(&info->tcp_socket_lock);
+
+    sk = uip_tcp_socket_find(info, ip->sip, ip->dip, tcp->sport, tcp->dport);
 
+    /*
+     * Guest is trying to start a TCP session, connect to the remote host and
+     * fake the SYN-ACK once that completes. Retransmitted SYNs are ignored.
+     */
+    if (uip_tcp_is_syn(tcp)) {
+        if (!sk && !uip_tcp_socket_alloc(arg, ip->sip, ip->dip, tcp->sport, tcp->dport))
+            ret = -1;
+        goto out;
+    }
+
+    if (!sk) {
+        ret = -1;
+        goto out;
+    }
+
+    if (uip_tcp_is_rst(tcp)) {
+        uip_tcp_socket_abort(sk);
         goto out;
     }
 
+    if (sk->state != UIP_TCP_ESTABLISHED)
+        goto out;
+
+    sk->window_size = ntohs(tcp->win);
+    if (uip_tcp_is_ack(tcp))
+        sk->guest_acked = ntohl(tcp->ack);
+
+    payload = uip_tcp_payload(tcp);
+    len = uip_tcp_payloadlen(tcp);
+
     /*
      * Ignore guest to server frames with zero tcp payload
      */
-    if (uip_tcp_payloadlen(tcp) == 0)
-        goto out;
+    if (!len && !uip_tcp_is_fin(tcp))
+        goto update;
 
     /*
-     * Sent out TCP data to remote host
+     * Skip what we already acknowledged. A segment past it means one got
+     * lost, and an old one was a retransmit, duplicate ACK either way.
      */
-    ret = uip_tcp_socket_send(sk, tcp);
-    if (ret < 0)
-        return -1;
+    off = (s32)(sk->ack_server - ntohl(tcp->seq));
+    if (off < 0 || off > len) {
+        uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+        goto update;
+    }
+
+    payload += off;
+    len -= off;
+
+    if (len) {
+        ret = uip_tcp_socket_send(sk, payload, len);
+        if (ret < 0) {
+            uip_tcp_socket_reset(sk);
+            ret = 0;
+            goto out;
+        }
+        sk->ack_server += ret;
+    }
+
+    /*
+     * Close guest to server TCP connection, after any data still buffered
+     */
+    if (uip_tcp_is_fin(tcp) && ret == len) {
+        sk->write_done = 1;
+        sk->ack_server += 1;
+        if (!sk->snd_len)
+            shutdown(sk->fd, SHUT_WR);
+    }
+    ret = 0;
+
     /*
      * Send ACK to guest imediately
      */
-    sk->ack_server += ret;
     uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
 
+    uip_tcp_socket_try_close(sk);
+
+update:
+    uip_tcp_socket_update(sk);
 out:
-    return 0;
+    mutex_unlock(&info->tcp_socket_lock);
+    return ret;
 }
 
 void uip_tcp_exit(struct uip_info *info) {
     struct uip_tcp_socket *sk, *next;
 
+    if (info->tcp_thread) {
+        pthread_cancel(info->tcp_thread);
+        pthread_join(info->tcp_thread, NULL);
+        info->tcp_thread = 0;
+    }
+
     mutex_lock(&info->tcp_socket_lock);
-    list_for_each_entry_safe(sk, next, &info->tcp_socket_head, list) uip_tcp_socket_free(sk);
+    list_for_each_entry_safe(sk, next, &info->tcp_socket_head, list) uip_tcp_socket_close(sk);
     mutex_unlock(&info->tcp_socket_lock);
+
+    uip_tcp_socket_reap(info);
+
+    if (info->tcp_epollfd > 0) {
+        close(info->tcp_epollfd);
+        info->tcp_epollfd = 0;
+    }
+
+    free(info->tcp_buf);
+    info->tcp_buf = NULL;
 }
@@ -11,6 +11,7 @@
 #define UIP_UDP_MAX_EVENTS 1000
 
 static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport) {
+    struct hlist_head *sk_hash;
     struct list_head *sk_head;
     struct uip_udp_socket *sk;
     struct mutex *sk_lock;
@@ -19,13 +20,14 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
     int ret;
 
     sk_head = &arg->info->udp_socket_head;
+    sk_hash = &arg->info->udp_socket_hash[uip_socket_hash(sip, dip, sport, dport)];
     sk_lock = &arg->info->udp_socket_lock;
 
     /*
      * Find existing sk
      */
     mutex_lock(sk_lock);
-    list_for_each_entry(sk, sk_head, list) {
+    hlist_for_each_entry(sk, sk_hash, node) {
         if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
             mutex_unlock(sk_lock);
             return sk;
@@ -75,6 +77,7 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 
     mutex_lock(sk_lock);
     list_add_tail(&sk->list, sk_head);
+    hlist_add_head(&sk->node, sk_hash);
     mutex_unlock(sk_lock);
 
     return sk;
@@ -84,16 +87,83 @@ out:
     return NULL;
 }
 
-static int uip_udp_socket_send(struct uip_udp_socket *sk, struct uip_udp *udp) {
-    int len;
+/* Caller holds the udp socket lock */
+static void uip_udp_tx_flush_locked(struct uip_info *info) {
+    struct uip_udp_tx *tx;
+    u32 i, run, sent;
     int ret;
 
-    len = ntohs(udp->len) - uip_udp_hdrlen(udp);
+    tx = &info->udp_tx;
+
+    for (i = 0; i < tx->nr; i += run) {
+        for (run = 1; i + run < tx->nr && tx->sks[i + run] == tx->sks[i]; run++)
+            ;
+
+        /*
+         * sendmmsg() stops at the first datagram the socket doesn't take.
+         * That one is dropped, as a full socket buffer would with
+         * sendto(), and the rest of the run still goes out.
+         */
+        for (sent = 0; sent < run; sent += ret) {
+            ret = sendmmsg(tx->sks[i]->fd, &tx->msgs[i + sent], run - sent, 0);
+            if (ret <= 0)
+                ret = 1;
+        }
+    }
 
-    ret = sendto(sk->fd, udp->payload, len, 0, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
-    if (ret != len)
+    tx->nr = 0;
+    tx->len = 0;
+}
+
+void uip_udp_tx_flush(struct uip_info *info) {
+    mutex_lock(&info->udp_socket_lock);
+    uip_udp_tx_flush_locked(info);
+    mutex_unlock(&info->udp_socket_lock);
+}
+
+/*
+ * Queue a guest datagram for the next sendmmsg, sent once the batch is full
+ * or the guest has no more frames for now
+ */
+static int uip_udp_socket_send(struct uip_info *info, struct uip_udp_socket *sk, struct uip_udp *udp) {
+    struct uip_udp_tx *tx;
+    int len;
+    u32 i;
+
+    len = ntohs(udp->len) - uip_udp_hdrlen(udp);
+    if (len < 0)
         return -1;
 
+    tx = &info->udp_tx;
+
+    mutex_lock(&info->udp_socket_lock);
+
+    if (!tx->buf) {
+        tx->buf = malloc(UIP_UDP_TX_BUF_SIZE);
+        if (!tx->buf) {
+            mutex_unlock(&info->udp_socket_lock);
+            return -1;
+        }
+    }
+
+    if (tx->nr == UIP_UDP_BATCH || tx->len + len > UIP_UDP_TX_BUF_SIZE)
+        uip_udp_tx_flush_locked(info);
+
+    i = tx->nr++;
+    memcpy(tx->buf + tx->len, udp->payload, len);
+    tx->iovs[i].iov_base = tx->buf + tx->len;
+    tx->iovs[i].iov_len = len;
+    tx->msgs[i].msg_hdr = (struct msghdr){
+        .msg_name = &sk->addr,
+        .msg_namelen = sizeof(sk->addr),
+        .msg_iov = &tx->iovs[i],
+        .msg_iovlen = 1,
+    };
+    tx->sks[i] = sk;
+    tx->len += len;
+
+    mutex_unlock(&info->udp_socket_lock);
+
     return 0;
 }
 
@@ -135,7 +205,6 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 
     ip2->len = udp2->len + htons(uip_ip_hdrlen(ip2));
     ip2->csum = uip_csum_ip(ip2);
-    udp2->csum = uip_csum_udp(udp2);
 
     /*
      * virtio_net_hdr
@@ -143,25 +212,59 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
     buf->vnet_len = info->vnet_hdr_len;
     memset(buf->vnet, 0, buf->vnet_len);
 
+    uip_csum_guest(info, buf);
+
     buf->eth_len = ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
     return 0;
 }
 
+/*
+ * Receive a batch of datagrams straight into free buffers for the guest, as
+ * many as there are buffers for
+ */
+static void uip_udp_socket_recv(struct uip_info *info, struct uip_udp_socket *sk) {
+    struct uip_buf *bufs[UIP_UDP_BATCH];
+    struct mmsghdr msgs[UIP_UDP_BATCH];
+    struct iovec iovs[UIP_UDP_BATCH];
+    struct uip_udp *udp;
+    int nr, ret, i;
+
+    nr = uip_buf_get_free_batch(info, bufs, UIP_UDP_BATCH);
+
+    for (i = 0; i < nr; i++) {
+        udp = (struct uip_udp *)bufs[i]->eth;
+        iovs[i].iov_base = udp->payload;
+        iovs[i].iov_len = UIP_MAX_UDP_PAYLOAD;
+        msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+
+    ret = recvmmsg(sk->fd, msgs, nr, MSG_DONTWAIT, NULL);
+
+    for (i = 0; i < nr; i++) {
+        if (i >= ret) {
+            uip_buf_set_free(info, bufs[i]);
+            continue;
+        }
+
+        uip_udp_make_pkg(info, sk, bufs[i], NULL, msgs[i].msg_len);
+
+        /*
+         * Send data received from socket to guest
+         */
+        uip_buf_set_used(info, bufs[i]);
+    }
+}
+
 static void *uip_udp_socket_thread(void *p) {
     struct epoll_event events[UIP_UDP_MAX_EVENTS];
-    struct uip_udp_socket *sk;
     struct uip_info *info;
-    struct uip_buf *buf;
-    int payload_len;
-    u8 *payload;
     int nfds;
     int i;
 
     kvm_set_thread_name("uip-udp");
 
     info = p;
-    payload = info->udp_buf;
 
     while (1) {
         nfds = epoll_wait(info->udp_epollfd, events, UIP_UDP_MAX_EVENTS, -1);
@@ -169,31 +272,9 @@ static void *uip_udp_socket_thread(void *p) {
         if (nfds == -1)
             continue;
 
-        for (i = 0; i < nfds; i++) {
-            sk = events[i].data.ptr;
-            payload_len = recvfrom(sk->fd, payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
-            if (payload_len < 0)
-                continue;
-
-            /*
-             * Get free buffer to send data to guest
-             */
-            buf = uip_buf_get_free(info);
-
-            uip_udp_make_pkg(info, sk, buf, payload, payload_len);
-
-            /*
-             * Send data received from socket to guest
-             */
-            uip_buf_set_used(info, buf);
-        }
+        for (i = 0; i < nfds; i++) uip_udp_socket_recv(info, events[i].data.ptr);
     }
 
-    mutex_lock(&info->udp_socket_lock);
-    free(info->udp_buf);
-    info->udp_buf = NULL;
-    mutex_unlock(&info->udp_socket_lock);
-
     pthread_exit(NULL);
     return NULL;
 }
@@ -224,17 +305,12 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg) {
     /*
      * Send out UDP data to remote host
      */
-    ret = uip_udp_socket_send(sk, udp);
+    ret = uip_udp_socket_send(info, sk, udp);
     if (ret)
         return -1;
 
-    if (!info->udp_thread) {
-        info->udp_buf = malloc(UIP_MAX_UDP_PAYLOAD);
-        if (!info->udp_buf)
-            return -1;
-
+    if (!info->udp_thread)
         pthread_create(&info->udp_thread, NULL, uip_udp_socket_thread, (void *)info);
-    }
 
     return 0;
 }
@@ -247,13 +323,16 @@ void uip_udp_exit(struct uip_info *info) {
         pthread_cancel(info->udp_thread);
         pthread_join(info->udp_thread, NULL);
         info->udp_thread = 0;
-        free(info->udp_buf);
     }
     if (info->udp_epollfd > 0) {
         close(info->udp_epollfd);
         info->udp_epollfd = 0;
     }
 
+    uip_udp_tx_flush_locked(info);
+    free(info->udp_tx.buf);
+    info->udp_tx.buf = NULL;
+
     list_for_each_entry_safe(sk, next, &info->udp_socket_head, list) {
         close(sk->fd);
         free(sk);
@@ -0,0 +1,555 @@
+/*
+ * Minimal vhost-user backend standing in for a real switch or storage daemon
+ * when testing kemu's vhost-user frontend:
+ *
+ *   net: frames transmitted by the guest are looped back to its RX queue
+ *   blk: RAM disk of the given size
+ *
+ * It serves a single frontend connection from a single thread.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvm/vhost-user.h"
+
+#define NUM_QUEUES    2
+#define MAX_IOV       128
+#define SECTOR_SIZE   512
+#define BLK_SEG_MAX   (MAX_IOV - 2)
+
+struct mem_region {
+    u64 guest_phys_addr;
+    u64 memory_size;
+    u64 userspace_addr;
+    void *mmap_addr;
+    u64 mmap_size;
+};
+
+struct vq {
+    u32 num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    u16 last_avail_idx;
+    int kick_fd;
+    int call_fd;
+    bool enabled;
+};
+
+static enum { DEV_NET, DEV_BLK } dev_type;
+static u64 features;
+static u64 protocol_features;
+static struct mem_region regions[VHOST_USER_MAX_MEM_REGIONS];
+static u32 nr_regions;
+static struct vq vqs[NUM_QUEUES];
+static u8 *disk;
+static u64 disk_size;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static void *gpa_to_va(u64 addr, u64 len) {
+    u32 i;
+
+    for (i = 0; i < nr_regions; i++) {
+        struct mem_region *r = &regions[i];
+
+        if (addr >= r->guest_phys_addr && addr + len <= r->guest_phys_addr + r->memory_size)
+            return r->mmap_addr + (addr - r->guest_phys_addr);
+    }
+    return NULL;
+}
+
+static void *uva_to_va(u64 addr) {
+    u32 i;
+
+    for (i = 0; i < nr_regions; i++) {
+        struct mem_region *r = &regions[i];
+
+        if (addr >= r->userspace_addr && addr < r->userspace_addr + r->memory_size)
+            return r->mmap_addr + (addr - r->userspace_addr);
+    }
+    return NULL;
+}
+
+static void unmap_regions(void) {
+    while (nr_regions) {
+        nr_regions--;
+        munmap(regions[nr_regions].mmap_addr, regions[nr_regions].mmap_size);
+    }
+}
+
+static bool vq_ready(struct vq *vq) {
+    return vq->enabled && vq->avail && vq->kick_fd > 0;
+}
+
+static bool vq_has_avail(struct vq *vq) {
+    return vq->last_avail_idx != le16toh(vq->avail->idx);
+}
+
+/* Pop the next chain, returns its head or -1 */
+static int vq_pop(struct vq *vq, struct iovec *iov, int *out, int *in) {
+    u16 head, idx, flags;
+    struct vring_desc *desc;
+    u32 n = 0;
+
+    if (!vq_has_avail(vq))
+        return -1;
+    __sync_synchronize();
+
+    head = le16toh(vq->avail->ring[vq->last_avail_idx++ % vq->num]);
+    *out = *in = 0;
+
+    for (idx = head;; idx = le16toh(desc->next)) {
+        if (idx >= vq->num || n == MAX_IOV)
+            return -1;
+
+        desc = &vq->desc[idx];
+        flags = le16toh(desc->flags);
+        iov[n].iov_len = le32toh(desc->len);
+        iov[n].iov_base = gpa_to_va(le64toh(desc->addr), iov[n].iov_len);
+        if (!iov[n].iov_base)
+            return -1;
+
+        if (flags & VRING_DESC_F_WRITE)
+            (*in)++;
+        else
+            (*out)++;
+        n++;
+
+        if (!(flags & VRING_DESC_F_NEXT))
+            break;
+    }
+
+    return head;
+}
+
+static void vq_push(struct vq *vq, u16 head, u32 len) {
+    u16 idx = le16toh(vq->used->idx);
+
+    vq->used->ring[idx % vq->num].id = htole32(head);
+    vq->used->ring[idx % vq->num].len = htole32(len);
+    __sync_synchronize();
+    vq->used->idx = htole16(idx + 1);
+}
+
+static void vq_notify(struct vq *vq) {
+    __sync_synchronize();
+    if (vq->call_fd > 0 && !(le16toh(vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT))
+        eventfd_write(vq->call_fd, 1);
+}
+
+static size_t iov_copy(struct iovec *dst, int nr_dst, struct iovec *src, int nr_src) {
+    size_t dst_off = 0, src_off = 0, copied = 0, len;
+
+    while (nr_dst && nr_src) {
+        len = dst->iov_len - dst_off;
+        if (len > src->iov_len - src_off)
+            len = src->iov_len - src_off;
+
+        memcpy(dst->iov_base + dst_off, src->iov_base + src_off, len);
+        copied += len;
+        dst_off += len;
+        src_off += len;
+
+        if (dst_off == dst->iov_len) {
+            dst++, nr_dst--;
+            dst_off = 0;
+        }
+        if (src_off == src->iov_len) {
+            src++, nr_src--;
+            src_off = 0;
+        }
+    }
+
+    return copied;
+}
+
+static void net_loopback(void) {
+    struct iovec tx_iov[MAX_IOV], rx_iov[MAX_IOV];
+    struct vq *rx = &vqs[0], *tx = &vqs[1];
+    int tx_head, rx_head, out, in, unused;
+    bool mrg_hdr = features & (1ULL << VIRTIO_F_VERSION_1 | 1ULL << VIRTIO_NET_F_MRG_RXBUF);
+    struct virtio_net_hdr_mrg_rxbuf *hdr;
+    size_t len;
+    bool done = false;
+
+    if (!vq_ready(rx) || !vq_ready(tx))
+        return;
+
+    /* Leave frames queued on TX until the guest posts RX buffers */
+    while (vq_has_avail(rx) && vq_has_avail(tx)) {
+        tx_head = vq_pop(tx, tx_iov, &out, &unused);
+        rx_head = vq_pop(rx, rx_iov, &unused, &in);
+        if (tx_head < 0 || rx_head < 0) {
+            fprintf(stderr, "invalid descriptor chain\n");
+            exit(1);
+        }
+
+        len = iov_copy(rx_iov, in, tx_iov, out);
+        if (mrg_hdr && rx_iov[0].iov_len >= sizeof(*hdr)) {
+            hdr = rx_iov[0].iov_base;
+            hdr->num_buffers = htole16(1);
+        }
+
+        vq_push(tx, tx_head, 0);
+        vq_push(rx, rx_head, len);
+        done = true;
+    }
+
+    if (done) {
+        vq_notify(tx);
+        vq_notify(rx);
+    }
+}
+
+static u8 blk_request(struct iovec *iov, int out, int in, u32 *len) {
+    struct virtio_blk_outhdr hdr;
+    struct iovec hdr_iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+    struct iovec *data = iov + 1;
+    u64 offset, size = 0;
+    int i, nr_data;
+
+    *len = 0;
+    if (iov_copy(&hdr_iov, 1, iov, out) != sizeof(hdr) || iov[0].iov_len != sizeof(hdr) || !in ||
+        iov[out + in - 1].iov_len != 1)
+        return VIRTIO_BLK_S_IOERR;
+
+    /* Data is everything between the header and the status byte */
+    nr_data = out + in - 2;
+    for (i = 0; i < nr_data; i++) size += data[i].iov_len;
+    offset = le64toh(hdr.sector) * SECTOR_SIZE;
+
+    switch (le32toh(hdr.type)) {
+        case VIRTIO_BLK_T_IN:
+            if (offset + size > disk_size)
+                return VIRTIO_BLK_S_IOERR;
+            for (i = 0; i < nr_data; offset += data[i++].iov_len)
+                memcpy(data[i].iov_base, disk + offset, data[i].iov_len);
+            *len = size;
+            return VIRTIO_BLK_S_OK;
+        case VIRTIO_BLK_T_OUT:
+            if (offset + size > disk_size)
+                return VIRTIO_BLK_S_IOERR;
+            for (i = 0; i < nr_data; offset += data[i++].iov_len)
+                memcpy(disk + offset, data[i].iov_base, data[i].iov_len);
+            return VIRTIO_BLK_S_OK;
+        case VIRTIO_BLK_T_FLUSH:
+            return VIRTIO_BLK_S_OK;
+        case VIRTIO_BLK_T_GET_ID:
+            if (nr_data)
+                *len = snprintf(data[0].iov_base, data[0].iov_len, "loopback");
+            return VIRTIO_BLK_S_OK;
+        default:
+            return VIRTIO_BLK_S_UNSUPP;
+    }
+}
+
+static void blk_process(void) {
+    struct iovec iov[MAX_IOV];
+    struct vq *vq = &vqs[0];
+    int head, out, in;
+    bool done = false;
+    u8 *status;
+    u32 len;
+
+    if (!vq_ready(vq))
+        return;
+
+    while ((head = vq_pop(vq, iov, &out, &in)) >= 0) {
+        status = iov[out + in - 1].iov_base;
+        *status = blk_request(iov, out, in, &len);
+        vq_push(vq, head, len + 1);
+        done = true;
+    }
+
+    if (done)
+        vq_notify(vq);
+}
+
+static void process_queues(void) {
+    if (dev_type == DEV_NET)
+        net_loopback();
+    else
+        blk_process();
+}
+
+static ssize_t recv_msg(int sock, struct vhost_user_msg *msg, int *fds, int *nr_fds) {
+    char control[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = &msg->hdr, .iov_len = sizeof(msg->hdr)};
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    *nr_fds = 0;
+    r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (r != sizeof(msg->hdr))
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nr_fds * sizeof(int));
+        }
+    }
+
+    if (msg->hdr.size > sizeof(msg->payload))
+        return -1;
+    if (msg->hdr.size && recv(sock, &msg->payload, msg->hdr.size, MSG_WAITALL) != msg->hdr.size)
+        return -1;
+
+    return r + msg->hdr.size;
+}
+
+static void send_reply(int sock, struct vhost_user_msg *msg, u32 size) {
+    msg->hdr.flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    msg->hdr.size = size;
+    if (send(sock, msg, sizeof(msg->hdr) + size, MSG_NOSIGNAL) < 0)
+        die("send");
+}
+
+static void reply_u64(int sock, struct vhost_user_msg *msg, u64 val) {
+    msg->payload.u64 = val;
+    send_reply(sock, msg, sizeof(msg->payload.u64));
+}
+
+static int set_mem_table(struct vhost_user_msg *msg, int *fds, int nr_fds) {
+    struct vhost_user_mem_region region;
+    u32 i;
+
+    if (msg->payload.mem.nregions > VHOST_USER_MAX_MEM_REGIONS || msg->payload.mem.nregions != (u32)nr_fds)
+        return -1;
+
+    unmap_regions();
+    for (i = 0; i < msg->payload.mem.nregions; i++) {
+        region = msg->payload.mem.regions[i];
+        regions[i] = (struct mem_region){
+            .guest_phys_addr = region.guest_phys_addr,
+            .memory_size = region.memory_size,
+            .userspace_addr = region.userspace_addr,
+            .mmap_size = region.memory_size + region.mmap_offset,
+        };
+
+        /* Map from the start of the file, mmap_offset need not be page aligned */
+        regions[i].mmap_addr = mmap(NULL, regions[i].mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        close(fds[i]);
+        if (regions[i].mmap_addr == MAP_FAILED)
+            return -1;
+        regions[i].mmap_addr += region.mmap_offset;
+        regions[i].mmap_size = region.memory_size;
+        nr_regions++;
+    }
+
+    return 0;
+}
+
+static void vq_reset(struct vq *vq) {
+    if (vq->kick_fd > 0)
+        close(vq->kick_fd);
+    if (vq->call_fd > 0)
+        close(vq->call_fd);
+    memset(vq, 0, sizeof(*vq));
+}
+
+/* Returns < 0 on a malformed request, 1 when a reply has been sent */
+static int handle_msg(int sock, struct vhost_user_msg *msg, int *fds, int nr_fds) {
+    u32 index = msg->payload.state.index;
+    struct virtio_blk_config blk_config;
+    u32 offset, size;
+    struct vq *vq;
+
+    switch (msg->hdr.request) {
+        case VHOST_USER_GET_FEATURES:
+            reply_u64(sock, msg, features);
+            return 1;
+        case VHOST_USER_SET_FEATURES:
+            features &= msg->payload.u64;
+            return 0;
+        case VHOST_USER_GET_PROTOCOL_FEATURES:
+            reply_u64(sock, msg, protocol_features);
+            return 1;
+        case VHOST_USER_SET_PROTOCOL_FEATURES:
+            protocol_features &= msg->payload.u64;
+            return 0;
+        case VHOST_USER_GET_QUEUE_NUM:
+            reply_u64(sock, msg, 1);
+            return 1;
+        case VHOST_USER_SET_OWNER:
+        case VHOST_USER_RESET_OWNER:
+            return 0;
+        case VHOST_USER_SET_MEM_TABLE:
+            return set_mem_table(msg, fds, nr_fds);
+        case VHOST_USER_GET_CONFIG:
+            offset = msg->payload.config.offset;
+            size = msg->payload.config.size;
+            if (dev_type != DEV_BLK || offset + size > sizeof(blk_config))
+                return -1;
+            blk_config = (struct virtio_blk_config){
+                .capacity = htole64(disk_size / SECTOR_SIZE),
+                .seg_max = htole32(BLK_SEG_MAX),
+            };
+            memcpy(msg->payload.config.region, (u8 *)&blk_config + offset, size);
+            send_reply(sock, msg, offsetof(struct vhost_user_config, region) + size);
+            return 1;
+    }
+
+    /* Per-vring requests */
+    if (msg->hdr.request == VHOST_USER_SET_VRING_KICK || msg->hdr.request == VHOST_USER_SET_VRING_CALL)
+        index = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+    if (index >= NUM_QUEUES)
+        return -1;
+    vq = &vqs[index];
+
+    switch (msg->hdr.request) {
+        case VHOST_USER_SET_VRING_NUM:
+            vq->num = msg->payload.state.num;
+            return 0;
+        case VHOST_USER_SET_VRING_BASE:
+            vq->last_avail_idx = msg->payload.state.num;
+            return 0;
+        case VHOST_USER_GET_VRING_BASE:
+            msg->payload.state.num = vq->last_avail_idx;
+            vq_reset(vq);
+            send_reply(sock, msg, sizeof(msg->payload.state));
+            return 1;
+        case VHOST_USER_SET_VRING_ADDR:
+            vq->desc = uva_to_va(msg->payload.addr.desc_user_addr);
+            vq->avail = uva_to_va(msg->payload.addr.avail_user_addr);
+            vq->used = uva_to_va(msg->payload.addr.used_user_addr);
+            return vq->desc && vq->avail && vq->used ? 0 : -1;
+        case VHOST_USER_SET_VRING_KICK:
+        case VHOST_USER_SET_VRING_CALL:
+            if (nr_fds != 1)
+                return -1;
+            if (msg->hdr.request == VHOST_USER_SET_VRING_KICK) {
+                if (vq->kick_fd > 0)
+                    close(vq->kick_fd);
+                vq->kick_fd = fds[0];
+                /* Without protocol features, rings start on kick */
+                if (!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+                    vq->enabled = true;
+            } else {
+                if (vq->call_fd > 0)
+                    close(vq->call_fd);
+                vq->call_fd = fds[0];
+            }
+            return 0;
+        case VHOST_USER_SET_VRING_ENABLE:
+            vq->enabled = msg->payload.state.num;
+            return 0;
+        default:
+            fprintf(stderr, "unsupported request %u\n", msg->hdr.request);
+            return -1;
+    }
+}
+
+static void serve(int sock) {
+    struct pollfd pfds[1 + NUM_QUEUES];
+    struct vhost_user_msg msg;
+    int fds[VHOST_USER_MAX_FDS];
+    int i, r, nr_fds;
+    eventfd_t val;
+
+    for (;;) {
+        pfds[0] = (struct pollfd){.fd = sock, .events = POLLIN};
+        for (i = 0; i < NUM_QUEUES; i++)
+            pfds[1 + i] = (struct pollfd){.fd = vqs[i].kick_fd > 0 ? vqs[i].kick_fd : -1, .events = POLLIN};
+
+        if (poll(pfds, 1 + NUM_QUEUES, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+
+        for (i = 0; i < NUM_QUEUES; i++) {
+            if (pfds[1 + i].revents & POLLIN)
+                eventfd_read(vqs[i].kick_fd, &val);
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            if (recv_msg(sock, &msg, fds, &nr_fds) < 0)
+                return;
+
+            r = handle_msg(sock, &msg, fds, nr_fds);
+            if (r < 0)
+                fprintf(stderr, "request %u failed\n", msg.hdr.request);
+            if (r <= 0 && (msg.hdr.flags & VHOST_USER_NEED_REPLY_MASK))
+                reply_u64(sock, &msg, r < 0);
+        }
+
+        process_queues();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int listen_fd, sock, i;
+
+    if (argc < 3 || (strcmp(argv[1], "net") && strcmp(argv[1], "blk"))) {
+        fprintf(stderr, "usage: %s <net|blk> <socket> [disk size in MiB]\n", argv[0]);
+        return 1;
+    }
+
+    features = 1ULL << VIRTIO_F_VERSION_1 | 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+    protocol_features = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK;
+
+    if (!strcmp(argv[1], "net")) {
+        dev_type = DEV_NET;
+        features |= 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+    } else {
+        dev_type = DEV_BLK;
+        features |= 1ULL << VIRTIO_BLK_F_SEG_MAX | 1ULL << VIRTIO_BLK_F_FLUSH;
+        protocol_features |= 1ULL << VHOST_USER_PROTOCOL_F_CONFIG;
+
+        disk_size = (argc > 3 ? strtoull(argv[3], NULL, 0) : 64) << 20;
+        disk = calloc(1, disk_size);
+        if (!disk)
+            die("calloc");
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        die("socket");
+
+    strncpy(addr.sun_path, argv[2], sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+        die("bind");
+
+    printf("vhost-user %s loopback listening on %s\n", argv[1], addr.sun_path);
+    sock = accept(listen_fd, NULL, NULL);
+    if (sock < 0)
+        die("accept");
+
+    serve(sock);
+
+    for (i = 0; i < NUM_QUEUES; i++) vq_reset(&vqs[i]);
+    unmap_regions();
+    close(sock);
+    close(listen_fd);
+    unlink(addr.sun_path);
+
+    return 0;
+}
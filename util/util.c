@@ -5,7 +5,10 @@
 #include "kvm/util.h"
 
 #include <kvm/kvm.h>
+#include <linux/kernel.h>
 #include <linux/magic.h> /* For HUGETLBFS_MAGIC */
+#include <linux/memfd.h>
+#include <linux/sizes.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
@@ -121,22 +124,131 @@ void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size) {
     unlink(mpath);
     if (ftruncate(fd, size) < 0)
         die("Can't ftruncate for mem mapping size %lld\n", (unsigned long long)size);
-    addr = mmap(NULL, size, PROT_RW, MAP_PRIVATE, fd, 0);
-    close(fd);
+    addr = mmap(NULL, size, PROT_RW, kvm->cfg.mem_shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (kvm->cfg.mem_shared)
+        kvm->ram_fd = fd;
+    else
+        close(fd);
 
     return addr;
 }
 
+int kvm_mem_backend_from_str(const char *arg, enum kvm_mem_backend *backend) {
+    if (!strcmp(arg, "anon")) {
+        *backend = KVM_MEM_ANON;
+    } else if (!strcmp(arg, "thp")) {
+        *backend = KVM_MEM_THP;
+    } else if (!strcmp(arg, "memfd")) {
+        *backend = KVM_MEM_MEMFD;
+    } else if (!strcmp(arg, "memfd-2M")) {
+        *backend = KVM_MEM_MEMFD_2M;
+    } else if (!strcmp(arg, "memfd-1G")) {
+        *backend = KVM_MEM_MEMFD_1G;
+    } else {
+        pr_err("mem-backend: unknown backend \"%s\"", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *mmap_memfd(struct kvm *kvm, u64 size) {
+    unsigned int flags = MFD_CLOEXEC;
+    int mmap_flags = MAP_SHARED;
+    void *addr;
+    int fd;
+
+    switch (kvm->cfg.mem_backend) {
+    case KVM_MEM_MEMFD_2M:
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+        kvm->ram_pagesize = SZ_2M;
+        break;
+    case KVM_MEM_MEMFD_1G:
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+        kvm->ram_pagesize = SZ_1G;
+        break;
+    default:
+        /* Huge pages are reserved up front, small ones on first touch */
+        mmap_flags |= MAP_NORESERVE;
+        kvm->ram_pagesize = getpagesize();
+        break;
+    }
+
+    /* Huge page files only come in whole pages */
+    size = ALIGN(size, kvm->ram_pagesize);
+
+    fd = memfd_create("kemu-ram", flags);
+    if (fd < 0)
+        die_perror("memfd_create");
+    if (ftruncate(fd, size) < 0)
+        die("Can't ftruncate for mem mapping size %lld\n", (unsigned long long)size);
+
+    addr = mmap(NULL, size, PROT_RW, mmap_flags, fd, 0);
+    if (addr == MAP_FAILED && (flags & MFD_HUGETLB))
+        pr_err("Can't map %lld bytes of %lluM pages, are enough of them reserved?", (unsigned long long)size,
+               (unsigned long long)kvm->ram_pagesize / SZ_1M);
+    kvm->ram_fd = fd;
+
+    return addr;
+}
+
+/*
+ * Anonymous memory starting on a 2M boundary, so that guest huge pages
+ * can be backed by host ones.
+ */
+static void *mmap_thp(struct kvm *kvm, u64 size) {
+    void *addr, *start;
+
+    kvm->ram_pagesize = getpagesize();
+
+    addr = mmap(NULL, size + SZ_2M, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return addr;
+
+    start = (void *)ALIGN((unsigned long)addr, SZ_2M);
+    if (start != addr)
+        munmap(addr, start - addr);
+    munmap(start + size, addr + SZ_2M - start);
+
+    return start;
+}
+
 /* This function wraps the decision between hugetlbfs map (if requested) or normal mmap */
 void *mmap_anon_or_hugetlbfs(struct kvm *kvm, const char *hugetlbfs_path, u64 size) {
+    void *addr;
+
     if (hugetlbfs_path)
         /*
          * We don't /need/ to map guest RAM from hugetlbfs, but we do so
          * if the user specifies a hugetlbfs path.
          */
-        return mmap_hugetlbfs(kvm, hugetlbfs_path, size);
+        addr = mmap_hugetlbfs(kvm, hugetlbfs_path, size);
+    else if (kvm->cfg.mem_shared || kvm->cfg.mem_backend >= KVM_MEM_MEMFD)
+        /* Shared with out-of-process device backends, e.g. vhost-user */
+        addr = mmap_memfd(kvm, size);
+    else if (kvm->cfg.mem_backend == KVM_MEM_THP)
+        addr = mmap_thp(kvm, size);
     else {
         kvm->ram_pagesize = getpagesize();
-        return mmap(NULL, size, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
+        addr = mmap(NULL, size, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
     }
+
+    kvm->ram_fd_start = addr;
+    return addr;
+}
+
+/*
+ * Advise the kernel on freshly mapped guest RAM: transparent huge pages
+ * with the thp backend, and KSM only when asked for, as it merges small
+ * pages and so splits the huge pages it scans.
+ */
+void kvm_advise_ram(struct kvm *kvm, void *addr, u64 size) {
+    if (kvm->cfg.hugetlbfs_path || kvm->cfg.mem_backend >= KVM_MEM_MEMFD_2M)
+        return;
+
+    if (kvm->cfg.mem_backend == KVM_MEM_THP && madvise(addr, size, MADV_HUGEPAGE) < 0)
+        pr_warning("Transparent huge pages unavailable for guest RAM: %s", strerror(errno));
+
+    if (kvm->cfg.ksm && madvise(addr, size, MADV_MERGEABLE) < 0)
+        pr_warning("KSM unavailable for guest RAM: %s", strerror(errno));
 }
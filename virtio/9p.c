@@ -1279,7 +1279,7 @@ static void virtio_p9_do_io(struct kvm *kvm, void *param) {
 
     while (virt_queue__available(vq)) {
         virtio_p9_do_io_request(kvm, job);
-        p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
+        virtio_queue__signal(kvm, &p9dev->vdev, vq, vq - p9dev->vqs);
     }
 }
 
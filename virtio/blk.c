@@ -45,7 +45,10 @@ struct blk_dev {
     struct virtio_device vdev;
     struct virtio_blk_config blk_config;
     u64 capacity;
+    u32 seg_max;
     struct disk_image *disk;
+    /* Requests are served by this backend when there is no disk */
+    struct virtio_vhost_user vhost_user;
 
     struct virt_queue vqs[NUM_VIRT_QUEUES];
     struct blk_dev_req reqs[VIRTIO_BLK_QUEUE_SIZE];
@@ -73,8 +76,7 @@ void virtio_blk_complete(void *param, long len) {
     virt_queue__set_used_elem(req->vq, req->head, len);
     mutex_unlock(&bdev->mutex);
 
-    if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-        bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+    virtio_queue__signal(req->kvm, &bdev->vdev, &bdev->vqs[queueid], queueid);
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req) {
@@ -163,6 +165,12 @@ static size_t get_config_size(struct kvm *kvm, void *dev) {
 static u64 get_host_features(struct kvm *kvm, void *dev) {
     struct blk_dev *bdev = dev;
 
+    if (!bdev->disk)
+        return bdev->vhost_user.features &
+               (1UL << VIRTIO_BLK_F_SEG_MAX | 1UL << VIRTIO_BLK_F_FLUSH | 1UL << VIRTIO_BLK_F_RO |
+                1UL << VIRTIO_BLK_F_BLK_SIZE | 1UL << VIRTIO_RING_F_EVENT_IDX | 1UL << VIRTIO_RING_F_INDIRECT_DESC |
+                1UL << VIRTIO_F_ANY_LAYOUT | 1ULL << VIRTIO_F_IN_ORDER);
+
     return 1UL << VIRTIO_BLK_F_SEG_MAX | 1UL << VIRTIO_BLK_F_FLUSH | 1UL << VIRTIO_RING_F_EVENT_IDX |
            1UL << VIRTIO_RING_F_INDIRECT_DESC | 1UL << VIRTIO_F_ANY_LAYOUT |
            (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
@@ -172,11 +180,14 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status) {
     struct blk_dev *bdev = dev;
     struct virtio_blk_config *conf = &bdev->blk_config;
 
+    if (!bdev->disk && (status & VIRTIO__STATUS_START))
+        virtio_vhost_user_start(kvm, &bdev->vhost_user, bdev->vdev.features);
+
     if (!(status & VIRTIO__STATUS_CONFIG))
         return;
 
     conf->capacity = virtio_host_to_guest_u64(bdev->vdev.endian, bdev->capacity);
-    conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, DISK_SEG_MAX);
+    conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, bdev->seg_max);
 }
 
 static void *virtio_blk_thread(void *dev) {
@@ -205,6 +216,11 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
 
     virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq], VIRTIO_BLK_QUEUE_SIZE);
 
+    if (!bdev->disk) {
+        virtio_vhost_user_set_vring(kvm, &bdev->vhost_user, vq, &bdev->vqs[vq]);
+        return 0;
+    }
+
     if (vq != 0)
         return 0;
 
@@ -229,6 +245,11 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq) {
     struct blk_dev *bdev = dev;
 
+    if (!bdev->disk) {
+        virtio_vhost_user_reset_vring(kvm, &bdev->vhost_user, vq);
+        return;
+    }
+
     if (vq != 0)
         return;
 
@@ -251,6 +272,24 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq) {
     return 0;
 }
 
+static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi) {
+    struct blk_dev *bdev = dev;
+
+    if (bdev->disk)
+        return;
+
+    virtio_vhost_set_vring_irqfd(kvm, gsi, &bdev->vqs[vq]);
+}
+
+static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd) {
+    struct blk_dev *bdev = dev;
+
+    if (bdev->disk)
+        return;
+
+    virtio_vhost_user_set_vring_kick(&bdev->vhost_user, vq, efd);
+}
+
 static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq) {
     struct blk_dev *bdev = dev;
 
@@ -280,16 +319,34 @@ static struct virtio_ops blk_dev_virtio_ops = {
     .exit_vq = exit_vq,
     .notify_status = notify_status,
     .notify_vq = notify_vq,
+    .notify_vq_gsi = notify_vq_gsi,
+    .notify_vq_eventfd = notify_vq_eventfd,
     .get_vq = get_vq,
     .get_size_vq = get_size_vq,
     .set_size_vq = set_size_vq,
 };
 
-static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk) {
+static void virtio_blk__vhost_user_init(struct kvm *kvm, struct blk_dev *bdev, const char *path) {
+    struct virtio_blk_config config;
+
+    virtio_vhost_user_init(kvm, &bdev->vhost_user, path);
+
+    /* Geometry comes from the backend, in the little-endian VIRTIO 1 layout */
+    if (virtio_vhost_user_get_config(&bdev->vhost_user, &config, sizeof(config)) < 0)
+        die("vhost-user-blk: unable to read the device configuration");
+
+    bdev->blk_config = config;
+    bdev->capacity = le64toh(config.capacity);
+    if (bdev->vhost_user.features & (1ULL << VIRTIO_BLK_F_SEG_MAX))
+        bdev->seg_max = le32toh(config.seg_max);
+    bdev->vdev.use_vhost = true;
+}
+
+static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk, const char *vhost_user) {
     struct blk_dev *bdev;
     int r;
 
-    if (!disk)
+    if (!disk && !vhost_user)
         return -EINVAL;
 
     bdev = calloc(1, sizeof(struct blk_dev));
@@ -298,10 +355,15 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk) {
 
     *bdev = (struct blk_dev){
         .disk = disk,
-        .capacity = disk->size / SECTOR_SIZE,
+        .seg_max = DISK_SEG_MAX,
         .kvm = kvm,
     };
 
+    if (disk)
+        bdev->capacity = disk->size / SECTOR_SIZE;
+    else
+        virtio_blk__vhost_user_init(kvm, bdev, vhost_user);
+
     list_add_tail(&bdev->list, &bdevs);
 
     r = virtio_init(kvm,
@@ -315,7 +377,8 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk) {
     if (r < 0)
         return r;
 
-    disk_image__set_callback(bdev->disk, virtio_blk_complete);
+    if (disk)
+        disk_image__set_callback(bdev->disk, virtio_blk_complete);
 
     if (compat_id == -1)
         compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
@@ -326,6 +389,8 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk) {
 static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev) {
     list_del(&bdev->list);
     virtio_exit(kvm, &bdev->vdev);
+    if (!bdev->disk)
+        virtio_vhost_user_exit(&bdev->vhost_user);
     free(bdev);
 
     return 0;
@@ -337,7 +402,13 @@ int virtio_blk__init(struct kvm *kvm) {
     for (i = 0; i < kvm->nr_disks; i++) {
         if (kvm->disks[i].wwpn)
             continue;
-        r = virtio_blk__init_one(kvm, &kvm->disks[i]);
+        r = virtio_blk__init_one(kvm, &kvm->disks[i], NULL);
+        if (r < 0)
+            goto cleanup;
+    }
+
+    if (kvm->cfg.vhost_user_blk) {
+        r = virtio_blk__init_one(kvm, NULL, kvm->cfg.vhost_user_blk);
         if (r < 0)
             goto cleanup;
     }
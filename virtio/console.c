@@ -63,7 +63,7 @@ static void virtio_console__inject_interrupt_callback(struct kvm *kvm, void *par
         head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
         len = term_getc_iov(kvm, iov, in, 0);
         virt_queue__set_used_elem(vq, head, len);
-        g_cdev.vdev.ops->signal_vq(kvm, &g_cdev.vdev, vq - g_cdev.vqs);
+        virtio_queue__signal(kvm, &g_cdev.vdev, vq, vq - g_cdev.vqs);
     }
 
     mutex_unlock(&g_cdev.mutex);
@@ -97,8 +97,9 @@ static void virtio_console_handle_callback(struct kvm *kvm, void *param) {
     while (virt_queue__available(vq)) {
         head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
         len = term_putc_iov(iov, out, 0);
-        virt_queue__set_used_elem(vq, head, len);
+        virt_queue__set_used_elem_in_order(vq, head, len);
     }
+    virt_queue__flush_used_in_order(vq);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev) {
@@ -114,7 +115,7 @@ static size_t get_config_size(struct kvm *kvm, void *dev) {
 }
 
 static u64 get_host_features(struct kvm *kvm, void *dev) {
-    return 1 << VIRTIO_F_ANY_LAYOUT;
+    return 1 << VIRTIO_F_ANY_LAYOUT | 1ULL << VIRTIO_F_IN_ORDER;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status) {
@@ -1,9 +1,14 @@
+#include <limits.h>
 #include <linux/types.h>
+#include <linux/virtio_ids.h>
 #include <linux/virtio_ring.h>
 #include <stdlib.h>
+#include <sys/timerfd.h>
 #include <sys/uio.h>
+#include <time.h>
 
 #include "kvm/barrier.h"
+#include "kvm/epoll.h"
 #include "kvm/guest_compat.h"
 #include "kvm/kvm.h"
 #include "kvm/util.h"
@@ -19,25 +24,32 @@ const char *virtio_trans_name(enum virtio_trans trans) {
     return "unknown";
 }
 
+int virtio_transport_from_str(const char *arg, enum virtio_trans *type) {
+    if (!strcmp(arg, "pci")) {
+        *type = VIRTIO_PCI;
+    } else if (!strcmp(arg, "pci-legacy")) {
+        *type = VIRTIO_PCI_LEGACY;
+#if defined(CONFIG_ARM) || defined(CONFIG_ARM64) || defined(CONFIG_RISCV) || defined(CONFIG_X86)
+    } else if (!strcmp(arg, "mmio")) {
+        *type = VIRTIO_MMIO;
+    } else if (!strcmp(arg, "mmio-legacy")) {
+        *type = VIRTIO_MMIO_LEGACY;
+#endif
+    } else {
+        ERR("virtio-transport: unknown type \"%s\"\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
 int virtio_transport_parser(const struct option *opt, const char *arg, int unset) {
     enum virtio_trans *type = opt->value;
     struct kvm *kvm;
 
     if (!strcmp(opt->long_name, "virtio-transport")) {
-        if (!strcmp(arg, "pci")) {
-            *type = VIRTIO_PCI;
-        } else if (!strcmp(arg, "pci-legacy")) {
-            *type = VIRTIO_PCI_LEGACY;
-#if defined(CONFIG_ARM) || defined(CONFIG_ARM64) || defined(CONFIG_RISCV)
-        } else if (!strcmp(arg, "mmio")) {
-            *type = VIRTIO_MMIO;
-        } else if (!strcmp(arg, "mmio-legacy")) {
-            *type = VIRTIO_MMIO_LEGACY;
-#endif
-        } else {
-            ERR("virtio-transport: unknown type \"%s\"\n", arg);
+        if (virtio_transport_from_str(arg, type) < 0)
             return -1;
-        }
     } else if (!strcmp(opt->long_name, "virtio-legacy")) {
         *type = VIRTIO_PCI_LEGACY;
     } else if (!strcmp(opt->long_name, "force-pci")) {
@@ -82,6 +94,37 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
     return used_elem;
 }
 
+/*
+ * Complete a chain whose used length the driver either ignores, as for
+ * chains without device-writable buffers, or can infer because the whole
+ * writable part was filled.
+ * With VIRTIO_F_IN_ORDER negotiated, the driver treats one used element as
+ * covering every buffer made available before it, so consecutive chains are
+ * accumulated here and published by virt_queue__flush_used_in_order() with
+ * a single element and a single used index update. Without the feature this
+ * is virt_queue__set_used_elem().
+ */
+void virt_queue__set_used_elem_in_order(struct virt_queue *queue, u32 head, u32 len) {
+    if (!queue->in_order) {
+        virt_queue__set_used_elem(queue, head, len);
+        return;
+    }
+
+    queue->in_order_head = head;
+    queue->in_order_len = len;
+    queue->in_order_batch++;
+}
+
+void virt_queue__flush_used_in_order(struct virt_queue *queue) {
+    if (!queue->in_order_batch)
+        return;
+
+    /* The element goes in the slot of the first buffer of the batch */
+    virt_queue__set_used_elem_no_update(queue, queue->in_order_head, queue->in_order_len, 0);
+    virt_queue__used_idx_advance(queue, queue->in_order_batch);
+    queue->in_order_batch = 0;
+}
+
 static inline bool virt_desc__test_flag(struct virt_queue *vq, struct vring_desc *desc, u16 flag) {
     return !!(virtio_guest_to_host_u16(vq->endian, desc->flags) & flag);
 }
@@ -104,7 +147,9 @@ static unsigned next_desc(struct virt_queue *vq, struct vring_desc *desc, unsign
     return min(next, max);
 }
 
-u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm) {
+/* Fills at most max_iov entries of iov, returns false if the chain has more */
+static bool virt_queue__fill_iov(struct virt_queue *vq, struct iovec iov[], u16 max_iov, u16 *out, u16 *in, u16 head,
+                                 struct kvm *kvm) {
     struct vring_desc *desc;
     u16 idx;
     u16 max;
@@ -121,6 +166,9 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
     }
 
     do {
+        if (*out + *in == max_iov)
+            return false;
+
         /* Grab the first descriptor, and check it's OK. */
         iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
         iov[*out + *in].iov_base = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
@@ -131,6 +179,12 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
             (*out)++;
     } while ((idx = next_desc(vq, desc, idx, max)) != max);
 
+    return true;
+}
+
+u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm) {
+    virt_queue__fill_iov(vq, iov, USHRT_MAX, out, in, head, kvm);
+
     return head;
 }
 
@@ -142,6 +196,21 @@ u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16
     return virt_queue__get_head_iov(vq, iov, out, in, head, kvm);
 }
 
+/*
+ * As virt_queue__get_iov(), for an iov of max_iov entries. A longer chain
+ * is popped all the same, and reported without any buffer.
+ */
+u16 virt_queue__get_iov_max(struct virt_queue *vq, struct iovec iov[], u16 max_iov, u16 *out, u16 *in,
+                            struct kvm *kvm) {
+    u16 head;
+
+    head = virt_queue__pop(vq);
+    if (!virt_queue__fill_iov(vq, iov, max_iov, out, in, head, kvm))
+        *out = *in = 0;
+
+    return head;
+}
+
 /* in and out are relative to guest */
 u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue, struct iovec in_iov[], struct iovec out_iov[],
                               u16 *in, u16 *out) {
@@ -172,14 +241,277 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue, struct
     return head;
 }
 
+/*
+ * Used when a frame threshold is configured without a time bound, so that a
+ * partial batch can never be held back indefinitely.
+ */
+#define VIRTIO_IRQ_MOD_DEFAULT_USECS 50
+#define NSEC_PER_USEC                1000ULL
+#define NSEC_PER_SEC                 1000000000ULL
+
+static struct kvm_epoll irq_mod_epoll;
+/* Serializes queue teardown against the timer callback, guards irq_mod_queues */
+static DEFINE_MUTEX(irq_mod_lock);
+static LIST_HEAD(irq_mod_queues);
+
+static u64 virtio_irq_mod__now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void virtio_irq_mod__arm(struct virt_queue_irq_mod *mod, u64 nsecs) {
+    struct itimerspec its = {
+        .it_value =
+            {
+                .tv_sec = nsecs / NSEC_PER_SEC,
+                .tv_nsec = nsecs % NSEC_PER_SEC,
+            },
+    };
+
+    /* A zero it_value would disarm the timer */
+    if (!nsecs)
+        its.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(mod->timer_fd, 0, &its, NULL) < 0) {
+        pr_warning("%s: timerfd_settime failed with %d", __func__, errno);
+        return;
+    }
+    mod->timer_armed = true;
+}
+
+/* Must be called with mod->lock held */
+static int virtio_irq_mod__flush(struct kvm *kvm, struct virt_queue *vq, u64 now, bool by_timer) {
+    struct virt_queue_irq_mod *mod = &vq->irq_mod;
+
+    if (mod->adaptive) {
+        /*
+         * A batch that filled up before the time bound means the queue is
+         * busy, so coalesce more aggressively. A batch the timer had to
+         * flush means the load went down, so get back to low latency.
+         */
+        if (by_timer)
+            mod->cur_frames = max(mod->cur_frames / 2, 1U);
+        else if (now - mod->last_flush < mod->max_usecs * NSEC_PER_USEC)
+            mod->cur_frames = min(mod->cur_frames * 2, mod->max_frames);
+    }
+
+    mod->pending = 0;
+    mod->last_flush = now;
+
+    if (!virtio_queue__should_signal(vq)) {
+        mod->nr_suppressed++;
+        return 0;
+    }
+
+    mod->nr_signals++;
+    return vq->vdev->ops->signal_vq(kvm, vq->vdev, mod->queueid);
+}
+
+static void virtio_irq_mod__timer_expired(struct kvm *kvm, struct epoll_event *ev) {
+    struct virt_queue *vq = ev->data.ptr;
+    struct virt_queue_irq_mod *mod = &vq->irq_mod;
+    u64 expirations, now, deadline;
+
+    /*
+     * The event may be left over from a queue torn down since, whose
+     * state is gone. Teardown holds irq_mod_lock, so only look at it once
+     * the queue is known to still be moderated.
+     */
+    mutex_lock(&irq_mod_lock);
+    if (!mod->enabled || read(mod->timer_fd, &expirations, sizeof(expirations)) < 0)
+        goto out;
+
+    mutex_lock(&mod->lock);
+    mod->timer_armed = false;
+    if (mod->pending) {
+        /* The timer may be left over from a batch that was already flushed */
+        now = virtio_irq_mod__now();
+        deadline = mod->pending_since + mod->max_usecs * NSEC_PER_USEC;
+        if (now < deadline) {
+            virtio_irq_mod__arm(mod, deadline - now);
+        } else {
+            mod->nr_timer_flushes++;
+            virtio_irq_mod__flush(kvm, vq, now, true);
+        }
+    }
+    mutex_unlock(&mod->lock);
+out:
+    mutex_unlock(&irq_mod_lock);
+}
+
+static bool virtio_irq_mod__configured(struct kvm *kvm) {
+    return kvm->cfg.virtio_irq_frames > 1 || kvm->cfg.virtio_irq_usecs > 0;
+}
+
+static void virtio_irq_mod__init(struct kvm *kvm, struct virt_queue *vq, size_t nr_descs) {
+    struct virt_queue_irq_mod *mod = &vq->irq_mod;
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = vq,
+    };
+    u32 frames = max(kvm->cfg.virtio_irq_frames, 0);
+    u32 usecs = max(kvm->cfg.virtio_irq_usecs, 0);
+
+    /* Without its thread, interrupts aren't moderated at all */
+    if (!virtio_irq_mod__configured(kvm) || !irq_mod_epoll.fd)
+        return;
+
+    if (!frames)
+        frames = nr_descs;
+    if (!usecs)
+        usecs = VIRTIO_IRQ_MOD_DEFAULT_USECS;
+
+    mod->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mod->timer_fd < 0) {
+        pr_warning("%s: timerfd_create failed with %d", __func__, errno);
+        mod->timer_fd = 0;
+        return;
+    }
+
+    mutex_init(&mod->lock);
+    mod->max_frames = frames;
+    mod->max_usecs = usecs;
+    mod->adaptive = kvm->cfg.virtio_irq_adaptive;
+    mod->cur_frames = mod->adaptive ? 1 : frames;
+
+    mutex_lock(&irq_mod_lock);
+    if (epoll_ctl(irq_mod_epoll.fd, EPOLL_CTL_ADD, mod->timer_fd, &event) < 0) {
+        pr_warning("%s: EPOLL_CTL_ADD failed with %d", __func__, errno);
+        mutex_unlock(&irq_mod_lock);
+        mutex_destroy(&mod->lock);
+        close(mod->timer_fd);
+        mod->timer_fd = 0;
+        return;
+    }
+    mod->enabled = true;
+    list_add_tail(&mod->list, &irq_mod_queues);
+    mutex_unlock(&irq_mod_lock);
+}
+
+static void virtio_irq_mod__exit(struct virt_queue *vq, int num) {
+    struct virt_queue_irq_mod *mod = &vq->irq_mod;
+    struct itimerspec its = {};
+
+    if (!mod->enabled)
+        return;
+
+    pr_debug("vq %d: %llu completions, %llu interrupts, %llu suppressed, %llu timer flushes",
+             num,
+             mod->nr_completions,
+             mod->nr_signals,
+             mod->nr_suppressed,
+             mod->nr_timer_flushes);
+
+    /* Waits for the timer callback, and keeps later ones away */
+    mutex_lock(&irq_mod_lock);
+    mutex_lock(&mod->lock);
+    timerfd_settime(mod->timer_fd, 0, &its, NULL);
+    mod->timer_armed = false;
+    mod->enabled = false;
+    mutex_unlock(&mod->lock);
+
+    list_del(&mod->list);
+    epoll_ctl(irq_mod_epoll.fd, EPOLL_CTL_DEL, mod->timer_fd, NULL);
+    close(mod->timer_fd);
+    mod->timer_fd = 0;
+    mutex_unlock(&irq_mod_lock);
+
+    mutex_destroy(&mod->lock);
+}
+
+/* Counters of the moderated queues, one line each */
+static const char *virtio_type_name(u32 type) {
+    switch (type) {
+        case VIRTIO_ID_NET:
+            return "net";
+        case VIRTIO_ID_BLOCK:
+            return "blk";
+        case VIRTIO_ID_CONSOLE:
+            return "console";
+        case VIRTIO_ID_RNG:
+            return "rng";
+        case VIRTIO_ID_BALLOON:
+            return "balloon";
+        case VIRTIO_ID_SCSI:
+            return "scsi";
+        case VIRTIO_ID_9P:
+            return "9p";
+        case VIRTIO_ID_VSOCK:
+            return "vsock";
+        default:
+            return "unknown";
+    }
+}
+
+void virtio_irq_mod__report(FILE *out) {
+    u64 completions, signals, suppressed, timer_flushes;
+    struct virt_queue_irq_mod *mod;
+    struct virt_queue *vq;
+    u32 queueid;
+
+    mutex_lock(&irq_mod_lock);
+    if (!list_empty(&irq_mod_queues))
+        fprintf(out, "  virtio interrupt moderation:\n");
+    list_for_each_entry(mod, &irq_mod_queues, list) {
+        vq = container_of(mod, struct virt_queue, irq_mod);
+
+        mutex_lock(&mod->lock);
+        queueid = mod->queueid;
+        completions = mod->nr_completions;
+        signals = mod->nr_signals;
+        suppressed = mod->nr_suppressed;
+        timer_flushes = mod->nr_timer_flushes;
+        mutex_unlock(&mod->lock);
+
+        /* The queue index is only known once the queue completed something */
+        if (!completions)
+            continue;
+
+        fprintf(out,
+                "    virtio-%-8s vq %-4u %llu completions, %llu interrupts, %llu suppressed, %llu timer flushes\n",
+                virtio_type_name(vq->vdev->type),
+                queueid,
+                completions,
+                signals,
+                suppressed,
+                timer_flushes);
+    }
+    mutex_unlock(&irq_mod_lock);
+}
+
+static int virtio_irq_mod__start_poll(struct kvm *kvm) {
+    if (!virtio_irq_mod__configured(kvm))
+        return 0;
+
+    if (epoll__init(kvm, &irq_mod_epoll, "virtio-irq-mod", virtio_irq_mod__timer_expired)) {
+        pr_warning("Unable to start virtio interrupt moderation thread");
+        irq_mod_epoll.fd = 0;
+    }
+
+    return 0;
+}
+dev_base_init(virtio_irq_mod__start_poll);
+
+static int virtio_irq_mod__stop_poll(struct kvm *kvm) {
+    if (irq_mod_epoll.fd)
+        epoll__exit(&irq_mod_epoll);
+    return 0;
+}
+base_exit(virtio_irq_mod__stop_poll);
+
 void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev, struct virt_queue *vq, size_t nr_descs) {
     struct vring_addr *addr = &vq->vring_addr;
 
     vq->endian = vdev->endian;
     vq->use_event_idx = (vdev->features & (1UL << VIRTIO_RING_F_EVENT_IDX));
+    vq->in_order = (vdev->features & (1ULL << VIRTIO_F_IN_ORDER));
     vq->enabled = true;
     vq->vdev = vdev;
 
+    virtio_irq_mod__init(kvm, vq, nr_descs);
+
     if (addr->legacy) {
         unsigned long base = (u64)addr->pfn * addr->pgsize;
         void *p = guest_flat_to_host(kvm, base);
@@ -204,6 +536,7 @@ void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev, int
 
     if (vq->enabled && vdev->ops->exit_vq)
         vdev->ops->exit_vq(kvm, dev, num);
+    virtio_irq_mod__exit(vq, num);
     memset(vq, 0, sizeof(*vq));
 }
 
@@ -251,6 +584,39 @@ bool virtio_queue__should_signal(struct virt_queue *vq) {
     return false;
 }
 
+/*
+ * Tell the guest that buffers of @vq were used, subject to the interrupt
+ * moderation configured for the VM. Devices should call this after updating
+ * the used ring instead of going to the transport's signal_vq directly.
+ */
+int virtio_queue__signal(struct kvm *kvm, struct virtio_device *vdev, struct virt_queue *vq, u32 queueid) {
+    struct virt_queue_irq_mod *mod = &vq->irq_mod;
+    u64 now;
+    int r = 0;
+
+    if (!mod->enabled) {
+        if (virtio_queue__should_signal(vq))
+            r = vdev->ops->signal_vq(kvm, vdev, queueid);
+        return r;
+    }
+
+    now = virtio_irq_mod__now();
+
+    mutex_lock(&mod->lock);
+    mod->queueid = queueid;
+    mod->nr_completions++;
+    if (!mod->pending++)
+        mod->pending_since = now;
+
+    if (mod->pending >= mod->cur_frames || now - mod->pending_since >= mod->max_usecs * NSEC_PER_USEC)
+        r = virtio_irq_mod__flush(kvm, vq, now, false);
+    else if (!mod->timer_armed)
+        virtio_irq_mod__arm(mod, mod->pending_since + mod->max_usecs * NSEC_PER_USEC - now);
+    mutex_unlock(&mod->lock);
+
+    return r;
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev, void *dev, u64 features) {
     /* TODO: fail negotiation if features & ~host_features */
 
@@ -327,6 +693,8 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev, struct v
     void *virtio;
     int r;
 
+    vdev->type = subsys_id;
+
     switch (trans) {
         case VIRTIO_PCI_LEGACY:
             vdev->legacy = true;
@@ -35,6 +35,11 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev, u32
         .vq = vq,
     };
 
+    /*
+     * QUEUE_NOTIFY carries the queue index, so every queue of the device
+     * gets its own eventfd on the same register thanks to datamatch, and
+     * notifications never exit to userspace through kvm_emulate_mmio().
+     */
     ioevent = (struct ioevent){
         .io_addr = vmmio->addr + VIRTIO_MMIO_QUEUE_NOTIFY,
         .io_len = sizeof(u32),
@@ -44,6 +49,8 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev, u32
         .fn_kvm = kvm,
         .fd = eventfd(0, 0),
     };
+    if (ioevent.fd < 0)
+        return -errno;
 
     if (vdev->use_vhost)
         /*
@@ -54,8 +61,13 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev, u32
     else
         /* Need to poll in userspace. */
         err = ioeventfd__add_event(&ioevent, IOEVENTFD_FLAG_USER_POLL);
-    if (err)
+    if (err) {
+        close(ioevent.fd);
+        /* Without KVM ioeventfd, QUEUE_NOTIFY keeps trapping to the device */
+        if (err == -ENOSYS && !vdev->use_vhost)
+            return 0;
         return err;
+    }
 
     if (vdev->ops->notify_vq_eventfd)
         vdev->ops->notify_vq_eventfd(kvm, vmmio->dev, vq, ioevent.fd);
@@ -128,6 +140,19 @@ static void generate_virtio_mmio_fdt_node(void *fdt, struct device_header *dev_h
 }
 #endif
 
+#ifdef CONFIG_X86
+/* x86 has no device tree, the kernel command line is the only way to describe the device */
+static void virtio_mmio_add_cmdline_device(struct kvm *kvm, struct virtio_mmio *vmmio) {
+    char param[64];
+
+    snprintf(param, sizeof(param), " virtio_mmio.device=0x%x@0x%x:%d", VIRTIO_MMIO_IO_SIZE, vmmio->addr, vmmio->irq);
+    kvm_arch_append_cmdline(kvm, param);
+}
+#else
+static void virtio_mmio_add_cmdline_device(struct kvm *kvm, struct virtio_mmio *vmmio) {
+}
+#endif
+
 int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev, int device_id, int subsys_id, int class) {
     bool legacy = vdev->legacy;
     struct virtio_mmio *vmmio = vdev->virtio;
@@ -177,6 +202,7 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev, int
      * virtio_mmio.devices=0x200@0xd2000000:5,0x200@0xd2000200:6
      */
     pr_debug("virtio-mmio.devices=0x%x@0x%x:%d", VIRTIO_MMIO_IO_SIZE, vmmio->addr, vmmio->irq);
+    virtio_mmio_add_cmdline_device(kvm, vmmio);
 
     return 0;
 }
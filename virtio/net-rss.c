@@ -0,0 +1,200 @@
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include "kvm/rwsem.h"
+#include "kvm/virtio-net-rss.h"
+
+#define VIRTIO_NET_RSS_HASH_TYPES_V4 \
+    (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4)
+#define VIRTIO_NET_RSS_HASH_TYPES_V6 \
+    (VIRTIO_NET_RSS_HASH_TYPE_IPv6 | VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
+/* Key the Toeplitz hash was specified with, which most drivers default to */
+static const u8 virtio_net_rss_default_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+    0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+    0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Every set bit of the input XORs in the 32 bits of the key starting at the
+ * same bit. The input never exceeds the 36 bytes of an IPv6 4-tuple, so the
+ * window never runs past the key.
+ */
+u32 virtio_net_rss_toeplitz(const u8 *key, const u8 *data, u32 len) {
+    u32 window = (u32)key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+    u32 hash = 0, i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        u8 next = i + 4 < VIRTIO_NET_RSS_MAX_KEY_SIZE ? key[i + 4] : 0;
+
+        for (bit = 7; bit >= 0; bit--) {
+            if (data[i] & (1 << bit))
+                hash ^= window;
+            window = window << 1 | ((next >> bit) & 1);
+        }
+    }
+
+    return hash;
+}
+
+void virtio_net_rss_init(struct virtio_net_rss *rss) {
+    pthread_rwlock_init(&rss->lock, NULL);
+    virtio_net_rss_reset(rss, 1);
+}
+
+/* Back to what a device coming out of reset does */
+void virtio_net_rss_reset(struct virtio_net_rss *rss, u16 nr_queues) {
+    down_write(&rss->lock);
+    rss->report = false;
+    rss->hash_types = VIRTIO_NET_RSS_HASH_TYPES;
+    memcpy(rss->key, virtio_net_rss_default_key, sizeof(rss->key));
+    up_write(&rss->lock);
+
+    virtio_net_rss_spread(rss, nr_queues);
+}
+
+/* Drop the table of the guest, if any, for one spreading flows over the first nr_queues */
+void virtio_net_rss_spread(struct virtio_net_rss *rss, u16 nr_queues) {
+    u16 i;
+
+    down_write(&rss->lock);
+    rss->configured = false;
+    rss->table_mask = VIRTIO_NET_RSS_MAX_TABLE_LEN - 1;
+    rss->unclassified = 0;
+    for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) rss->table[i] = i % nr_queues;
+    up_write(&rss->lock);
+}
+
+/*
+ * Apply the hash parameters of the guest, and its indirection table if it
+ * has one. The caller checked the table holds a power of two entries.
+ */
+void virtio_net_rss_configure(struct virtio_net_rss *rss, u32 hash_types, const u8 *key, u8 key_len,
+                              const u16 *table, u16 table_len, u16 unclassified) {
+    down_write(&rss->lock);
+    rss->report = true;
+    rss->hash_types = hash_types & VIRTIO_NET_RSS_HASH_TYPES;
+    memset(rss->key, 0, sizeof(rss->key));
+    memcpy(rss->key, key, key_len);
+    if (table) {
+        rss->configured = true;
+        rss->table_mask = table_len - 1;
+        rss->unclassified = unclassified;
+        memcpy(rss->table, table, table_len * sizeof(*table));
+    }
+    up_write(&rss->lock);
+}
+
+/*
+ * Gather the addresses of an IPv4 or IPv6 frame, and its ports if the hash
+ * types ask for them, the way the Toeplitz hash takes them. Returns the
+ * input length, zero if the frame isn't classified.
+ */
+static u32 virtio_net_rss_input(u32 types, const u8 *frame, u32 len, u8 *input, u16 *report) {
+    u32 off = ETH_HLEN, l4_off, n;
+    u16 proto;
+    u8 l4;
+
+    if (len < ETH_HLEN)
+        return 0;
+
+    proto = frame[12] << 8 | frame[13];
+    if (proto == ETH_P_8021Q && len >= off + 4) {
+        proto = frame[16] << 8 | frame[17];
+        off += 4;
+    }
+
+    if (proto == ETH_P_IP && len >= off + 20) {
+        u16 frag_off = frame[off + 6] << 8 | frame[off + 7];
+
+        if (!(types & VIRTIO_NET_RSS_HASH_TYPES_V4))
+            return 0;
+
+        memcpy(input, frame + off + 12, 8);
+        n = 8;
+        l4 = frame[off + 9];
+        l4_off = off + (frame[off] & 0xf) * 4;
+
+        /* Fragments have no ports, or only the first one does */
+        if (!(frag_off & 0x3fff) && len >= l4_off + 4) {
+            if (l4 == IPPROTO_TCP && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+                *report = VIRTIO_NET_HASH_REPORT_TCPv4;
+                goto ports;
+            }
+            if (l4 == IPPROTO_UDP && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+                *report = VIRTIO_NET_HASH_REPORT_UDPv4;
+                goto ports;
+            }
+        }
+
+        *report = VIRTIO_NET_HASH_REPORT_IPv4;
+        return types & VIRTIO_NET_RSS_HASH_TYPE_IPv4 ? n : 0;
+    }
+
+    if (proto == ETH_P_IPV6 && len >= off + 40) {
+        if (!(types & VIRTIO_NET_RSS_HASH_TYPES_V6))
+            return 0;
+
+        memcpy(input, frame + off + 8, 32);
+        n = 32;
+        l4 = frame[off + 6];
+        l4_off = off + 40;
+
+        if (len >= l4_off + 4) {
+            if (l4 == IPPROTO_TCP && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+                *report = VIRTIO_NET_HASH_REPORT_TCPv6;
+                goto ports;
+            }
+            if (l4 == IPPROTO_UDP && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+                *report = VIRTIO_NET_HASH_REPORT_UDPv6;
+                goto ports;
+            }
+        }
+
+        *report = VIRTIO_NET_HASH_REPORT_IPv6;
+        return types & VIRTIO_NET_RSS_HASH_TYPE_IPv6 ? n : 0;
+    }
+
+    return 0;
+
+ports:
+    memcpy(input + n, frame + l4_off, 4);
+    return n + 4;
+}
+
+/*
+ * Pick the receive queue of a frame. Its hash and hash type are returned
+ * as the guest should see them: none until it enabled hashing.
+ */
+u16 virtio_net_rss_queue(struct virtio_net_rss *rss, const u8 *frame, u32 len, u32 *hash, u16 *report) {
+    u8 input[36];
+    u32 n;
+    u16 queue;
+
+    *hash = 0;
+    *report = VIRTIO_NET_HASH_REPORT_NONE;
+
+    down_read(&rss->lock);
+
+    n = virtio_net_rss_input(rss->hash_types, frame, len, input, report);
+    if (!n) {
+        *report = VIRTIO_NET_HASH_REPORT_NONE;
+        queue = rss->unclassified;
+    } else {
+        *hash = virtio_net_rss_toeplitz(rss->key, input, n);
+        queue = rss->table[*hash & rss->table_mask];
+    }
+
+    if (!rss->report) {
+        *hash = 0;
+        *report = VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    up_read(&rss->lock);
+
+    return queue;
+}
@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/byteorder.h>
 #include <linux/if_tun.h>
 #include <linux/list.h>
 #include <linux/types.h>
@@ -12,6 +13,8 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "kvm/af-packet.h"
+#include "kvm/af-xdp.h"
 #include "kvm/guest_compat.h"
 #include "kvm/iovec.h"
 #include "kvm/kvm.h"
@@ -19,6 +22,7 @@
 #include "kvm/strbuf.h"
 #include "kvm/uip.h"
 #include "kvm/util.h"
+#include "kvm/virtio-net-rss.h"
 #include "kvm/virtio-net.h"
 #include "kvm/virtio-pci-dev.h"
 #include "kvm/virtio.h"
@@ -26,11 +30,31 @@
 #define VIRTIO_NET_QUEUE_SIZE 256
 #define VIRTIO_NET_NUM_QUEUES 8
 
+/*
+ * Ring and transport features are implemented by vhost-net, device specific
+ * ones by TAP and by us (e.g. the control queue).
+ */
+#define VIRTIO_NET_VHOST_FEATURES \
+    (((1ULL << VIRTIO_TRANSPORT_F_END) - 1) & ~((1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) - 1))
+
+/* A vhost-user backend implements everything but the config space and control queue */
+#define VIRTIO_NET_VHOST_USER_LOCAL_FEATURES \
+    (1ULL << VIRTIO_NET_F_MAC | 1ULL << VIRTIO_NET_F_CTRL_VQ | 1ULL << VIRTIO_NET_F_MQ)
+
+/* Packet and XDP sockets pass frames as they are, without segmentation or checksum offload */
+#define VIRTIO_NET_PACKET_OFFLOADS \
+    (1ULL << VIRTIO_NET_F_CSUM | 1ULL << VIRTIO_NET_F_HOST_TSO4 | 1ULL << VIRTIO_NET_F_HOST_TSO6 | \
+     1ULL << VIRTIO_NET_F_HOST_UFO | 1ULL << VIRTIO_NET_F_GUEST_TSO4 | 1ULL << VIRTIO_NET_F_GUEST_TSO6 | \
+     1ULL << VIRTIO_NET_F_GUEST_UFO)
+
 struct net_dev;
+struct net_dev_queue;
 
 struct net_dev_operations {
-    int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
-    int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+    int (*rx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+    int (*tx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+    /* Optional, called once the guest has no more frames to send */
+    void (*tx_flush)(struct net_dev_queue *queue);
 };
 
 struct net_dev_queue {
@@ -40,6 +64,8 @@ struct net_dev_queue {
     pthread_t thread;
     struct mutex lock;
     pthread_cond_t cond;
+    /* Frames larger than the buffers the guest can post */
+    u64 nr_dropped;
 };
 
 struct net_dev {
@@ -51,13 +77,30 @@ struct net_dev {
     struct virtio_net_config config;
     u32 queue_pairs;
 
-    int vhost_fd;
-    int tap_fd;
+    /* vhost-net instance and TAP queue of each queue pair */
+    int vhost_fds[VIRTIO_NET_NUM_QUEUES];
+    u64 vhost_features;
+    int tap_fds[VIRTIO_NET_NUM_QUEUES];
+    int nr_tap_fds;
+    /* TAP queues [0, tap_queues) are attached to the interface */
+    int tap_queues;
     char tap_name[IFNAMSIZ];
     bool tap_ufo;
 
+    struct virtio_vhost_user vhost_user;
+
+    /* Packet socket of each queue pair */
+    struct af_packet packets[VIRTIO_NET_NUM_QUEUES];
+
+    /* XDP socket of each queue pair, bound to the interface queue of the same index */
+    struct af_xdp_prog xdp_prog;
+    struct af_xdp xsks[VIRTIO_NET_NUM_QUEUES];
+
     int mode;
 
+    /* Steering of the backends that can, and the hashes reported to the guest */
+    struct virtio_net_rss rss;
+
     struct uip_info info;
     struct net_dev_operations *ops;
     struct kvm *kvm;
@@ -69,81 +112,185 @@ static LIST_HEAD(ndevs);
 static int compat_id = -1;
 
 #define MAX_PACKET_SIZE 65550
+/* Ethernet frame with a VLAN tag */
+#define MAX_FRAME_SIZE  (ETH_FRAME_LEN + 4)
 
 static bool has_virtio_feature(struct net_dev *ndev, u32 feature) {
-    return ndev->vdev.features & (1 << feature);
+    return ndev->vdev.features & (1ULL << feature);
 }
 
 static int virtio_net_hdr_len(struct net_dev *ndev) {
+    if (has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+        return sizeof(struct virtio_net_hdr_v1_hash);
+
     if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) || !ndev->vdev.legacy)
         return sizeof(struct virtio_net_hdr_mrg_rxbuf);
 
     return sizeof(struct virtio_net_hdr);
 }
 
+/* Largest frame the backend hands us, vnet header included */
+static size_t virtio_net_rx_max_len(struct net_dev *ndev) {
+    size_t len = virtio_net_hdr_len(ndev);
+
+    if (has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO4) || has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO6) ||
+        has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_UFO))
+        return len + MAX_PACKET_SIZE;
+
+    return len + MAX_FRAME_SIZE;
+}
+
+/* Sleep until the guest makes receive buffers available */
+static void virtio_net_rx_wait(struct net_dev_queue *queue) {
+    mutex_lock(&queue->lock);
+    while (!virt_queue__available(&queue->vq))
+        pthread_cond_wait(&queue->cond, &queue->lock.mutex);
+    mutex_unlock(&queue->lock);
+}
+
+/*
+ * A TAP queue detached when the guest disabled its pair fails reads and
+ * writes with EBADFD. That isn't an error, the pair is just idle until the
+ * guest enables it again.
+ */
+static bool virtio_net_tap_idle(struct net_dev_queue *queue, int len) {
+    return len < 0 && queue->ndev->mode == NET_MODE_TAP && (errno == EBADFD || errno == EAGAIN);
+}
+
+/* Sleep until the TAP queue of the pair is attached again */
+static void virtio_net_tap_wait_attached(struct net_dev_queue *queue) {
+    mutex_lock(&queue->lock);
+    while (queue->id / 2 >= queue->ndev->tap_queues)
+        pthread_cond_wait(&queue->cond, &queue->lock.mutex);
+    mutex_unlock(&queue->lock);
+}
+
+/* Report the hash of the frame read into iov, whatever the backend */
+static void virtio_net_rx_hash(struct net_dev *ndev, struct iovec *iov, u32 hdr_len, u32 len) {
+    struct {
+        __le32 value;
+        __le16 report;
+        __le16 padding;
+    } hash = {};
+    u8 frame[128];
+    u32 value;
+    u16 report;
+
+    /* Enough for the headers of any frame we classify */
+    len = min_t(u32, len - hdr_len, sizeof(frame));
+    memcpy_fromiovecend(frame, iov, hdr_len, len);
+    virtio_net_rss_queue(&ndev->rss, frame, len, &value, &report);
+
+    hash.value = cpu_to_le32(value);
+    hash.report = cpu_to_le16(report);
+    memcpy_toiovecend(iov, (unsigned char *)&hash, offsetof(struct virtio_net_hdr_v1_hash, hash_value), sizeof(hash));
+}
+
+/*
+ * Packets are read straight into guest buffers. Enough chains to hold the
+ * largest frame are popped beforehand, a single one unless mergeable RX
+ * buffers were negotiated, and those the frame didn't reach are handed back
+ * to the ring for the next one. While the guest refills its ring we wait
+ * for more chains: user mode can't send a frame again once it is read.
+ * Frames are only dropped when the whole ring can't hold them.
+ *
+ * Chains the device can't write to are completed empty. Since chains are
+ * handed back from the end, that is only done for the first one of a batch.
+ */
 static void *virtio_net_rx_thread(void *p) {
-    struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+    struct iovec iov[VIRTIO_NET_QUEUE_SIZE * 2];
+    struct {
+        u16 head;
+        u32 len;
+    } chains[VIRTIO_NET_QUEUE_SIZE];
     struct net_dev_queue *queue = p;
     struct virt_queue *vq = &queue->vq;
     struct net_dev *ndev = queue->ndev;
     struct kvm *kvm;
-    u16 out, in;
-    u16 head;
-    int len, copied;
+    u16 head, out, in, num_buffers;
+    size_t size, max_len;
+    int len, niov, nr_chains, max_chains, i;
+    bool mrg_rxbuf;
 
     kvm_set_thread_name("virtio-net-rx");
 
     kvm = ndev->kvm;
     while (1) {
-        mutex_lock(&queue->lock);
-        if (!virt_queue__available(vq))
-            pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-        mutex_unlock(&queue->lock);
+        mrg_rxbuf = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF);
+        max_len = virtio_net_rx_max_len(ndev);
+        niov = nr_chains = 0;
+        size = 0;
 
-        while (virt_queue__available(vq)) {
-            unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
-            struct iovec dummy_iov = {
-                .iov_base = buffer,
-                .iov_len = sizeof(buffer),
-            };
-            struct virtio_net_hdr_mrg_rxbuf *hdr;
-            u16 num_buffers;
-
-            len = ndev->ops->rx(&dummy_iov, 1, ndev);
-            if (len < 0) {
-                pr_warning("%s: rx on vq %u failed (%d), exiting thread\n", __func__, queue->id, len);
-                goto out_err;
-            }
+        max_chains = min_t(int, ARRAY_SIZE(chains), vq->vring.num);
 
-            copied = num_buffers = 0;
-            head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-            hdr = iov[0].iov_base;
-            while (copied < len) {
-                size_t iovsize = min_t(size_t, len - copied, iov_size(iov, in));
-
-                memcpy_toiovec(iov, buffer + copied, iovsize);
-                copied += iovsize;
-                virt_queue__set_used_elem_no_update(vq, head, iovsize, num_buffers++);
-                if (copied == len)
+        do {
+            virtio_net_rx_wait(queue);
+
+            head = virt_queue__get_iov_max(vq, iov + niov, ARRAY_SIZE(iov) - niov, &out, &in, kvm);
+            if (!in || out) {
+                if (nr_chains) {
+                    vq->last_avail_idx--;
                     break;
-                while (!virt_queue__available(vq)) sleep(0);
-                head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+                }
+                virt_queue__set_used_elem(vq, head, 0);
+                virtio_queue__signal(kvm, &ndev->vdev, vq, queue->id);
+                continue;
             }
 
-            /*
-             * The device MUST set num_buffers, except in the case
-             * where the legacy driver did not negotiate
-             * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
-             */
-            if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) || !ndev->vdev.legacy)
-                hdr->num_buffers = virtio_host_to_guest_u16(vq->endian, num_buffers);
+            chains[nr_chains].head = head;
+            chains[nr_chains].len = iov_size(iov + niov, in);
+            size += chains[nr_chains++].len;
+            niov += in;
+        } while (!nr_chains ||
+                 (mrg_rxbuf && size < max_len && nr_chains < max_chains && niov < (int)ARRAY_SIZE(iov)));
+
+        len = ndev->ops->rx(iov, niov, queue);
+        if (virtio_net_tap_idle(queue, len)) {
+            vq->last_avail_idx -= nr_chains;
+            virtio_net_tap_wait_attached(queue);
+            continue;
+        }
+        if (len < 0) {
+            pr_warning("%s: rx on vq %u failed (%d), exiting thread\n", __func__, queue->id, len);
+            goto out_err;
+        }
+
+        if ((size_t)len > size) {
+            /* Truncated, drop it and reuse the buffers */
+            queue->nr_dropped++;
+            vq->last_avail_idx -= nr_chains;
+            continue;
+        }
+
+        if (has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+            virtio_net_rx_hash(ndev, iov, virtio_net_hdr_len(ndev), len);
+
+        for (i = 0, num_buffers = 0; len > 0 || !num_buffers; i++) {
+            u32 used = min_t(u32, len, chains[i].len);
+
+            virt_queue__set_used_elem_no_update(vq, chains[i].head, used, num_buffers++);
+            len -= used;
+        }
+        vq->last_avail_idx -= nr_chains - num_buffers;
 
-            virt_queue__used_idx_advance(vq, num_buffers);
+        /*
+         * The device MUST set num_buffers, except in the case
+         * where the legacy driver did not negotiate
+         * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
+         */
+        if (mrg_rxbuf || !ndev->vdev.legacy) {
+            u16 num_buffers_le = virtio_host_to_guest_u16(vq->endian, num_buffers);
 
-            /* We should interrupt guest right now, otherwise latency is huge. */
-            if (virtio_queue__should_signal(vq))
-                ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+            memcpy_toiovecend(iov,
+                              (unsigned char *)&num_buffers_le,
+                              offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                              sizeof(num_buffers_le));
         }
+
+        virt_queue__used_idx_advance(vq, num_buffers);
+
+        /* We should interrupt guest right now, otherwise latency is huge. */
+        virtio_queue__signal(kvm, &ndev->vdev, vq, queue->id);
     }
 
 out_err:
@@ -173,17 +320,24 @@ static void *virtio_net_tx_thread(void *p) {
 
         while (virt_queue__available(vq)) {
             head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-            len = ndev->ops->tx(iov, out, ndev);
+            len = ndev->ops->tx(iov, out, queue);
+            if (virtio_net_tap_idle(queue, len)) {
+                /* Frames left over from a disabled pair are dropped */
+                virt_queue__set_used_elem_in_order(vq, head, 0);
+                continue;
+            }
             if (len < 0) {
                 pr_warning("%s: tx on vq %u failed (%d)\n", __func__, queue->id, errno);
                 goto out_err;
             }
 
-            virt_queue__set_used_elem(vq, head, len);
+            virt_queue__set_used_elem_in_order(vq, head, len);
         }
 
-        if (virtio_queue__should_signal(vq))
-            ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+        if (ndev->ops->tx_flush)
+            ndev->ops->tx_flush(queue);
+        virt_queue__flush_used_in_order(vq);
+        virtio_queue__signal(kvm, &ndev->vdev, vq, queue->id);
     }
 
 out_err:
@@ -191,14 +345,133 @@ out_err:
     return NULL;
 }
 
-static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm *kvm, struct net_dev *ndev,
-                                                struct virtio_net_ctrl_hdr *ctrl) {
-    /* Not much to do here */
+static int virtio_net__tap_set_queues(struct net_dev *ndev, int nr_queues);
+
+/* Have the backend steer flows only to the first pairs queues, which the guest polls */
+static int virtio_net_set_queues(struct net_dev *ndev, u16 pairs) {
+    if (ndev->mode == NET_MODE_TAP)
+        return virtio_net__tap_set_queues(ndev, pairs);
+
+    if (ndev->mode == NET_MODE_USER)
+        uip_set_queues(&ndev->info, pairs);
+
+    /* Frames of queues without a socket in the map go to the host */
+    for (u32 i = 0; ndev->mode == NET_MODE_XDP && i < ndev->queue_pairs; i++) {
+        int r = af_xdp_steer(&ndev->xsks[i], &ndev->xdp_prog, i, i < pairs);
+
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static void virtio_net_steer(struct net_dev *ndev) {
+    int r;
+
+    if (ndev->mode != NET_MODE_PACKET || ndev->queue_pairs == 1)
+        return;
+
+    r = af_packet_steer(&ndev->packets[0], &ndev->rss);
+    if (r < 0)
+        pr_warning("Unable to steer packet socket frames (%d)", r);
+}
+
+/*
+ * Both commands carry the hash types and the key, VIRTIO_NET_CTRL_MQ_RSS_CONFIG
+ * an indirection table and the number of pairs in use as well. Entries
+ * point to the receive queue of a pair.
+ */
+static virtio_net_ctrl_ack virtio_net_handle_rss(struct net_dev *ndev, struct virtio_net_ctrl_hdr *ctrl,
+                                                 struct iovec *iov, size_t iovcount) {
+    struct {
+        __le32 hash_types;
+        __le16 table_mask;
+        __le16 unclassified;
+    } __attribute__((packed)) rss;
+    struct {
+        __le16 max_tx_vq;
+        u8 key_len;
+    } __attribute__((packed)) tail;
+    u16 table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    u8 key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    u16 i, table_len = 1, pairs = 0;
+
+    if (memcpy_fromiovec_safe(&rss, &iov, sizeof(rss), &iovcount))
+        return VIRTIO_NET_ERR;
+
+    if (ctrl->cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        table_len = le16_to_cpu(rss.table_mask) + 1;
+        if (!has_virtio_feature(ndev, VIRTIO_NET_F_RSS) || table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (table_len & (table_len - 1)))
+            return VIRTIO_NET_ERR;
+    } else if (!has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* The hash config has reserved fields where a one entry table and max_tx_vq would be */
+    if (memcpy_fromiovec_safe(table, &iov, table_len * sizeof(*table), &iovcount) ||
+        memcpy_fromiovec_safe(&tail, &iov, sizeof(tail), &iovcount) || tail.key_len > sizeof(key) ||
+        memcpy_fromiovec_safe(key, &iov, tail.key_len, &iovcount))
+        return VIRTIO_NET_ERR;
+
+    if (ctrl->cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        virtio_net_rss_configure(&ndev->rss, le32_to_cpu(rss.hash_types), key, tail.key_len, NULL, 0, 0);
+        virtio_net_steer(ndev);
+        return VIRTIO_NET_OK;
+    }
+
+    pairs = le16_to_cpu(tail.max_tx_vq);
+    if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > ndev->queue_pairs ||
+        le16_to_cpu(rss.unclassified) >= pairs)
+        return VIRTIO_NET_ERR;
+
+    for (i = 0; i < table_len; i++) {
+        table[i] = le16_to_cpu(table[i]);
+        if (table[i] >= pairs)
+            return VIRTIO_NET_ERR;
+    }
+
+    if (virtio_net_set_queues(ndev, pairs) < 0)
+        return VIRTIO_NET_ERR;
+
+    virtio_net_rss_configure(&ndev->rss, le32_to_cpu(rss.hash_types), key, tail.key_len, table, table_len,
+                             le16_to_cpu(rss.unclassified));
+    virtio_net_steer(ndev);
+
+    return VIRTIO_NET_OK;
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm *kvm, struct net_dev *ndev, struct virtio_net_ctrl_hdr *ctrl,
+                                                struct iovec *iov, size_t iovcount) {
+    struct virtio_net_ctrl_mq mq;
+    u16 pairs;
+
+    if (ctrl->cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG || ctrl->cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG)
+        return virtio_net_handle_rss(ndev, ctrl, iov, iovcount);
+
+    if (ctrl->cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)
+        return VIRTIO_NET_ERR;
+
+    if (memcpy_fromiovec_safe(&mq, &iov, sizeof(mq), &iovcount))
+        return VIRTIO_NET_ERR;
+
+    pairs = virtio_guest_to_host_u16(ndev->vdev.endian, mq.virtqueue_pairs);
+    if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > ndev->queue_pairs)
+        return VIRTIO_NET_ERR;
+
+    if (virtio_net_set_queues(ndev, pairs) < 0)
+        return VIRTIO_NET_ERR;
+
+    /* Any table of the guest may point to queues it no longer uses */
+    virtio_net_rss_spread(&ndev->rss, pairs);
+    virtio_net_steer(ndev);
+
     return VIRTIO_NET_OK;
 }
 
 static void *virtio_net_ctrl_thread(void *p) {
-    struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+    struct iovec iov[VIRTIO_NET_QUEUE_SIZE], *cmd_iov;
     struct net_dev_queue *queue = p;
     struct virt_queue *vq = &queue->vq;
     struct net_dev *ndev = queue->ndev;
@@ -206,7 +479,7 @@ static void *virtio_net_ctrl_thread(void *p) {
     struct kvm *kvm = ndev->kvm;
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack ack;
-    size_t len;
+    size_t iovcount;
 
     kvm_set_thread_name("virtio-net-ctrl");
 
@@ -218,23 +491,25 @@ static void *virtio_net_ctrl_thread(void *p) {
 
         while (virt_queue__available(vq)) {
             head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-            len = min(iov_size(iov, in), sizeof(ctrl));
-            memcpy_fromiovec((void *)&ctrl, iov, len);
+            cmd_iov = iov;
+            iovcount = out;
+            if (memcpy_fromiovec_safe(&ctrl, &cmd_iov, sizeof(ctrl), &iovcount))
+                ctrl.class = -1;
 
             switch (ctrl.class) {
                 case VIRTIO_NET_CTRL_MQ:
-                    ack = virtio_net_handle_mq(kvm, ndev, &ctrl);
+                    ack = virtio_net_handle_mq(kvm, ndev, &ctrl, cmd_iov, iovcount);
                     break;
                 default:
                     ack = VIRTIO_NET_ERR;
                     break;
             }
-            memcpy_toiovec(iov + in, &ack, sizeof(ack));
+            /* The ack is the first device-writable buffer */
+            memcpy_toiovec(iov + out, &ack, sizeof(ack));
             virt_queue__set_used_elem(vq, head, sizeof(ack));
         }
 
-        if (virtio_queue__should_signal(vq))
-            ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+        virtio_queue__signal(kvm, &ndev->vdev, vq, queue->id);
     }
 
     pthread_exit(NULL);
@@ -255,15 +530,17 @@ static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, in
     mutex_unlock(&net_queue->lock);
 }
 
-static int virtio_net_request_tap(struct net_dev *ndev, struct ifreq *ifr, const char *tapname) {
+static int virtio_net_request_tap(struct net_dev *ndev, int fd, struct ifreq *ifr, const char *tapname) {
     int ret;
 
     memset(ifr, 0, sizeof(*ifr));
     ifr->ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (ndev->nr_tap_fds > 1)
+        ifr->ifr_flags |= IFF_MULTI_QUEUE;
     if (tapname)
         strlcpy(ifr->ifr_name, tapname, sizeof(ifr->ifr_name));
 
-    ret = ioctl(ndev->tap_fd, TUNSETIFF, ifr);
+    ret = ioctl(fd, TUNSETIFF, ifr);
 
     if (ret >= 0)
         strlcpy(ndev->tap_name, ifr->ifr_name, sizeof(ndev->tap_name));
@@ -288,17 +565,68 @@ static int virtio_net_exec_script(const char *script, const char *tap_name) {
     return 0;
 }
 
+static void virtio_net__tap_close(struct net_dev *ndev, int nr_fds) {
+    int i;
+
+    /* Leave a descriptor handed over by the user alone */
+    if (ndev->params->fd)
+        return;
+
+    for (i = 0; i < nr_fds; i++) close(ndev->tap_fds[i]);
+}
+
+/*
+ * Keep only the TAP queues of the pairs the guest uses attached, so that the
+ * host doesn't steer flows to queues nobody posts buffers for.
+ */
+static int virtio_net__tap_set_queues(struct net_dev *ndev, int nr_queues) {
+    struct net_dev_queue *queue;
+    struct ifreq ifr;
+
+    while (ndev->tap_queues != nr_queues) {
+        bool attach = ndev->tap_queues < nr_queues;
+        int fd = ndev->tap_fds[attach ? ndev->tap_queues : ndev->tap_queues - 1];
+
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+        if (ioctl(fd, TUNSETQUEUE, &ifr) < 0) {
+            pr_warning("Unable to %s TAP queue", attach ? "attach" : "detach");
+            return -errno;
+        }
+        ndev->tap_queues += attach ? 1 : -1;
+
+        /* Wake up the RX thread of the pair, idle while it was detached */
+        if (attach && !ndev->vdev.use_vhost) {
+            queue = &ndev->queues[(ndev->tap_queues - 1) * 2];
+            if (queue->ndev) {
+                mutex_lock(&queue->lock);
+                pthread_cond_signal(&queue->cond);
+                mutex_unlock(&queue->lock);
+            }
+        }
+    }
+
+    return 0;
+}
+
 static bool virtio_net__tap_init(struct net_dev *ndev) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
-    int hdr_len;
+    int hdr_len, i;
     struct sockaddr_in sin = {0};
     struct ifreq ifr;
     const struct virtio_net_params *params = ndev->params;
     bool skipconf = !!params->tapif;
 
+    /* macvtap keeps the header size per queue */
     hdr_len = virtio_net_hdr_len(ndev);
-    if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
-        pr_warning("Config tap device TUNSETVNETHDRSZ error");
+    for (i = 0; i < ndev->nr_tap_fds; i++) {
+        if (ioctl(ndev->tap_fds[i], TUNSETVNETHDRSZ, &hdr_len) < 0)
+            pr_warning("Config tap device TUNSETVNETHDRSZ error");
+    }
+
+    /* Only the first pair is in use until the guest enables more */
+    if (virtio_net__tap_set_queues(ndev, 1) < 0)
+        goto fail;
 
     if (strcmp(params->script, "none")) {
         if (virtio_net_exec_script(params->script, ndev->tap_name) < 0)
@@ -331,8 +659,7 @@ static bool virtio_net__tap_init(struct net_dev *ndev) {
 fail:
     if (sock >= 0)
         close(sock);
-    if (ndev->tap_fd >= 0)
-        close(ndev->tap_fd);
+    virtio_net__tap_close(ndev, ndev->nr_tap_fds);
 
     return 0;
 }
@@ -354,32 +681,52 @@ static void virtio_net__tap_exit(struct net_dev *ndev) {
 }
 
 static bool virtio_net__tap_create(struct net_dev *ndev) {
-    int offload;
+    int offload, nr_open = 0;
     struct ifreq ifr;
     const struct virtio_net_params *params = ndev->params;
     bool macvtap = (!!params->tapif) && (params->tapif[0] == '/');
+    const char *tap_file = "/dev/net/tun";
+
+    /*
+     * Every queue pair gets a TAP queue of its own, served by its own RX/TX
+     * threads or vhost-net instance.
+     */
+    ndev->nr_tap_fds = ndev->queue_pairs;
 
     /* Did the user already gave us the FD? */
-    if (params->fd)
-        ndev->tap_fd = params->fd;
-    else {
-        const char *tap_file = "/dev/net/tun";
+    if (params->fd) {
+        if (ndev->nr_tap_fds > 1) {
+            pr_warning("A single TAP fd was given, disabling multiqueue");
+            ndev->queue_pairs = ndev->nr_tap_fds = 1;
+        }
+        ndev->tap_fds[0] = params->fd;
+        nr_open = 1;
+    }
 
-        /* Did the user ask us to use macvtap? */
-        if (macvtap)
-            tap_file = params->tapif;
+    /* Did the user ask us to use macvtap? */
+    if (macvtap)
+        tap_file = params->tapif;
 
-        ndev->tap_fd = open(tap_file, O_RDWR);
-        if (ndev->tap_fd < 0) {
+    for (; nr_open < ndev->nr_tap_fds; nr_open++) {
+        ndev->tap_fds[nr_open] = open(tap_file, O_RDWR);
+        if (ndev->tap_fds[nr_open] < 0) {
             pr_warning("Unable to open %s", tap_file);
-            return 0;
+            goto fail;
         }
     }
 
-    if (!macvtap && virtio_net_request_tap(ndev, &ifr, params->tapif) < 0) {
-        pr_warning("Config tap device error. Are you root?");
-        goto fail;
+    /*
+     * The first queue creates the interface, or attaches to the one the
+     * user named, and the others join it. macvtap queues are attached by
+     * opening its character device again.
+     */
+    for (int i = 0; !macvtap && i < ndev->nr_tap_fds; i++) {
+        if (virtio_net_request_tap(ndev, ndev->tap_fds[i], &ifr, i ? ndev->tap_name : params->tapif) < 0) {
+            pr_warning("Config tap device error. Are you root?");
+            goto fail;
+        }
     }
+    ndev->tap_queues = ndev->nr_tap_fds;
 
     /*
      * The UFO support had been removed from kernel in commit:
@@ -391,13 +738,13 @@ static bool virtio_net__tap_create(struct net_dev *ndev) {
      */
     ndev->tap_ufo = true;
     offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO;
-    if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+    if (ioctl(ndev->tap_fds[0], TUNSETOFFLOAD, offload) < 0) {
         /*
          * Is this failure caused by kernel remove the UFO support?
          * Try TUNSETOFFLOAD without TUN_F_UFO.
          */
         offload &= ~TUN_F_UFO;
-        if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+        if (ioctl(ndev->tap_fds[0], TUNSETOFFLOAD, offload) < 0) {
             pr_warning("Config tap device TUNSETOFFLOAD error");
             goto fail;
         }
@@ -407,26 +754,53 @@ static bool virtio_net__tap_create(struct net_dev *ndev) {
     return 1;
 
 fail:
-    if ((ndev->tap_fd >= 0) || (!params->fd))
-        close(ndev->tap_fd);
+    virtio_net__tap_close(ndev, nr_open);
 
     return 0;
 }
 
-static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev) {
-    return writev(ndev->tap_fd, iov, out);
+static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue) {
+    return writev(queue->ndev->tap_fds[queue->id / 2], iov, out);
+}
+
+static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue) {
+    return readv(queue->ndev->tap_fds[queue->id / 2], iov, in);
+}
+
+static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue) {
+    return uip_tx(iov, out, &queue->ndev->info);
+}
+
+static inline void uip_ops_tx_flush(struct net_dev_queue *queue) {
+    uip_tx_flush(&queue->ndev->info);
+}
+
+static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue) {
+    return uip_rx(iov, in, &queue->ndev->info, queue->id / 2);
+}
+
+static inline int packet_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue) {
+    return af_packet_tx(iov, out, &queue->ndev->packets[queue->id / 2]);
 }
 
-static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev) {
-    return readv(ndev->tap_fd, iov, in);
+static inline int packet_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue) {
+    return af_packet_rx(iov, in, &queue->ndev->packets[queue->id / 2]);
 }
 
-static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev) {
-    return uip_tx(iov, out, &ndev->info);
+static inline void packet_ops_tx_flush(struct net_dev_queue *queue) {
+    af_packet_tx_flush(&queue->ndev->packets[queue->id / 2]);
 }
 
-static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev) {
-    return uip_rx(iov, in, &ndev->info);
+static inline int xdp_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue) {
+    return af_xdp_tx(iov, out, &queue->ndev->xsks[queue->id / 2]);
+}
+
+static inline int xdp_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue) {
+    return af_xdp_rx(iov, in, &queue->ndev->xsks[queue->id / 2]);
+}
+
+static inline void xdp_ops_tx_flush(struct net_dev_queue *queue) {
+    af_xdp_tx_flush(&queue->ndev->xsks[queue->id / 2]);
 }
 
 static struct net_dev_operations tap_ops = {
@@ -437,6 +811,19 @@ static struct net_dev_operations tap_ops = {
 static struct net_dev_operations uip_ops = {
     .rx = uip_ops_rx,
     .tx = uip_ops_tx,
+    .tx_flush = uip_ops_tx_flush,
+};
+
+static struct net_dev_operations packet_ops = {
+    .rx = packet_ops_rx,
+    .tx = packet_ops_tx,
+    .tx_flush = packet_ops_tx_flush,
+};
+
+static struct net_dev_operations xdp_ops = {
+    .rx = xdp_ops_rx,
+    .tx = xdp_ops_tx,
+    .tx_flush = xdp_ops_tx_flush,
 };
 
 static u8 *get_config(struct kvm *kvm, void *dev) {
@@ -459,7 +846,7 @@ static u64 get_host_features(struct kvm *kvm, void *dev) {
                1UL << VIRTIO_NET_F_HOST_TSO6 | 1UL << VIRTIO_NET_F_GUEST_TSO4 | 1UL << VIRTIO_NET_F_GUEST_TSO6 |
                1UL << VIRTIO_RING_F_EVENT_IDX | 1UL << VIRTIO_RING_F_INDIRECT_DESC | 1UL << VIRTIO_NET_F_CTRL_VQ |
                1UL << VIRTIO_NET_F_MRG_RXBUF | 1UL << (ndev->queue_pairs > 1 ? VIRTIO_NET_F_MQ : 0) |
-               1UL << VIRTIO_F_ANY_LAYOUT;
+               1UL << VIRTIO_F_ANY_LAYOUT | 1ULL << VIRTIO_F_IN_ORDER;
 
     /*
      * The UFO feature for host and guest only can be enabled when the
@@ -468,30 +855,90 @@ static u64 get_host_features(struct kvm *kvm, void *dev) {
     if (ndev->tap_ufo)
         features |= (1UL << VIRTIO_NET_F_HOST_UFO | 1UL << VIRTIO_NET_F_GUEST_UFO);
 
-    if (ndev->vhost_fd) {
-        u64 vhost_features;
+    if (ndev->mode == NET_MODE_VHOST_USER)
+        features &= ndev->vhost_user.features | VIRTIO_NET_VHOST_USER_LOCAL_FEATURES;
+    else if (ndev->mode == NET_MODE_PACKET)
+        features = (features & ~VIRTIO_NET_PACKET_OFFLOADS) | 1ULL << VIRTIO_NET_F_GUEST_CSUM;
+    else if (ndev->mode == NET_MODE_XDP)
+        features &= ~VIRTIO_NET_PACKET_OFFLOADS;
+    else if (ndev->vdev.use_vhost)
+        features &= ndev->vhost_features | ~VIRTIO_NET_VHOST_FEATURES;
+    else if (ndev->mode == NET_MODE_USER)
+        features |= 1ULL << VIRTIO_NET_F_GUEST_CSUM;
+
+    /* Only user mode and packet sockets choose the queue of a frame */
+    if (!ndev->vdev.use_vhost) {
+        features |= 1ULL << VIRTIO_NET_F_HASH_REPORT;
+        if (ndev->queue_pairs > 1 && (ndev->mode == NET_MODE_USER || ndev->mode == NET_MODE_PACKET))
+            features |= 1ULL << VIRTIO_NET_F_RSS;
+    }
 
-        if (ioctl(ndev->vhost_fd, VHOST_GET_FEATURES, &vhost_features) != 0)
-            die_perror("VHOST_GET_FEATURES failed");
+    return features;
+}
 
-        features &= vhost_features;
+/* Smallest mergeable RX buffer the spec has drivers post, a whole frame */
+#define VIRTIO_NET_MIN_MRG_BUF 1526
+
+/*
+ * Whether the RX rings hold a whole GSO frame, even when the guest posts
+ * the smallest mergeable buffers. Frames the ring can't hold are dropped,
+ * and user mode can't send them again.
+ */
+static bool virtio_net_rx_fits_gso(struct net_dev *ndev) {
+    size_t max_len = virtio_net_hdr_len(ndev) + MAX_PACKET_SIZE;
+    struct virt_queue *vq;
+    u32 i;
+
+    if (!has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF))
+        return true;
+
+    for (i = 0; i < ndev->queue_pairs; i++) {
+        vq = &ndev->queues[i * 2].vq;
+        if (vq->enabled && (size_t)vq->vring.num * VIRTIO_NET_MIN_MRG_BUF < max_len)
+            return false;
     }
 
-    return features;
+    return true;
 }
 
 static void virtio_net_start(struct net_dev *ndev) {
     /* VHOST_NET_F_VIRTIO_NET_HDR clashes with VIRTIO_F_ANY_LAYOUT! */
     u64 features = ndev->vdev.features & ~(1UL << VHOST_NET_F_VIRTIO_NET_HDR);
+    u32 i;
+
+    /* Only the first pair is in use until the guest enables more */
+    virtio_net_rss_reset(&ndev->rss, 1);
+    virtio_net_steer(ndev);
 
     if (ndev->mode == NET_MODE_TAP) {
         if (!virtio_net__tap_init(ndev))
             die_perror("TAP device initialized failed because");
 
-        if (ndev->vhost_fd && virtio_vhost_set_features(ndev->vhost_fd, features))
-            die_perror("VHOST_SET_FEATURES failed");
+        for (i = 0; ndev->vdev.use_vhost && i < ndev->queue_pairs; i++) {
+            if (virtio_vhost_set_features(ndev->vhost_fds[i], features & ndev->vhost_features))
+                die_perror("VHOST_SET_FEATURES failed");
+        }
+    } else if (ndev->mode == NET_MODE_VHOST_USER) {
+        /*
+         * Only vhost-net reuses bit 27 for VHOST_NET_F_VIRTIO_NET_HDR, a
+         * vhost-user backend gets VIRTIO_F_ANY_LAYOUT as negotiated.
+         */
+        virtio_vhost_user_start(ndev->kvm, &ndev->vhost_user, ndev->vdev.features);
+    } else if (ndev->mode == NET_MODE_PACKET) {
+        for (i = 0; i < ndev->queue_pairs; i++) {
+            ndev->packets[i].vnet_hdr_len = virtio_net_hdr_len(ndev);
+            ndev->packets[i].endian = ndev->vdev.endian;
+            ndev->packets[i].guest_csum = has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_CSUM);
+        }
+    } else if (ndev->mode == NET_MODE_XDP) {
+        for (i = 0; i < ndev->queue_pairs; i++) ndev->xsks[i].vnet_hdr_len = virtio_net_hdr_len(ndev);
     } else {
         ndev->info.vnet_hdr_len = virtio_net_hdr_len(ndev);
+        ndev->info.endian = ndev->vdev.endian;
+        ndev->info.guest_csum = has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_CSUM);
+        ndev->info.guest_tso = ndev->info.guest_csum && has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO4) &&
+                               virtio_net_rx_fits_gso(ndev);
+        ndev->info.rss = &ndev->rss;
         uip_init(&ndev->info);
     }
 }
@@ -500,7 +947,7 @@ static void virtio_net_stop(struct net_dev *ndev) {
     /* Undo whatever start() did */
     if (ndev->mode == NET_MODE_TAP)
         virtio_net__tap_exit(ndev);
-    else
+    else if (ndev->mode == NET_MODE_USER)
         uip_exit(&ndev->info);
 }
 
@@ -523,9 +970,11 @@ static void virtio_net_update_endian(struct net_dev *ndev) {
             disable_req = TUNSETVNETLE;
         }
 
-        ioctl(ndev->tap_fd, disable_req, &disable_val);
-        if (ioctl(ndev->tap_fd, enable_req, &enable_val) < 0)
-            ERR("Config tap device TUNSETVNETLE/BE error");
+        for (int i = 0; i < ndev->nr_tap_fds; i++) {
+            ioctl(ndev->tap_fds[i], disable_req, &disable_val);
+            if (ioctl(ndev->tap_fds[i], enable_req, &enable_val) < 0)
+                ERR("Config tap device TUNSETVNETLE/BE error");
+        }
     }
 }
 
@@ -546,7 +995,8 @@ static bool is_ctrl_vq(struct net_dev *ndev, u32 vq) {
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
-    struct vhost_vring_file file = {.index = vq};
+    /* vhost-net instances only know about the RX/TX queues of their pair */
+    struct vhost_vring_file file = {.index = vq % 2};
     struct net_dev_queue *net_queue;
     struct net_dev *ndev = dev;
     struct virt_queue *queue;
@@ -566,19 +1016,25 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
         pthread_create(&net_queue->thread, NULL, virtio_net_ctrl_thread, net_queue);
 
         return 0;
-    } else if (ndev->vhost_fd == 0) {
+    } else if (!ndev->vdev.use_vhost) {
         if (vq & 1)
             pthread_create(&net_queue->thread, NULL, virtio_net_tx_thread, net_queue);
         else
             pthread_create(&net_queue->thread, NULL, virtio_net_rx_thread, net_queue);
 
+        return 0;
+    } else if (ndev->mode == NET_MODE_VHOST_USER) {
+        virtio_vhost_user_set_vring(kvm, &ndev->vhost_user, vq, queue);
+
         return 0;
     }
 
-    virtio_vhost_set_vring(kvm, ndev->vhost_fd, vq, queue);
+    virtio_vhost_set_vring(kvm, ndev->vhost_fds[vq / 2], file.index, queue);
+    /* The IRQ worker signals the queue with its device-wide index */
+    queue->index = vq;
 
-    file.fd = ndev->tap_fd;
-    r = ioctl(ndev->vhost_fd, VHOST_NET_SET_BACKEND, &file);
+    file.fd = ndev->tap_fds[vq / 2];
+    r = ioctl(ndev->vhost_fds[vq / 2], VHOST_NET_SET_BACKEND, &file);
     if (r < 0)
         die_perror("VHOST_NET_SET_BACKEND failed");
 
@@ -589,18 +1045,25 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq) {
     struct net_dev *ndev = dev;
     struct net_dev_queue *queue = &ndev->queues[vq];
 
-    virtio_vhost_reset_vring(kvm, ndev->vhost_fd, vq, &queue->vq);
-
     /*
      * TODO: vhost reset owner. It's the only way to cleanly stop vhost, but
      * we can't restart it at the moment.
      */
-    if (ndev->vhost_fd && !is_ctrl_vq(ndev, vq)) {
+    if (ndev->mode == NET_MODE_VHOST_USER && !is_ctrl_vq(ndev, vq)) {
+        virtio_vhost_user_reset_vring(kvm, &ndev->vhost_user, vq);
+        return;
+    }
+
+    if (ndev->vdev.use_vhost && !is_ctrl_vq(ndev, vq)) {
+        virtio_vhost_reset_vring(kvm, ndev->vhost_fds[vq / 2], vq % 2, &queue->vq);
         pr_warning("Cannot reset VHOST queue");
-        ioctl(ndev->vhost_fd, VHOST_RESET_OWNER);
+        ioctl(ndev->vhost_fds[vq / 2], VHOST_RESET_OWNER);
         return;
     }
 
+    if (queue->nr_dropped)
+        pr_debug("vq %u: %llu frames too large for the ring dropped", vq, queue->nr_dropped);
+
     /*
      * Threads are waiting on cancellation points (readv or
      * pthread_cond_wait) and should stop gracefully.
@@ -613,7 +1076,7 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi) {
     struct net_dev *ndev = dev;
     struct net_dev_queue *queue = &ndev->queues[vq];
 
-    if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+    if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
         return;
 
     virtio_vhost_set_vring_irqfd(kvm, gsi, &queue->vq);
@@ -622,10 +1085,15 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi) {
 static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd) {
     struct net_dev *ndev = dev;
 
-    if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+    if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
         return;
 
-    virtio_vhost_set_vring_kick(kvm, ndev->vhost_fd, vq, efd);
+    if (ndev->mode == NET_MODE_VHOST_USER) {
+        virtio_vhost_user_set_vring_kick(&ndev->vhost_user, vq, efd);
+        return;
+    }
+
+    virtio_vhost_set_vring_kick(kvm, ndev->vhost_fds[vq / 2], vq % 2, efd);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq) {
@@ -675,16 +1143,24 @@ static struct virtio_ops net_dev_virtio_ops = {
 };
 
 static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev) {
-    if (ndev->queue_pairs > 1) {
-        pr_warning("multiqueue is not supported with vhost yet");
+    u32 i;
+
+    if (ndev->mode != NET_MODE_TAP) {
+        pr_warning("vhost-net requires a TAP backend");
         return;
     }
 
-    ndev->vhost_fd = open("/dev/vhost-net", O_RDWR);
-    if (ndev->vhost_fd < 0)
-        die_perror("Failed openning vhost-net device");
+    /* One vhost-net instance per queue pair, each with its own worker */
+    for (i = 0; i < ndev->queue_pairs; i++) {
+        ndev->vhost_fds[i] = open("/dev/vhost-net", O_RDWR);
+        if (ndev->vhost_fds[i] < 0)
+            die_perror("Failed openning vhost-net device");
+
+        virtio_vhost_init(kvm, ndev->vhost_fds[i]);
+    }
 
-    virtio_vhost_init(kvm, ndev->vhost_fd);
+    if (ioctl(ndev->vhost_fds[0], VHOST_GET_FEATURES, &ndev->vhost_features) != 0)
+        die_perror("VHOST_GET_FEATURES failed");
 
     ndev->vdev.use_vhost = true;
 }
@@ -705,11 +1181,15 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p, const cha
             p->mode = NET_MODE_USER;
         } else if (!strncmp(val, "tap", 3)) {
             p->mode = NET_MODE_TAP;
+        } else if (!strncmp(val, "packet", 6)) {
+            p->mode = NET_MODE_PACKET;
+        } else if (!strncmp(val, "xdp", 3)) {
+            p->mode = NET_MODE_XDP;
         } else if (!strncmp(val, "none", 4)) {
             kvm->cfg.no_net = 1;
             return -1;
         } else
-            die("Unknown network mode %s, please use user, tap or none", kvm->cfg.network);
+            die("Unknown network mode %s, please use user, tap, packet, xdp or none", kvm->cfg.network);
     } else if (strcmp(param, "script") == 0) {
         p->script = strdup(val);
     } else if (strcmp(param, "downscript") == 0) {
@@ -722,6 +1202,8 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p, const cha
         p->trans = strdup(val);
     } else if (strcmp(param, "tapif") == 0) {
         p->tapif = strdup(val);
+    } else if (strcmp(param, "ifname") == 0) {
+        p->ifname = strdup(val);
     } else if (strcmp(param, "vhost") == 0) {
         p->vhost = atoi(val);
     } else if (strcmp(param, "fd") == 0) {
@@ -787,7 +1269,7 @@ static int virtio_net__init_one(struct virtio_net_params *params) {
     enum virtio_trans trans = params->kvm->cfg.virtio_transport;
     struct net_dev *ndev;
     struct virtio_ops *ops;
-    int i, r;
+    int i, r, fanout_id;
 
     ndev = calloc(1, sizeof(struct net_dev));
     if (ndev == NULL)
@@ -811,11 +1293,49 @@ static int virtio_net__init_one(struct virtio_net_params *params) {
         ndev->info.host_mac.addr[i] = params->host_mac[i];
     }
 
+    virtio_net_rss_init(&ndev->rss);
+    ndev->config.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    ndev->config.rss_max_indirection_table_length = cpu_to_le16(VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    ndev->config.supported_hash_types = cpu_to_le32(VIRTIO_NET_RSS_HASH_TYPES);
+
     ndev->mode = params->mode;
     if (ndev->mode == NET_MODE_TAP) {
         ndev->ops = &tap_ops;
         if (!virtio_net__tap_create(ndev))
             die_perror("You have requested a TAP device, but creation of one has failed because");
+    } else if (ndev->mode == NET_MODE_VHOST_USER) {
+        virtio_vhost_user_init(params->kvm, &ndev->vhost_user, params->vhost_user);
+        ndev->queue_pairs = min(ndev->queue_pairs, max(1U, ndev->vhost_user.max_queues));
+        ndev->vdev.use_vhost = true;
+    } else if (ndev->mode == NET_MODE_PACKET) {
+        ndev->ops = &packet_ops;
+        if (!params->ifname)
+            die("Packet socket networking requires a host interface");
+
+        /* The queues of a device form a fanout group, steering flows over them */
+        for (i = 0, fanout_id = -1; i < (int)ndev->queue_pairs; i++) {
+            r = af_packet_init(&ndev->packets[i], params->ifname, ndev->queue_pairs > 1 ? &fanout_id : NULL);
+            if (r < 0) {
+                errno = -r;
+                die_perror("Unable to open a packet socket because");
+            }
+        }
+        virtio_net_steer(ndev);
+    } else if (ndev->mode == NET_MODE_XDP) {
+        ndev->ops = &xdp_ops;
+        if (!params->ifname)
+            die("XDP socket networking requires a host interface");
+
+        ndev->queue_pairs = min_t(u32, ndev->queue_pairs, af_xdp_nr_queues(params->ifname));
+        r = af_xdp_prog_attach(&ndev->xdp_prog, params->ifname, ndev->queue_pairs);
+        for (i = 0; r >= 0 && i < (int)ndev->queue_pairs; i++)
+            r = af_xdp_init(&ndev->xsks[i], &ndev->xdp_prog, params->ifname, i);
+        if (r < 0) {
+            errno = -r;
+            die_perror("Unable to set up XDP sockets because");
+        }
+        if (!ndev->xsks[0].zerocopy)
+            pr_warning("%s: no zero-copy XDP support, copying frames", params->ifname);
     } else {
         ndev->info.host_ip = ntohl(inet_addr(params->host_ip));
         ndev->info.guest_ip = ntohl(inet_addr(params->guest_ip));
@@ -877,6 +1397,19 @@ int virtio_net__init(struct kvm *kvm) {
         str_to_mac(kvm->cfg.guest_mac, net_params.guest_mac);
         str_to_mac(kvm->cfg.host_mac, net_params.host_mac);
 
+        if (kvm->cfg.vhost_user_net) {
+            net_params.mode = NET_MODE_VHOST_USER;
+            net_params.vhost_user = kvm->cfg.vhost_user_net;
+        } else if (kvm->cfg.net_packet) {
+            net_params.mode = NET_MODE_PACKET;
+            net_params.ifname = kvm->cfg.net_packet;
+            net_params.mq = kvm->cfg.nrcpus;
+        } else if (kvm->cfg.net_xdp) {
+            net_params.mode = NET_MODE_XDP;
+            net_params.ifname = kvm->cfg.net_xdp;
+            net_params.mq = kvm->cfg.nrcpus;
+        }
+
         r = virtio_net__init_one(&net_params);
         if (r < 0)
             goto cleanup;
@@ -905,6 +1438,14 @@ int virtio_net__exit(struct kvm *kvm) {
 
         list_del(&ndev->list);
         virtio_exit(kvm, &ndev->vdev);
+        if (ndev->mode == NET_MODE_VHOST_USER)
+            virtio_vhost_user_exit(&ndev->vhost_user);
+        for (u32 i = 0; ndev->mode == NET_MODE_PACKET && i < ndev->queue_pairs; i++)
+            af_packet_exit(&ndev->packets[i]);
+        for (u32 i = 0; ndev->mode == NET_MODE_XDP && i < ndev->queue_pairs; i++)
+            af_xdp_exit(&ndev->xsks[i]);
+        if (ndev->mode == NET_MODE_XDP)
+            af_xdp_prog_detach(&ndev->xdp_prog);
         free(ndev);
     }
 
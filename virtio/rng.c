@@ -8,6 +8,7 @@
 #include <sys/types.h>
 
 #include "kvm/guest_compat.h"
+#include "kvm/iovec.h"
 #include "kvm/kvm.h"
 #include "kvm/threadpool.h"
 #include "kvm/util.h"
@@ -48,8 +49,7 @@ static size_t get_config_size(struct kvm *kvm, void *dev) {
 }
 
 static u64 get_host_features(struct kvm *kvm, void *dev) {
-    /* Unused */
-    return 0;
+    return 1ULL << VIRTIO_F_IN_ORDER;
 }
 
 static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev, struct virt_queue *queue) {
@@ -74,7 +74,13 @@ static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev, stru
             return false;
     }
 
-    virt_queue__set_used_elem(queue, head, len);
+    /* A short read cannot be folded into an in-order batch */
+    if ((size_t)len == iov_size(iov, in)) {
+        virt_queue__set_used_elem_in_order(queue, head, len);
+    } else {
+        virt_queue__flush_used_in_order(queue);
+        virt_queue__set_used_elem(queue, head, len);
+    }
 
     return true;
 }
@@ -85,8 +91,9 @@ static void virtio_rng_do_io(struct kvm *kvm, void *param) {
     struct rng_dev *rdev = job->rdev;
 
     while (virt_queue__available(vq)) virtio_rng_do_io_request(kvm, rdev, vq);
+    virt_queue__flush_used_in_order(vq);
 
-    rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
+    virtio_queue__signal(kvm, &rdev->vdev, vq, vq - rdev->vqs);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq) {
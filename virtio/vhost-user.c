@@ -0,0 +1,313 @@
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "kvm/kvm.h"
+#include "kvm/read-write.h"
+#include "kvm/virtio.h"
+
+#define VHOST_USER_PROTOCOL_FEATURES \
+    (1ULL << VHOST_USER_PROTOCOL_F_MQ | 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK | 1ULL << VHOST_USER_PROTOCOL_F_CONFIG)
+
+static int vhost_user_send(struct virtio_vhost_user *vu, struct vhost_user_msg *msg, int *fds, int nr_fds) {
+    char control[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))] = {};
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = sizeof(msg->hdr) + msg->hdr.size,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    if (nr_fds) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        if (!cmsg)
+            return -EINVAL;
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+    }
+
+    do {
+        r = sendmsg(vu->sock, &mh, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0)
+        return -errno;
+    if (r != (ssize_t)iov.iov_len)
+        return -EIO;
+
+    return 0;
+}
+
+static void vhost_user_recv(struct virtio_vhost_user *vu, struct vhost_user_msg *msg, u32 request) {
+    if (read_in_full(vu->sock, &msg->hdr, sizeof(msg->hdr)) != sizeof(msg->hdr))
+        die("vhost-user: backend closed the connection");
+
+    if (msg->hdr.request != request || !(msg->hdr.flags & VHOST_USER_REPLY_MASK) ||
+        msg->hdr.size > sizeof(msg->payload))
+        die("vhost-user: invalid reply to request %u", request);
+
+    if (read_in_full(vu->sock, &msg->payload, msg->hdr.size) != (ssize_t)msg->hdr.size)
+        die("vhost-user: short reply to request %u", request);
+}
+
+/*
+ * Send a request and wait for its reply if it has one. Other requests are
+ * acknowledged by the backend when REPLY_ACK was negotiated, so that errors
+ * are not silently ignored.
+ */
+static void vhost_user_xfer(struct virtio_vhost_user *vu, struct vhost_user_msg *msg, int *fds, int nr_fds,
+                            bool reply) {
+    u32 request = msg->hdr.request;
+    bool ack = !reply && (vu->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+    int r;
+
+    msg->hdr.flags = VHOST_USER_VERSION | (ack ? VHOST_USER_NEED_REPLY_MASK : 0);
+
+    mutex_lock(&vu->mutex);
+    r = vhost_user_send(vu, msg, fds, nr_fds);
+    if (r < 0)
+        die("vhost-user: failed sending request %u: %s", request, strerror(-r));
+    if (reply || ack)
+        vhost_user_recv(vu, msg, request);
+    mutex_unlock(&vu->mutex);
+
+    if (ack && msg->payload.u64)
+        die("vhost-user: request %u failed", request);
+}
+
+static u64 vhost_user_get_u64(struct virtio_vhost_user *vu, u32 request) {
+    struct vhost_user_msg msg = {.hdr.request = request};
+
+    vhost_user_xfer(vu, &msg, NULL, 0, true);
+    if (msg.hdr.size != sizeof(msg.payload.u64))
+        die("vhost-user: invalid reply to request %u", request);
+
+    return msg.payload.u64;
+}
+
+static void vhost_user_set_u64(struct virtio_vhost_user *vu, u32 request, u64 val) {
+    struct vhost_user_msg msg = {
+        .hdr.request = request,
+        .hdr.size = sizeof(msg.payload.u64),
+        .payload.u64 = val,
+    };
+
+    vhost_user_xfer(vu, &msg, NULL, 0, false);
+}
+
+static void vhost_user_set_vring_fd(struct virtio_vhost_user *vu, u32 request, u32 index, int fd) {
+    struct vhost_user_msg msg = {
+        .hdr.request = request,
+        .hdr.size = sizeof(msg.payload.u64),
+        .payload.u64 = index & VHOST_USER_VRING_IDX_MASK,
+    };
+
+    vhost_user_xfer(vu, &msg, &fd, 1, false);
+}
+
+static void vhost_user_set_vring_state(struct virtio_vhost_user *vu, u32 request, u32 index, u32 num) {
+    struct vhost_user_msg msg = {
+        .hdr.request = request,
+        .hdr.size = sizeof(msg.payload.state),
+        .payload.state = {.index = index, .num = num},
+    };
+
+    vhost_user_xfer(vu, &msg, NULL, 0, false);
+}
+
+static void vhost_user_set_mem_table(struct kvm *kvm, struct virtio_vhost_user *vu) {
+    struct vhost_user_msg msg = {.hdr.request = VHOST_USER_SET_MEM_TABLE};
+    int fds[VHOST_USER_MAX_MEM_REGIONS];
+    struct kvm_mem_bank *bank;
+    u32 i = 0;
+
+    list_for_each_entry(bank, &kvm->mem_banks, list) {
+        if (bank->type != KVM_MEM_TYPE_RAM)
+            continue;
+
+        if (i == VHOST_USER_MAX_MEM_REGIONS)
+            die("vhost-user: too many memory regions");
+
+        msg.payload.mem.regions[i] = (struct vhost_user_mem_region){
+            .guest_phys_addr = bank->guest_phys_addr,
+            .memory_size = bank->size,
+            .userspace_addr = (unsigned long)bank->host_addr,
+            .mmap_offset = bank->host_addr - kvm->ram_fd_start,
+        };
+        fds[i++] = kvm->ram_fd;
+    }
+    msg.payload.mem.nregions = i;
+
+    msg.hdr.size = offsetof(struct vhost_user_mem_table, regions) + i * sizeof(struct vhost_user_mem_region);
+    vhost_user_xfer(vu, &msg, fds, i, false);
+}
+
+static void vhost_user_start_vring(struct kvm *kvm, struct virtio_vhost_user *vu, u32 index) {
+    struct virt_queue *queue = vu->vqs[index];
+    struct vhost_user_msg msg = {
+        .hdr.request = VHOST_USER_SET_VRING_ADDR,
+        .hdr.size = sizeof(msg.payload.addr),
+        .payload.addr =
+            {
+                .index = index,
+                .desc_user_addr = (u64)(unsigned long)queue->vring.desc,
+                .used_user_addr = (u64)(unsigned long)queue->vring.used,
+                .avail_user_addr = (u64)(unsigned long)queue->vring.avail,
+            },
+    };
+
+    if (queue->endian != VIRTIO_ENDIAN_HOST)
+        die("vhost-user requires the same endianness in guest and host");
+
+    vhost_user_set_vring_state(vu, VHOST_USER_SET_VRING_NUM, index, queue->vring.num);
+    vhost_user_set_vring_state(vu, VHOST_USER_SET_VRING_BASE, index, queue->last_avail_idx);
+    vhost_user_xfer(vu, &msg, NULL, 0, false);
+
+    vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_CALL, index, virtio_vhost_get_call_fd(kvm, queue));
+    if (vu->kick_fds[index])
+        vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_KICK, index, vu->kick_fds[index]);
+
+    /* With protocol features, rings start disabled */
+    if (vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+        vhost_user_set_vring_state(vu, VHOST_USER_SET_VRING_ENABLE, index, 1);
+}
+
+void virtio_vhost_user_init(struct kvm *kvm, struct virtio_vhost_user *vu, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct vhost_user_msg msg = {.hdr.request = VHOST_USER_SET_OWNER};
+    u64 protocol_features;
+
+    if (!kvm->ram_fd)
+        die("vhost-user requires guest memory shared with the backend");
+
+    mutex_init(&vu->mutex);
+    vu->max_queues = 1;
+
+    vu->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (vu->sock < 0)
+        die_perror("vhost-user: socket");
+
+    strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    if (connect(vu->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die_perror("vhost-user: connect");
+
+    vu->features = vhost_user_get_u64(vu, VHOST_USER_GET_FEATURES);
+    if (vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        protocol_features = vhost_user_get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES);
+        protocol_features &= VHOST_USER_PROTOCOL_FEATURES;
+        vhost_user_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES, protocol_features);
+        vu->protocol_features = protocol_features;
+
+        if (protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ))
+            vu->max_queues = vhost_user_get_u64(vu, VHOST_USER_GET_QUEUE_NUM);
+    }
+
+    vhost_user_xfer(vu, &msg, NULL, 0, false);
+}
+
+void virtio_vhost_user_exit(struct virtio_vhost_user *vu) {
+    if (vu->sock > 0)
+        close(vu->sock);
+    vu->sock = 0;
+}
+
+int virtio_vhost_user_get_config(struct virtio_vhost_user *vu, void *config, u32 size) {
+    struct vhost_user_msg msg = {
+        .hdr.request = VHOST_USER_GET_CONFIG,
+        .hdr.size = offsetof(struct vhost_user_config, region) + size,
+        .payload.config.size = size,
+    };
+
+    if (!(vu->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)))
+        return -ENOTSUP;
+
+    if (size > VHOST_USER_MAX_CONFIG_SIZE)
+        return -EINVAL;
+
+    vhost_user_xfer(vu, &msg, NULL, 0, true);
+    if (msg.payload.config.size != size)
+        return -EIO;
+
+    memcpy(config, msg.payload.config.region, size);
+    return 0;
+}
+
+void virtio_vhost_user_set_vring(struct kvm *kvm, struct virtio_vhost_user *vu, u32 index, struct virt_queue *queue) {
+    if (index >= VHOST_USER_MAX_QUEUES)
+        die("vhost-user: queue %u out of range", index);
+
+    queue->index = index;
+    vu->vqs[index] = queue;
+
+    if (vu->started)
+        vhost_user_start_vring(kvm, vu, index);
+}
+
+void virtio_vhost_user_set_vring_kick(struct virtio_vhost_user *vu, u32 index, int event_fd) {
+    if (index >= VHOST_USER_MAX_QUEUES)
+        die("vhost-user: queue %u out of range", index);
+
+    vu->kick_fds[index] = event_fd;
+
+    if (vu->started && vu->vqs[index])
+        vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_KICK, index, event_fd);
+}
+
+void virtio_vhost_user_reset_vring(struct kvm *kvm, struct virtio_vhost_user *vu, u32 index) {
+    struct vhost_user_msg msg = {
+        .hdr.request = VHOST_USER_GET_VRING_BASE,
+        .hdr.size = sizeof(msg.payload.state),
+        .payload.state.index = index,
+    };
+    struct virt_queue *queue;
+    u32 i;
+
+    if (index >= VHOST_USER_MAX_QUEUES || !vu->vqs[index])
+        return;
+
+    queue = vu->vqs[index];
+    vu->vqs[index] = NULL;
+    vu->kick_fds[index] = 0;
+
+    /* GET_VRING_BASE stops the ring in the backend */
+    if (vu->started)
+        vhost_user_xfer(vu, &msg, NULL, 0, true);
+
+    if (queue->irqfd)
+        virtio_vhost_put_call_fd(kvm, queue);
+
+    for (i = 0; i < VHOST_USER_MAX_QUEUES; i++) {
+        if (vu->vqs[i])
+            return;
+    }
+    vu->started = false;
+}
+
+void virtio_vhost_user_start(struct kvm *kvm, struct virtio_vhost_user *vu, u64 features) {
+    u32 i;
+
+    features &= vu->features;
+    features |= vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    /* As for vhost, there is no IOTLB behind VIRTIO_F_ACCESS_PLATFORM */
+    features &= ~(1ULL << VIRTIO_F_ACCESS_PLATFORM);
+    vhost_user_set_u64(vu, VHOST_USER_SET_FEATURES, features);
+    /* The backend maps guest RAM once it knows the negotiated features */
+    vhost_user_set_mem_table(kvm, vu);
+
+    for (i = 0; i < VHOST_USER_MAX_QUEUES; i++) {
+        if (vu->vqs[i])
+            vhost_user_start_vring(kvm, vu, i);
+    }
+
+    vu->started = true;
+}
@@ -82,6 +82,39 @@ static int virtio_vhost_get_irqfd(struct virt_queue *queue) {
     return queue->irqfd;
 }
 
+/*
+ * Return the eventfd a vhost backend signals the queue with. Until an irqfd
+ * route is set up by virtio_vhost_set_vring_irqfd(), it is polled by the IRQ
+ * worker which injects the interrupt from userspace.
+ */
+int virtio_vhost_get_call_fd(struct kvm *kvm, struct virt_queue *queue) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = queue,
+    };
+    int fd = virtio_vhost_get_irqfd(queue);
+
+    if (virtio_vhost_start_poll(kvm))
+        die("Unable to start vhost polling thread\n");
+
+    if (!queue->gsi && epoll_ctl(epoll.fd, EPOLL_CTL_ADD, fd, &event) < 0 && errno != EEXIST)
+        die_perror("EPOLL_CTL_ADD vhost call fd");
+
+    return fd;
+}
+
+void virtio_vhost_put_call_fd(struct kvm *kvm, struct virt_queue *queue) {
+    if (queue->gsi) {
+        irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
+        queue->gsi = 0;
+    }
+
+    epoll_ctl(epoll.fd, EPOLL_CTL_DEL, queue->irqfd, NULL);
+
+    close(queue->irqfd);
+    queue->irqfd = 0;
+}
+
 void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index, struct virt_queue *queue) {
     int r;
     struct vhost_vring_addr addr = {
@@ -93,11 +126,7 @@ void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index, struct vir
     struct vhost_vring_state state = {.index = index};
     struct vhost_vring_file file = {
         .index = index,
-        .fd = virtio_vhost_get_irqfd(queue),
-    };
-    struct epoll_event event = {
-        .events = EPOLLIN,
-        .data.ptr = queue,
+        .fd = virtio_vhost_get_call_fd(kvm, queue),
     };
 
     queue->index = index;
@@ -122,10 +151,6 @@ void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index, struct vir
     r = ioctl(vhost_fd, VHOST_SET_VRING_CALL, &file);
     if (r < 0)
         die_perror("VHOST_SET_VRING_CALL failed");
-
-    r = epoll_ctl(epoll.fd, EPOLL_CTL_ADD, file.fd, &event);
-    if (r < 0)
-        die_perror("EPOLL_CTL_ADD vhost call fd");
 }
 
 void virtio_vhost_set_vring_kick(struct kvm *kvm, int vhost_fd, u32 index, int event_fd) {
@@ -169,17 +194,10 @@ void virtio_vhost_reset_vring(struct kvm *kvm, int vhost_fd, u32 index, struct v
     if (!queue->irqfd)
         return;
 
-    if (queue->gsi) {
-        irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
-        queue->gsi = 0;
-    }
-
-    epoll_ctl(epoll.fd, EPOLL_CTL_DEL, queue->irqfd, NULL);
-
     if (ioctl(vhost_fd, VHOST_SET_VRING_CALL, &file))
         perror("SET_VRING_CALL");
-    close(queue->irqfd);
-    queue->irqfd = 0;
+
+    virtio_vhost_put_call_fd(kvm, queue);
 }
 
 int virtio_vhost_set_features(int vhost_fd, u64 features) {